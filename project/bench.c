@@ -0,0 +1,1111 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./bloom.h"
+#include "./comm.h"
+#include "./db.h"
+#include "./numa.h"
+#include "./parse.h"
+
+/*
+ * Micro-benchmarks of the database module, run in-process without the
+ * server or the network in the way:
+ *   bench writes [max threads] [ops per thread]
+ *       adds and then removes disjoint sets of random keys from 1, 2, 4,
+ *       ... max threads at once, reporting throughput of each phase.
+ *   bench lookups [max threads] [ops per thread]
+ *       queries random keys among a million 16-byte ids from 1, 2, 4, ...
+ *       max threads at once. Compare "bench" with "bench-fixed", the same
+ *       benchmark built with FIXED_KEYS, for strcmp() against integer keys.
+ *   bench parse [iterations]
+ *       times parse_command() on each kind of command line, in ns per
+ *       command, next to sscanf() splitting the same line.
+ *   bench numa [threads] [ops per thread]
+ *       loads keys from threads spread over the NUMA nodes, then has every
+ *       thread query the keys of one node's share of the keyspace, as a
+ *       client behind a router would, starting on the wrong node. Compares
+ *       one heap-allocated tree with trees split over the nodes (db_shard())
+ *       and reports throughput and the share of remote accesses.
+ *   bench rebalance [keys] [lookups]
+ *       loads random keys, times lookups from one thread, lets the
+ *       collector rebuild the tree (db_rebalance()) until a walk over it
+ *       finishes, and times the same lookups again.
+ *   bench bloom [keys] [lookups]
+ *       loads random keys with the Bloom filter on (bloom_init()) and
+ *       times queries of keys that are absent and of keys that are present,
+ *       from one thread, with the filter consulted and with it ignored.
+ *   bench stress [threads] [ops per thread] [keys] [seed] [rebalance] [bloom]
+ *       runs random adds, removes, queries and one-key transactions from
+ *       many threads at once, records when each was called and returned,
+ *       and checks that the history of every key is linearizable: that
+ *       some order of the operations, consistent with real time, explains
+ *       every result on a sequential model of the key, in which a
+ *       transaction only fails if a write of its key overlapped it. Two-key
+ *       transactions meanwhile transfer money between accounts, and audits
+ *       that read every account as of one snapshot check that none was
+ *       made or lost. The operations each
+ *       thread runs follow from the seed; build with "make bench-tsan" to
+ *       run it under ThreadSanitizer as well. A rebalance percent has the
+ *       collector rebuild the tree under the same load, and a
+ *       non-zero bloom has queries and removes go through the filter.
+ */
+
+#define KEYLEN 24
+
+#ifdef __SANITIZE_THREAD__
+// The first race ThreadSanitizer reports stops the run with a failure,
+// before it can be reported linearizable. A rebuild write-locks every node
+// of the subtree it replaces, more locks at once than the deadlock
+// detector can follow, so that one is off.
+const char *__tsan_default_options(void) {
+    return "halt_on_error=1:exitcode=66:detect_deadlocks=0";
+}
+#endif
+
+// Keys loaded before every run, so that writers descend a realistic depth.
+#define PRELOAD 100000
+
+typedef struct worker {
+    pthread_t thread;
+    int ops;
+    char (*keys)[KEYLEN];
+    pthread_barrier_t *start;
+    int phase;  // 0 adds, 1 removes
+} worker_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fills keys with n random keys, made unique by the tag. */
+static void make_keys(char (*keys)[KEYLEN], int n, int tag, unsigned int *seed) {
+    for (int i = 0; i < n; i++) {
+        snprintf(keys[i], KEYLEN, "%08x%08x-%d", rand_r(seed), rand_r(seed), tag);
+    }
+}
+
+static void *write_worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    pthread_barrier_wait(w->start);
+    for (int i = 0; i < w->ops; i++) {
+        if (w->phase == 0) {
+            db_add(w->keys[i], "value");
+        } else {
+            db_remove(w->keys[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Runs one phase on every worker at once and returns the elapsed time. */
+static double run_phase(worker_t *workers, int nthreads, int phase) {
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].phase = phase;
+        workers[t].start = &start;
+        int err;
+        if ((err = pthread_create(&workers[t].thread, 0, write_worker, &workers[t])))
+            handle_error_en(err, "pthread_create");
+    }
+    pthread_barrier_wait(&start);
+    double begin = now();
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double elapsed = now() - begin;
+    pthread_barrier_destroy(&start);
+    return elapsed;
+}
+
+static void bench_writes(int max_threads, int ops) {
+    unsigned int seed = 42;
+    char (*preload)[KEYLEN] = malloc(sizeof(*preload) * PRELOAD);
+    worker_t *workers = calloc(max_threads, sizeof(worker_t));
+    if (!preload || !workers) {
+        perror("malloc");
+        exit(1);
+    }
+    make_keys(preload, PRELOAD, -1, &seed);
+    for (int t = 0; t < max_threads; t++) {
+        if (!(workers[t].keys = malloc(sizeof(*workers[t].keys) * ops))) {
+            perror("malloc");
+            exit(1);
+        }
+        workers[t].ops = ops;
+        make_keys(workers[t].keys, ops, t, &seed);
+    }
+
+    printf("%8s %14s %14s\n", "threads", "adds/s", "removes/s");
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        db_gc_start();
+        for (int i = 0; i < PRELOAD; i++) {
+            db_add(preload[i], "value");
+        }
+        double add = run_phase(workers, nthreads, 0);
+        double remove = run_phase(workers, nthreads, 1);
+        printf("%8d %14.0f %14.0f\n", nthreads, nthreads * ops / add,
+               nthreads * ops / remove);
+        db_gc_stop();
+        db_cleanup();
+    }
+
+    for (int t = 0; t < max_threads; t++) {
+        free(workers[t].keys);
+    }
+    free(workers);
+    free(preload);
+}
+
+// Keys in the tree for the lookups benchmark.
+#define LOOKUP_KEYS 1000000
+
+/* A random id below 10^14, for id_key(). */
+static unsigned long random_id(unsigned int *seed) {
+    unsigned long id = (unsigned long)rand_r(seed) << 16 ^ rand_r(seed);
+    return id % 100000000000000UL;
+}
+
+/* Writes the key of id into key: 16 bytes with a common prefix, as ids
+ * usually have, so that bench-fixed takes them as well. */
+static void id_key(char *key, unsigned long id) {
+    snprintf(key, KEYLEN, "id%014lu", id);
+}
+
+typedef struct lookup_worker {
+    pthread_t thread;
+    int ops;
+    unsigned int seed;
+    char (*keys)[KEYLEN];
+    pthread_barrier_t *start;
+    long found;
+} lookup_worker_t;
+
+static void *lookup_worker(void *arg) {
+    lookup_worker_t *w = (lookup_worker_t *)arg;
+    pthread_barrier_wait(w->start);
+    for (int i = 0; i < w->ops; i++) {
+        value_t *value = db_query(w->keys[rand_r(&w->seed) % LOOKUP_KEYS]);
+        if (value) {
+            w->found++;
+            value_release(value);
+        }
+    }
+    return NULL;
+}
+
+static void bench_lookups(int max_threads, int ops) {
+    unsigned int seed = 42;
+    char (*keys)[KEYLEN] = malloc(sizeof(*keys) * LOOKUP_KEYS);
+    lookup_worker_t *workers = calloc(max_threads, sizeof(lookup_worker_t));
+    if (!keys || !workers) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < LOOKUP_KEYS; i++)
+        id_key(keys[i], random_id(&seed));
+    db_gc_start();
+    for (int i = 0; i < LOOKUP_KEYS; i++)
+        db_add(keys[i], "value");
+#ifdef FIXED_KEYS
+    printf("%ld keys, compared as integers\n", db_size());
+#else
+    printf("%ld keys, compared with strcmp()\n", db_size());
+#endif
+    printf("%8s %14s\n", "threads", "lookups/s");
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, nthreads + 1);
+        for (int t = 0; t < nthreads; t++) {
+            workers[t].ops = ops;
+            workers[t].seed = t + 1;
+            workers[t].keys = keys;
+            workers[t].start = &start;
+            int err;
+            if ((err = pthread_create(&workers[t].thread, 0, lookup_worker, &workers[t])))
+                handle_error_en(err, "pthread_create");
+        }
+        pthread_barrier_wait(&start);
+        double begin = now();
+        for (int t = 0; t < nthreads; t++) {
+            pthread_join(workers[t].thread, NULL);
+        }
+        double elapsed = now() - begin;
+        pthread_barrier_destroy(&start);
+        printf("%8d %14.0f\n", nthreads, nthreads * ops / elapsed);
+    }
+    db_gc_stop();
+    db_cleanup();
+    free(workers);
+    free(keys);
+}
+
+/* Returns ns per call of parse_command() on line, or of sscanf() if
+ * scan is set, each on a fresh copy of line, less the copying. */
+static double time_parse(const char *line, size_t len, char *buf, int iterations, int scan) {
+    static char key[MAX_KEYLEN + 1];
+    static char value[MAX_VALUELEN + 1];
+    command_t cmd;
+    char op;
+    double begin = now();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(buf, line, len + 1);
+    }
+    double copy = now() - begin;
+    begin = now();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(buf, line, len + 1);
+        if (scan) {
+            sscanf(buf, "%c %4096s %1048576s", &op, key, value);
+        } else {
+            parse_command(buf, &cmd);
+        }
+    }
+    return (now() - begin - copy) * 1e9 / iterations;
+}
+
+static void bench_parse(int iterations) {
+    static const struct {
+        const char *name;
+        char op;
+        int words;
+        size_t value_len;
+    } kinds[] = {
+        {"query", 'q', 1, 0},
+        {"remove", 'd', 1, 0},
+        {"add", 'a', 2, 16},
+        {"add 1 KB", 'a', 2, 1024},
+        {"add 64 KB", 'a', 2, 64 << 10},
+        {"keys of", 'v', 1, 16},
+    };
+    char *line = malloc(MAX_VALUELEN + 64);
+    char *buf = malloc(MAX_VALUELEN + 64);
+    if (!line || !buf) {
+        perror("malloc");
+        exit(1);
+    }
+    printf("%-10s %10s %12s %12s\n", "command", "bytes", "parse ns", "sscanf ns");
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        size_t len;
+        if (kinds[k].op == 'v') {
+            len = sprintf(line, "v ");
+        } else {
+            len = sprintf(line, "%c user:0000012345 ", kinds[k].op);
+        }
+        if (kinds[k].value_len) {
+            memset(line + len, 'x', kinds[k].value_len);
+            len += kinds[k].value_len;
+        }
+        line[len++] = '\n';
+        line[len] = '\0';
+        // Fewer rounds for longer lines, so that every kind takes about as long.
+        int rounds = iterations / (1 + len / 64);
+        if (rounds < 10)
+            rounds = 10;
+        printf("%-10s %10zu %12.1f %12.1f\n", kinds[k].name, len,
+               time_parse(line, len, buf, rounds, 0), time_parse(line, len, buf, rounds, 1));
+    }
+    free(buf);
+    free(line);
+}
+
+typedef struct numa_worker {
+    pthread_t thread;
+    int node;  // Where the worker runs
+    int ops;
+    char (*keys)[KEYLEN];  // Loaded by the worker
+    char (**queries)[KEYLEN];  // Queried by the worker
+    int num_queries;
+    pthread_barrier_t *start;
+    int phase;  // 0 loads, 1 queries
+} numa_worker_t;
+
+static void *numa_worker(void *arg) {
+    numa_worker_t *w = (numa_worker_t *)arg;
+    unsigned int seed = w->node + 1;
+    numa_pin(w->node);
+    pthread_barrier_wait(w->start);
+    for (int i = 0; i < w->ops; i++) {
+        if (w->phase == 0) {
+            db_add(w->keys[i], "value");
+            continue;
+        }
+        value_t *value = db_query(*w->queries[rand_r(&seed) % w->num_queries]);
+        if (value)
+            value_release(value);
+        if (i % 1024 == 1023)
+            numa_follow();
+    }
+    numa_follow();
+    return NULL;
+}
+
+/* Runs one phase of the numa benchmark and returns the elapsed time. */
+static double run_numa_phase(numa_worker_t *workers, int nthreads, int phase) {
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].phase = phase;
+        workers[t].start = &start;
+        int err;
+        if ((err = pthread_create(&workers[t].thread, 0, numa_worker, &workers[t])))
+            handle_error_en(err, "pthread_create");
+    }
+    pthread_barrier_wait(&start);
+    double begin = now();
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double elapsed = now() - begin;
+    pthread_barrier_destroy(&start);
+    return elapsed;
+}
+
+static void bench_numa(int nthreads, int ops) {
+    unsigned int seed = 42;
+    int nodes = numa_nodes();
+    int total = nthreads * ops;
+    char (*keys)[KEYLEN] = malloc(sizeof(*keys) * total);
+    char (**by_node)[KEYLEN] = malloc(sizeof(*by_node) * total);
+    int *first = calloc(nodes + 1, sizeof(int));
+    numa_worker_t *workers = calloc(nthreads, sizeof(numa_worker_t));
+    if (!keys || !by_node || !first || !workers) {
+        perror("malloc");
+        exit(1);
+    }
+    make_keys(keys, total, 0, &seed);
+
+    // Group the keys by the node their tree lives on once split; with a
+    // single node there is only the one tree.
+    int *owner = malloc(sizeof(int) * total);
+    if (!owner) {
+        perror("malloc");
+        exit(1);
+    }
+    db_shard(0);
+    for (int i = 0; i < total; i++) {
+        owner[i] = db_key_node(keys[i]) < 0 ? 0 : db_key_node(keys[i]);
+        first[owner[i] + 1]++;
+    }
+    for (int node = 0; node < nodes; node++)
+        first[node + 1] += first[node];
+    int *fill = calloc(nodes, sizeof(int));
+    if (!fill) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < total; i++)
+        by_node[first[owner[i]] + fill[owner[i]]++] = &keys[i];
+    free(fill);
+    free(owner);
+
+    printf("%d NUMA node(s), %d threads\n", nodes, nthreads);
+    printf("%8s %8s %14s %10s\n", "trees", "memory", "queries/s", "remote");
+    for (int split = 0; split < 2; split++) {
+        int trees = db_shard(split ? 0 : 1);
+        db_gc_start();
+        for (int t = 0; t < nthreads; t++) {
+            workers[t].node = t % nodes;
+            workers[t].ops = ops;
+            workers[t].keys = keys + t * ops;
+        }
+        run_numa_phase(workers, nthreads, 0);
+        for (int t = 0; t < nthreads; t++) {
+            // Serves the keys of one node, but starts out on the next one.
+            int node = t % nodes;
+            workers[t].queries = by_node + first[node];
+            workers[t].num_queries = first[node + 1] - first[node];
+            workers[t].node = (node + 1) % nodes;
+            if (workers[t].num_queries == 0) {
+                workers[t].queries = by_node;
+                workers[t].num_queries = total;
+            }
+        }
+        unsigned long local0, remote0, local1, remote1;
+        numa_counts(&local0, &remote0);
+        double elapsed = run_numa_phase(workers, nthreads, 1);
+        numa_counts(&local1, &remote1);
+        unsigned long local = local1 - local0;
+        unsigned long remote = remote1 - remote0;
+        printf("%8d %8s %14.0f %9.1f%%\n", trees, trees > 1 ? "per-node" : "heap",
+               total / elapsed, local + remote ? 100.0 * remote / (local + remote) : 0.0);
+        db_gc_stop();
+        db_cleanup();
+    }
+
+    free(workers);
+    free(first);
+    free(by_node);
+    free(keys);
+}
+
+/* One operation of the stress history, on one key. */
+typedef struct op_record {
+    int key;
+    char kind;  // 'a' add, 'd' remove, 'q' query, 'r' replace in a transaction
+    int arg;  // The value written, as a number unique to the operation
+    int result;  // What db_add(), db_remove() or txn_commit() returned; the value found
+    unsigned long call;  // Logical times of the call and the return
+    unsigned long ret;
+    int contended;  // A write of the key that succeeded overlapped it
+} op_record_t;
+
+// Accounts that transfers move money between, outside the keys of the
+// histories, and the balance each starts with.
+#define STRESS_ACCOUNTS 8
+#define STRESS_BALANCE 1000
+
+typedef struct stress_worker {
+    pthread_t thread;
+    int id;
+    int ops;
+    int keys;
+    unsigned int seed;
+    op_record_t *history;
+    unsigned long transfers;  // Committed
+    unsigned long transfer_conflicts;
+    unsigned long audits;
+    unsigned long bad_audits;  // That found money made or lost...
+    long bad_sum;  // ...such as this sum
+} stress_worker_t;
+
+static unsigned long stress_clock;
+
+static void stress_key(char *buf, int key) {
+    snprintf(buf, KEYLEN, "key%d", key);
+}
+
+static void account_key(char *buf, int account) {
+    snprintf(buf, KEYLEN, "acct%d", account);
+}
+
+/* Returns the number a stress value stands for, or 0 for no value. */
+static int stress_value(value_t *value) {
+    int n = value ? atoi(value->data) : 0;
+    if (value)
+        value_release(value);
+    return n;
+}
+
+/* Moves up to 10 from one random account to another in one transaction.
+ * Returns what txn_commit() returned. */
+static int stress_transfer(stress_worker_t *w) {
+    char from[KEYLEN];
+    char to[KEYLEN];
+    char balance[KEYLEN];
+    value_t *value = NULL;
+    int a = rand_r(&w->seed) % STRESS_ACCOUNTS;
+    int b = (a + 1 + rand_r(&w->seed) % (STRESS_ACCOUNTS - 1)) % STRESS_ACCOUNTS;
+    int amount = 1 + rand_r(&w->seed) % 10;
+    txn_t *txn = txn_begin();
+    if (txn == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    account_key(from, a);
+    account_key(to, b);
+    txn_query(txn, from, &value);
+    int from_balance = stress_value(value);
+    value = NULL;
+    txn_query(txn, to, &value);
+    int to_balance = stress_value(value);
+    if (amount > from_balance)
+        amount = from_balance;
+    // Lets other threads commit in between, even on one CPU.
+    if (rand_r(&w->seed) % 4 == 0)
+        sched_yield();
+    snprintf(balance, KEYLEN, "%d", from_balance - amount);
+    txn_remove(txn, from);
+    txn_add(txn, from, balance);
+    snprintf(balance, KEYLEN, "%d", to_balance + amount);
+    txn_remove(txn, to);
+    txn_add(txn, to, balance);
+    return txn_commit(txn);
+}
+
+/* Returns the sum of the accounts in one snapshot of the database, as
+ * db_dump() writes it. */
+static long stress_audit(void) {
+    char *dump = NULL;
+    size_t len = 0;
+    long sum = 0;
+    FILE *out = open_memstream(&dump, &len);
+    if (out == NULL || db_dump(out) < 0) {
+        perror("db_dump");
+        exit(1);
+    }
+    fclose(out);
+    for (char *line = dump; line && *line;) {
+        long balance;
+        if (sscanf(line, "a acct%*d %ld", &balance) == 1)
+            sum += balance;
+        line = strchr(line, '\n');
+        line = line ? line + 1 : NULL;
+    }
+    free(dump);
+    return sum;
+}
+
+static void *stress_worker(void *arg) {
+    stress_worker_t *w = (stress_worker_t *)arg;
+    char key[KEYLEN];
+    char value[KEYLEN];
+    for (int i = 0; i < w->ops; i++) {
+        op_record_t *op = &w->history[i];
+        int r = rand_r(&w->seed) % 10;
+        op->key = rand_r(&w->seed) % w->keys;
+        op->kind = r < 4 ? 'q' : r < 7 ? 'a' : r < 9 ? 'd' : 'r';
+        op->arg = w->id * w->ops + i + 1;
+        stress_key(key, op->key);
+        snprintf(value, KEYLEN, "%d", op->arg);
+        if (rand_r(&w->seed) % 16 == 0)
+            sched_yield();
+        op->call = __atomic_fetch_add(&stress_clock, 1, __ATOMIC_SEQ_CST);
+        if (op->kind == 'q') {
+            op->result = stress_value(db_query(key));
+        } else if (op->kind == 'a') {
+            op->result = db_add(key, value);
+        } else if (op->kind == 'd') {
+            op->result = db_remove(key);
+        } else {
+            txn_t *txn = txn_begin();
+            if (txn == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            txn_remove(txn, key);
+            txn_add(txn, key, value);
+            if (rand_r(&w->seed) % 4 == 0)
+                sched_yield();
+            op->result = txn_commit(txn);
+        }
+        op->ret = __atomic_fetch_add(&stress_clock, 1, __ATOMIC_SEQ_CST);
+
+        // Transfers move money between the accounts, which audits, reading
+        // them as of one snapshot, must always find all of.
+        if (rand_r(&w->seed) % 8 == 0) {
+            int result = stress_transfer(w);
+            if (result < 0) {
+                fprintf(stderr, "transfer failed: %d\n", result);
+                exit(1);
+            }
+            w->transfers += result;
+            w->transfer_conflicts += result == 0;
+        }
+        // Audits dump every key, so the more keys, the fewer of them.
+        if (i % (64 * (1 + w->keys / 256)) == 0) {
+            long sum = stress_audit();
+            w->audits++;
+            if (sum != STRESS_ACCOUNTS * STRESS_BALANCE && w->bad_audits++ == 0)
+                w->bad_sum = sum;
+        }
+    }
+    return NULL;
+}
+
+/* Applies op to a key holding state (0 for none). Returns whether op's
+ * result is what the key would have given, and the state after it. */
+static int model_apply(const op_record_t *op, int state, int *next) {
+    *next = state;
+    switch (op->kind) {
+    case 'q':
+        return op->result == state;
+    case 'a':
+        if (state == 0 && op->result == 1)
+            *next = op->arg;
+        return op->result == (state == 0);
+    case 'd':
+        if (state != 0 && op->result == 1)
+            *next = 0;
+        return op->result == (state != 0);
+    default:
+        // A transaction may lose to a write of its key that overlapped it,
+        // and then changes nothing, but only to one.
+        if (op->result == 1)
+            *next = op->arg;
+        return op->result == 1 || (op->result == 0 && op->contended);
+    }
+}
+
+/* A call or return in the history of one key, linked in time order. */
+typedef struct lin_event {
+    int op;
+    unsigned long time;
+    struct lin_event *ret;  // For a call, its return; NULL for a return
+    struct lin_event *prev;
+    struct lin_event *next;
+} lin_event_t;
+
+/* The (linearized operations, state) pairs already tried, which cannot
+ * lead to a linearization if they are reached again. */
+typedef struct lin_cache {
+    unsigned long *slots;  // words bitset words then the state, per slot
+    char *used;
+    size_t cap;
+    size_t len;
+    int words;
+} lin_cache_t;
+
+static size_t lin_hash(const unsigned long *bits, int words, int state) {
+    size_t h = state * 0x9e3779b97f4a7c15UL;
+    for (int i = 0; i < words; i++)
+        h = (h ^ bits[i]) * 0x100000001b3UL;
+    return h;
+}
+
+/* Adds (bits, state) to cache. Returns 0 if it was there already. */
+static int lin_cache_add(lin_cache_t *cache, const unsigned long *bits, int state) {
+    int stride = cache->words + 1;
+    if (2 * (cache->len + 1) > cache->cap) {
+        lin_cache_t grown = {NULL, NULL, cache->cap ? 2 * cache->cap : 1024, 0, cache->words};
+        grown.slots = malloc(sizeof(unsigned long) * stride * grown.cap);
+        grown.used = calloc(grown.cap, 1);
+        if (!grown.slots || !grown.used) {
+            perror("malloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < cache->cap; i++) {
+            if (cache->used[i]) {
+                unsigned long *slot = &cache->slots[i * stride];
+                lin_cache_add(&grown, slot, (int)slot[cache->words]);
+            }
+        }
+        free(cache->slots);
+        free(cache->used);
+        *cache = grown;
+    }
+    size_t i = lin_hash(bits, cache->words, state) & (cache->cap - 1);
+    for (; cache->used[i]; i = (i + 1) & (cache->cap - 1)) {
+        unsigned long *slot = &cache->slots[i * stride];
+        if (slot[cache->words] == (unsigned long)state &&
+            memcmp(slot, bits, sizeof(unsigned long) * cache->words) == 0)
+            return 0;
+    }
+    memcpy(&cache->slots[i * stride], bits, sizeof(unsigned long) * cache->words);
+    cache->slots[i * stride + cache->words] = state;
+    cache->used[i] = 1;
+    cache->len++;
+    return 1;
+}
+
+static int lin_event_cmp(const void *a, const void *b) {
+    unsigned long x = ((const lin_event_t *)a)->time;
+    unsigned long y = ((const lin_event_t *)b)->time;
+    return (x > y) - (x < y);
+}
+
+/* Checks that the n operations on one key, starting from no value, are
+ * linearizable, by Wing and Gong's search with Lowe's memoization: take
+ * the earliest pending call that the model accepts next, and back up
+ * when a return comes up before its call could be taken. */
+static int linearizable(op_record_t **ops, int n) {
+    lin_event_t *events = malloc(sizeof(lin_event_t) * (2 * n + 1));
+    lin_event_t **calls = malloc(sizeof(lin_event_t *) * n);
+    int words = (n + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long));
+    unsigned long *bits = calloc(words ? words : 1, sizeof(unsigned long));
+    lin_event_t **stack = malloc(sizeof(lin_event_t *) * n);
+    int *states = malloc(sizeof(int) * n);
+    lin_cache_t cache = {NULL, NULL, 0, 0, words};
+    if (!events || !calls || !bits || !stack || !states) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        events[2 * i] = (lin_event_t){i, ops[i]->call, NULL, NULL, NULL};
+        events[2 * i + 1] = (lin_event_t){i, ops[i]->ret, NULL, NULL, NULL};
+    }
+    qsort(events, 2 * n, sizeof(lin_event_t), lin_event_cmp);
+    lin_event_t *head = &events[2 * n];
+    lin_event_t *prev = head;
+    for (int i = 0; i < 2 * n; i++) {
+        if (events[i].time == ops[events[i].op]->call) {
+            calls[events[i].op] = &events[i];
+        } else {
+            calls[events[i].op]->ret = &events[i];
+        }
+        events[i].prev = prev;
+        prev->next = &events[i];
+        prev = &events[i];
+    }
+    prev->next = head;
+    head->prev = prev;
+
+    int depth = 0;
+    int state = 0;
+    int ok = 1;
+    lin_event_t *e = head->next;
+    while (head->next != head) {
+        if (e->ret) {
+            int next;
+            int op = e->op;
+            if (model_apply(ops[op], state, &next)) {
+                bits[op / (8 * sizeof(unsigned long))] |= 1UL << (op % (8 * sizeof(unsigned long)));
+                if (lin_cache_add(&cache, bits, next)) {
+                    stack[depth] = e;
+                    states[depth++] = state;
+                    state = next;
+                    // Lift the operation out of the history.
+                    e->prev->next = e->next;
+                    e->next->prev = e->prev;
+                    e->ret->prev->next = e->ret->next;
+                    e->ret->next->prev = e->ret->prev;
+                    e = head->next;
+                    continue;
+                }
+                bits[op / (8 * sizeof(unsigned long))] &= ~(1UL << (op % (8 * sizeof(unsigned long))));
+            }
+            e = e->next;
+        } else {
+            if (depth == 0) {
+                ok = 0;
+                break;
+            }
+            // Put the last operation taken back and try a later one instead.
+            e = stack[--depth];
+            state = states[depth];
+            bits[e->op / (8 * sizeof(unsigned long))] &= ~(1UL << (e->op % (8 * sizeof(unsigned long))));
+            e->ret->prev->next = e->ret;
+            e->ret->next->prev = e->ret;
+            e->prev->next = e;
+            e->next->prev = e;
+            e = e->next;
+        }
+    }
+    free(cache.slots);
+    free(cache.used);
+    free(states);
+    free(stack);
+    free(bits);
+    free(calls);
+    free(events);
+    return ok;
+}
+
+/* Returns lookups per second of ops random keys among n from one thread,
+ * of which expected must find their key. */
+static double time_lookups(char (*keys)[KEYLEN], int n, int ops, int expected) {
+    unsigned int seed = 7;
+    long found = 0;
+    double begin = now();
+    for (int i = 0; i < ops; i++) {
+        value_t *value = db_query(keys[rand_r(&seed) % n]);
+        if (value) {
+            found++;
+            value_release(value);
+        }
+    }
+    double elapsed = now() - begin;
+    if (found != expected) {
+        fprintf(stderr, "%ld of %d lookups found their key\n", found, ops);
+        exit(1);
+    }
+    return ops / elapsed;
+}
+
+static void bench_rebalance(int nkeys, int ops) {
+    unsigned int seed = 42;
+    char (*keys)[KEYLEN] = malloc(sizeof(*keys) * nkeys);
+    if (!keys) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < nkeys; i++)
+        id_key(keys[i], random_id(&seed));
+    db_gc_start();
+    for (int i = 0; i < nkeys; i++)
+        db_add(keys[i], "value");
+    printf("%ld keys in arrival order: %.0f lookups/s\n", db_size(),
+           time_lookups(keys, nkeys, ops, ops));
+    unsigned long walks = db_rebalance(100);
+    double begin = now();
+    while (db_rebalance(100) == walks)
+        usleep(1000);
+    double elapsed = now() - begin;
+    printf("rebuilt in %.2fs: %.0f lookups/s\n", elapsed, time_lookups(keys, nkeys, ops, ops));
+    db_gc_stop();
+    char stats[1024];
+    db_stats(stats, sizeof(stats));
+    printf("%s\n", stats);
+    db_rebalance(0);
+    db_cleanup();
+    free(keys);
+}
+
+static void bench_bloom(int nkeys, int ops) {
+    unsigned int seed = 42;
+    char (*present)[KEYLEN] = malloc(sizeof(*present) * nkeys);
+    char (*absent)[KEYLEN] = malloc(sizeof(*absent) * nkeys);
+    if (!present || !absent) {
+        perror("malloc");
+        exit(1);
+    }
+    // Even ids are loaded and odd ones are not, so that absent keys end
+    // their descent as deep in the tree as present ones.
+    for (int i = 0; i < nkeys; i++) {
+        unsigned long id = random_id(&seed) & ~1UL;
+        id_key(present[i], id);
+        id_key(absent[i], id + 1);
+    }
+    if (bloom_init(nkeys) < 0) {
+        perror("bloom_init");
+        exit(1);
+    }
+    for (int i = 0; i < nkeys; i++)
+        db_add(present[i], "value");
+    for (int on = 0; on <= 1; on++) {
+        // The filter keeps counting while it is ignored; nothing is written
+        // here anyway.
+        bloom_enabled = on;
+        printf("%ld keys, filter %s: absent %.1f ns/query, present %.1f ns/query\n",
+               db_size(), on ? "on " : "off", 1e9 / time_lookups(absent, nkeys, ops, 0),
+               1e9 / time_lookups(present, nkeys, ops, ops));
+    }
+    char stats[1024];
+    db_stats(stats, sizeof(stats));
+    printf("%s\n", stats);
+    db_cleanup();
+    bloom_cleanup();
+    free(present);
+    free(absent);
+}
+
+static void bench_stress(int nthreads, int ops, int keys, unsigned int seed, int rebalance,
+                         int bloom) {
+    stress_worker_t *workers = calloc(nthreads, sizeof(stress_worker_t));
+    int *counts = calloc(keys, sizeof(int));
+    if (!workers || !counts) {
+        perror("malloc");
+        exit(1);
+    }
+    db_rebalance(rebalance);
+    if (bloom && bloom_init(keys) < 0) {
+        perror("bloom_init");
+        exit(1);
+    }
+    db_gc_start();
+    for (int a = 0; a < STRESS_ACCOUNTS; a++) {
+        char key[KEYLEN];
+        char balance[KEYLEN];
+        account_key(key, a);
+        snprintf(balance, KEYLEN, "%d", STRESS_BALANCE);
+        db_add(key, balance);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        workers[t].id = t;
+        workers[t].ops = ops;
+        workers[t].keys = keys;
+        workers[t].seed = seed * 1000003 + t;
+        if (!(workers[t].history = malloc(sizeof(op_record_t) * ops))) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    double begin = now();
+    for (int t = 0; t < nthreads; t++) {
+        int err;
+        if ((err = pthread_create(&workers[t].thread, 0, stress_worker, &workers[t])))
+            handle_error_en(err, "pthread_create");
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    double elapsed = now() - begin;
+
+    // The final contents close every key's history, once nothing runs.
+    op_record_t *final = calloc(keys, sizeof(op_record_t));
+    if (!final) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int k = 0; k < keys; k++) {
+        char key[KEYLEN];
+        stress_key(key, k);
+        final[k].key = k;
+        final[k].kind = 'q';
+        final[k].call = __atomic_fetch_add(&stress_clock, 1, __ATOMIC_SEQ_CST);
+        final[k].result = stress_value(db_query(key));
+        final[k].ret = __atomic_fetch_add(&stress_clock, 1, __ATOMIC_SEQ_CST);
+        counts[k] = 1;
+    }
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < ops; i++)
+            counts[workers[t].history[i].key]++;
+    }
+    int failed = 0;
+    for (int k = 0; k < keys && !failed; k++) {
+        op_record_t **history = malloc(sizeof(op_record_t *) * counts[k]);
+        int n = 0;
+        if (!history) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int t = 0; t < nthreads; t++) {
+            for (int i = 0; i < ops; i++) {
+                if (workers[t].history[i].key == k)
+                    history[n++] = &workers[t].history[i];
+            }
+        }
+        history[n++] = &final[k];
+        for (int i = 0; i < n; i++) {
+            op_record_t *op = history[i];
+            for (int j = 0; j < n && op->kind == 'r' && op->result == 0 && !op->contended; j++) {
+                op_record_t *other = history[j];
+                op->contended = other != op && other->kind != 'q' && other->result == 1 &&
+                                other->call < op->ret && other->ret > op->call;
+            }
+        }
+        if (!linearizable(history, n)) {
+            failed = 1;
+            printf("key%d: history not linearizable (seed %u):\n", k, seed);
+            for (int i = 0; i < n; i++) {
+                printf("  [%lu, %lu] %c %d -> %d\n", history[i]->call, history[i]->ret,
+                       history[i]->kind, history[i]->arg, history[i]->result);
+            }
+        }
+        free(history);
+    }
+
+    unsigned long transfers = 0, conflicts = 0, audits = 0;
+    long sum = 0;
+    for (int t = 0; t < nthreads; t++) {
+        transfers += workers[t].transfers;
+        conflicts += workers[t].transfer_conflicts;
+        audits += workers[t].audits;
+        if (workers[t].bad_audits && !failed) {
+            failed = 1;
+            printf("%lu audits saw the accounts sum to something else, such as %ld, not %d "
+                   "(seed %u)\n",
+                   workers[t].bad_audits, workers[t].bad_sum, STRESS_ACCOUNTS * STRESS_BALANCE,
+                   seed);
+        }
+    }
+    for (int a = 0; a < STRESS_ACCOUNTS; a++) {
+        char key[KEYLEN];
+        account_key(key, a);
+        sum += stress_value(db_query(key));
+    }
+    if (sum != STRESS_ACCOUNTS * STRESS_BALANCE && !failed) {
+        failed = 1;
+        printf("the accounts sum to %ld, not %d, at the end (seed %u)\n", sum,
+               STRESS_ACCOUNTS * STRESS_BALANCE, seed);
+    }
+    db_gc_stop();
+    char stats[1024];
+    db_stats(stats, sizeof(stats));
+    printf("%d threads, %d operations on %d keys in %.2fs, seed %u: %s\n"
+           "%lu transfers (%lu more conflicted), %lu audits\n%s\n",
+           nthreads, nthreads * ops, keys, elapsed, seed, failed ? "FAILED" : "linearizable",
+           transfers, conflicts, audits, stats);
+    db_rebalance(0);
+    db_cleanup();
+    bloom_cleanup();
+    for (int t = 0; t < nthreads; t++) {
+        free(workers[t].history);
+    }
+    free(final);
+    free(counts);
+    free(workers);
+    if (failed)
+        exit(1);
+}
+
+static void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s writes [<max threads> [<ops per thread>]]\n"
+            "       %s lookups [<max threads> [<ops per thread>]]\n"
+            "       %s parse [<iterations>]\n"
+            "       %s numa [<threads> [<ops per thread>]]\n"
+            "       %s rebalance [<keys> [<lookups>]]\n"
+            "       %s bloom [<keys> [<lookups>]]\n"
+            "       %s stress [<threads> [<ops per thread> [<keys> [<seed> [<rebalance percent> "
+            "[<bloom>]]]]]]\n",
+            cmd, cmd, cmd, cmd, cmd, cmd, cmd);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage_error(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "writes") == 0) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : 64;
+        int ops = argc > 3 ? atoi(argv[3]) : 20000;
+        if (max_threads < 1 || ops < 1) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        bench_writes(max_threads, ops);
+        return 0;
+    }
+    if (strcmp(argv[1], "lookups") == 0) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+        int ops = argc > 3 ? atoi(argv[3]) : 1000000;
+        if (max_threads < 1 || ops < 1) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        bench_lookups(max_threads, ops);
+        return 0;
+    }
+    if (strcmp(argv[1], "parse") == 0) {
+        int iterations = argc > 2 ? atoi(argv[2]) : 2000000;
+        if (iterations < 1) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        bench_parse(iterations);
+        return 0;
+    }
+    if (strcmp(argv[1], "numa") == 0) {
+        int nthreads = argc > 2 ? atoi(argv[2]) : 2 * numa_nodes();
+        int ops = argc > 3 ? atoi(argv[3]) : 200000;
+        if (nthreads < 1 || ops < 1) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        bench_numa(nthreads, ops);
+        return 0;
+    }
+    if (strcmp(argv[1], "stress") == 0) {
+        int nthreads = argc > 2 ? atoi(argv[2]) : 16;
+        int ops = argc > 3 ? atoi(argv[3]) : 20000;
+        int keys = argc > 4 ? atoi(argv[4]) : 256;
+        unsigned int seed = argc > 5 ? strtoul(argv[5], NULL, 10) : 1;
+        int rebalance = argc > 6 ? atoi(argv[6]) : 0;
+        int bloom = argc > 7 ? atoi(argv[7]) : 0;
+        if (nthreads < 1 || ops < 1 || keys < 1 || rebalance < 0) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        bench_stress(nthreads, ops, keys, seed, rebalance, bloom);
+        return 0;
+    }
+    if (strcmp(argv[1], "rebalance") == 0) {
+        int keys = argc > 2 ? atoi(argv[2]) : 1000000;
+        int ops = argc > 3 ? atoi(argv[3]) : 2000000;
+        if (keys < 1 || ops < 1) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        bench_rebalance(keys, ops);
+        return 0;
+    }
+    if (strcmp(argv[1], "bloom") == 0) {
+        int keys = argc > 2 ? atoi(argv[2]) : 1000000;
+        int ops = argc > 3 ? atoi(argv[3]) : 2000000;
+        if (keys < 1 || ops < 1) {
+            usage_error(argv[0]);
+            return 1;
+        }
+        bench_bloom(keys, ops);
+        return 0;
+    }
+    usage_error(argv[0]);
+    return 1;
+}
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./bloom.h"
+
+int bloom_enabled;
+
+// Counters per block: one cache line of them.
+#define BLOOM_BLOCK 64
+
+// Counters per key the filter is sized for
+#define BLOOM_PER_KEY 12
+
+// Counters a key counts in, all in its block
+#define BLOOM_PROBES 6
+
+// A counter at this value stays there.
+#define BLOOM_STUCK 255
+
+// Sets of statistics counters, so that lookups from many threads rarely
+// share a cache line. Threads that do share one may lose a count now and
+// then, rather than pay for an atomic add on every lookup.
+#define BLOOM_STRIPES 64
+
+// Blocks looked at to tell how full the filter is
+#define BLOOM_SAMPLE 4096
+
+typedef struct bloom_block {
+    uint8_t counter[BLOOM_BLOCK];
+} __attribute__((aligned(64))) bloom_block_t;
+
+typedef struct bloom_counts {
+    unsigned long checks;
+    unsigned long rejects;
+    unsigned long false_positives;
+} __attribute__((aligned(64))) bloom_counts_t;
+
+static bloom_block_t *blocks;
+static uint32_t num_blocks;
+static long keys_counted;
+static bloom_counts_t counts[BLOOM_STRIPES];
+static int next_stripe;
+static __thread bloom_counts_t *my_counts;
+
+/* FNV-1a, with the bits mixed afterwards so that both halves of the hash
+ * depend on every byte. */
+static uint64_t bloom_hash(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211UL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The key's block, from the high half of its hash; its counters in the
+ * block follow from the low half, six bits each. */
+static bloom_block_t *block_of(uint64_t h) {
+    return &blocks[((h >> 32) * num_blocks) >> 32];
+}
+
+static bloom_counts_t *counts_get(void) {
+    if (my_counts == NULL) {
+        int stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED);
+        my_counts = &counts[stripe % BLOOM_STRIPES];
+    }
+    return my_counts;
+}
+
+int bloom_init(long keys) {
+    long wanted = (keys * BLOOM_PER_KEY + BLOOM_BLOCK - 1) / BLOOM_BLOCK;
+    if (wanted < 1)
+        wanted = 1;
+    if (wanted > UINT32_MAX)
+        wanted = UINT32_MAX;
+    if ((blocks = aligned_alloc(64, wanted * sizeof(bloom_block_t))) == NULL)
+        return -1;
+    memset(blocks, 0, wanted * sizeof(bloom_block_t));
+    num_blocks = wanted;
+    bloom_enabled = 1;
+    return 0;
+}
+
+void bloom_add(const char *name, size_t len) {
+    uint64_t h = bloom_hash(name, len);
+    bloom_block_t *block = block_of(h);
+    for (int i = 0; i < BLOOM_PROBES; i++, h >>= 6) {
+        uint8_t *counter = &block->counter[h & (BLOOM_BLOCK - 1)];
+        uint8_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        while (old != BLOOM_STUCK &&
+               !__atomic_compare_exchange_n(counter, &old, old + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+    __atomic_fetch_add(&keys_counted, 1, __ATOMIC_RELAXED);
+}
+
+void bloom_remove(const char *name, size_t len) {
+    uint64_t h = bloom_hash(name, len);
+    bloom_block_t *block = block_of(h);
+    for (int i = 0; i < BLOOM_PROBES; i++, h >>= 6) {
+        uint8_t *counter = &block->counter[h & (BLOOM_BLOCK - 1)];
+        uint8_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        while (old != BLOOM_STUCK && old != 0 &&
+               !__atomic_compare_exchange_n(counter, &old, old - 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+    __atomic_fetch_sub(&keys_counted, 1, __ATOMIC_RELAXED);
+}
+
+int bloom_check(const char *name, size_t len) {
+    uint64_t h = bloom_hash(name, len);
+    bloom_block_t *block = block_of(h);
+    bloom_counts_t *c = counts_get();
+    __atomic_store_n(&c->checks, c->checks + 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < BLOOM_PROBES; i++, h >>= 6) {
+        if (__atomic_load_n(&block->counter[h & (BLOOM_BLOCK - 1)], __ATOMIC_RELAXED) == 0) {
+            __atomic_store_n(&c->rejects, c->rejects + 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bloom_false_positive(void) {
+    bloom_counts_t *c = counts_get();
+    __atomic_store_n(&c->false_positives, c->false_positives + 1, __ATOMIC_RELAXED);
+}
+
+void bloom_stats(char *buf, int len) {
+    unsigned long checks = 0, rejects = 0, false_positives = 0;
+    for (int i = 0; i < BLOOM_STRIPES; i++) {
+        checks += __atomic_load_n(&counts[i].checks, __ATOMIC_RELAXED);
+        rejects += __atomic_load_n(&counts[i].rejects, __ATOMIC_RELAXED);
+        false_positives += __atomic_load_n(&counts[i].false_positives, __ATOMIC_RELAXED);
+    }
+    // An absent key gets through if all its counters are in use, which
+    // happens about as often as picking that many used ones of its block
+    // at random. Blocks fill unevenly, so each counts on its own.
+    double expected = 0;
+    unsigned long seen = 0;
+    uint32_t step = num_blocks > BLOOM_SAMPLE ? num_blocks / BLOOM_SAMPLE : 1;
+    for (uint32_t b = 0; b < num_blocks; b += step, seen++) {
+        int used = 0;
+        for (int i = 0; i < BLOOM_BLOCK; i++)
+            used += __atomic_load_n(&blocks[b].counter[i], __ATOMIC_RELAXED) != 0;
+        double through = 1;
+        for (int i = 0; i < BLOOM_PROBES; i++)
+            through *= (double)used / BLOOM_BLOCK;
+        expected += through;
+    }
+    if (seen)
+        expected /= seen;
+    long keys = __atomic_load_n(&keys_counted, __ATOMIC_RELAXED);
+    unsigned long absent = rejects + false_positives;
+    snprintf(buf, len,
+             "bloom_bytes=%zu bloom_keys=%ld bloom_checks=%lu bloom_rejects=%lu "
+             "bloom_false_positives=%lu bloom_fpr=%.4f bloom_expected_fpr=%.4f ",
+             (size_t)num_blocks * sizeof(bloom_block_t), keys, checks, rejects, false_positives,
+             absent ? (double)false_positives / absent : 0.0, expected);
+}
+
+void bloom_clear(void) {
+    if (blocks)
+        memset(blocks, 0, (size_t)num_blocks * sizeof(bloom_block_t));
+    keys_counted = 0;
+}
+
+void bloom_cleanup(void) {
+    free(blocks);
+    blocks = NULL;
+    num_blocks = 0;
+    keys_counted = 0;
+    bloom_enabled = 0;
+}
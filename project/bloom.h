@@ -0,0 +1,57 @@
+#ifndef BLOOM_H_
+#define BLOOM_H_
+
+#include <stddef.h>
+
+/*
+ * A counting Bloom filter over the keys present in the database, which
+ * lets queries and removals of absent keys answer without reading the
+ * tree. Every key counts in a few of the counters of one cache line; a key
+ * with any of its counters at zero is certainly absent. Keys that are
+ * absent but whose counters other keys happen to fill get through to the
+ * tree anyway: those are the false positives bloom_stats() reports.
+ */
+
+/**
+  * When non-zero, the database keeps the filter up to date and consults it. Set by
+  * bloom_init(), before any key is added.
+  */
+extern int bloom_enabled;
+
+/**
+  * bloom_init() makes a filter sized for about keys keys, with 12 counters of a byte for each,
+  * and enables it. Beyond that many keys it lets more absent keys through. Returns 0 on
+  * success, or -1 if memory ran out.
+  */
+int bloom_init(long keys);
+
+/**
+  * bloom_add() counts a key that became present, bloom_remove() one that is no longer. A key
+  * must be counted before it can be read, and uncounted only once it can no longer be; a
+  * counter that would overflow stays at its highest value for good.
+  */
+void bloom_add(const char *name, size_t len);
+void bloom_remove(const char *name, size_t len);
+
+/**
+  * bloom_check() returns 0 if the key is certainly absent, 1 if it may be present.
+  * bloom_false_positive() tells the filter that a key it let through was absent after all.
+  */
+int bloom_check(const char *name, size_t len);
+void bloom_false_positive(void);
+
+/**
+  * bloom_stats() writes the filter's counters as space-separated key=value pairs into buf:
+  * its size, keys counted, lookups, rejections, false positives and the share of absent keys
+  * it let through, next to the share expected for its fill.
+  */
+void bloom_stats(char *buf, int len);
+
+/**
+  * bloom_clear() zeroes every counter, for an emptied database. bloom_cleanup() frees the
+  * filter and disables it.
+  */
+void bloom_clear(void);
+void bloom_cleanup(void);
+
+#endif  // BLOOM_H_
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,16 +10,56 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "./load.h"
+#include "./lz.h"
+#include "./shm.h"
 
-#define BUFSIZE 1024
 
 /*
- * Helper that opens a TCP socket representing the server.
+ * Helper that opens a Unix domain socket to the server listening at path.
+ * Returns the file descriptor on success, -1 on failure.
+ */
+int get_unix_socket(const char *path) {
+    int sock;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long!\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * Helper that opens a TCP socket representing the server. A servername of
+ * "unix" means the port is the path of a Unix domain socket instead, which
+ * is how the server's admin channel and local listener are reached. A
+ * servername of "shm" also names such a path, but is handled by
+ * run_shm_occurence().
  * Returns the file descriptor on success, -1 on failure.
  */
 int get_socket(const char *server, const char *port) {
+    if (strcmp(server, "unix") == 0) {
+        return get_unix_socket(port);
+    }
+
     // setup for getaddrinfo
     int sock;
     struct addrinfo hints;
@@ -57,6 +98,82 @@ int get_socket(const char *server, const char *port) {
     return sock;
 }
 
+/*
+ * Parses the "z <length> <compressed length>" line that precedes a value the
+ * server sent compressed, after the client asked for that with "z on".
+ * Returns 1 if line is such a frame, 0 if it is an ordinary response.
+ */
+int parse_frame(const char *line, size_t *raw_len, size_t *len) {
+    // Values never contain spaces, so no value can look like a frame.
+    return sscanf(line, "z %zu %zu", raw_len, len) == 2;
+}
+
+/*
+ * Expands the len compressed bytes of a framed value and prints them.
+ * Returns 0 on success, -1 if they do not expand to raw_len bytes.
+ */
+int print_compressed(const char *data, size_t len, size_t raw_len) {
+    char *raw;
+    if ((raw = malloc(raw_len + 1)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (lz_decompress(data, len, raw, raw_len) != (long)raw_len) {
+        fprintf(stderr, "Malformed compressed value!\n");
+        free(raw);
+        return -1;
+    }
+    fwrite(raw, 1, raw_len, stdout);
+    putchar('\n');
+    free(raw);
+    return 0;
+}
+
+/*
+ * Runs the script in infile against a server on this host over the
+ * shared-memory transport, set up through the Unix domain socket at path.
+ * Does not return.
+ */
+void run_shm_occurence(const char *path, FILE *infile) {
+    int sock;
+    if ((sock = get_unix_socket(path)) == -1) {
+        exit(1);
+    }
+    if (write(sock, "shm\n", 4) != 4) {
+        perror("write");
+        exit(1);
+    }
+    shm_region_t *region;
+    if ((region = shm_accept(sock)) == NULL) {
+        exit(1);
+    }
+
+    char *rbuf = NULL, *qbuf = NULL;
+    size_t rcap = 0, qcap = 0;
+    ssize_t qlen;
+    while ((qlen = getline(&qbuf, &qcap, infile)) > 0) {
+        if (shm_send(&region->req, qbuf, qlen, sock) < 0 ||
+            shm_recv(&region->resp, &rbuf, &rcap, SIZE_MAX, sock) < 0) {
+            fprintf(stderr, "Connection terminated.\n");
+            exit(1);
+        }
+        size_t raw_len, len;
+        long n;
+        if (!parse_frame(rbuf, &raw_len, &len)) {
+            printf("%s\n", rbuf);
+        } else if ((n = shm_recv(&region->resp, &rbuf, &rcap, SIZE_MAX, sock)) < 0 ||
+                   n != len || print_compressed(rbuf, len, raw_len) < 0) {
+            fprintf(stderr, "Connection terminated.\n");
+            exit(1);
+        }
+    }
+    shm_close(region);
+    close(sock);
+    fclose(infile);
+    printf("Client terminated cleanly.\n");
+    exit(0);
+}
+
 /*
  * Forks off a process that attempts to connect to the server, and then run the
  * script in the file provided.
@@ -79,21 +196,35 @@ pid_t create_occurence(const char *server, const char *port,
             infile = stdin;
         }
 
+        if (strcmp(server, "shm") == 0) {
+            run_shm_occurence(port, infile);
+        }
+
         // Step 3: set up a new connection to the server
         int sock;
         if ((sock = get_socket(server, port)) == -1) {
             exit(1);
         }
 
-        // Step 4: loop, sending queries and printing responses
+        // Step 4: loop, sending queries and printing responses. Lines are
+        // read with getline, since a value may run to a megabyte.
         FILE *cxn = fdopen(sock, "w+");
-        char rbuf[BUFSIZE], qbuf[BUFSIZE];
-        rbuf[0] = '\0';
+        char *rbuf = NULL, *qbuf = NULL;
+        size_t rcap = 0, qcap = 0;
+        int watching = 0;
 
         while (1) {
             // if there are no more commands, so we can clean up and exit
-            if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
+            if (getline(&qbuf, &qcap, infile) < 0) {
+                // A watching connection goes on printing notifications
+                // until the server closes it.
+                while (watching && getline(&rbuf, &rcap, cxn) > 0) {
+                    printf("%s", rbuf);
+                    fflush(stdout);
+                }
+                qbuf = realloc(qbuf, 2);
                 qbuf[0] = EOF;
+                qbuf[1] = '\0';
                 fputs(qbuf, cxn);
                 fflush(cxn);
                 fclose(cxn);
@@ -102,6 +233,7 @@ pid_t create_occurence(const char *server, const char *port,
                 exit(0);
             } else {
                 // otherwise, send the command
+                watching |= strncmp(qbuf, "watch ", 6) == 0;
                 if (fputs(qbuf, cxn) == EOF) {
                     fprintf(stderr, "No connection!\n");
                     exit(1);
@@ -110,11 +242,25 @@ pid_t create_occurence(const char *server, const char *port,
             }
 
             // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
+            if (getline(&rbuf, &rcap, cxn) < 0) {
+                fprintf(stderr, "Connection terminated.\n");
+                exit(1);
+            }
+            size_t raw_len, len;
+            if (!parse_frame(rbuf, &raw_len, &len)) {
+                printf("%s", rbuf);
+                continue;
+            }
+            // The compressed bytes follow, then a newline.
+            if (len + 1 > rcap && (rbuf = realloc(rbuf, rcap = len + 1)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            if (fread(rbuf, 1, len + 1, cxn) != len + 1 ||
+                print_compressed(rbuf, len, raw_len) < 0) {
                 fprintf(stderr, "Connection terminated.\n");
                 exit(1);
             }
-            printf("%s", rbuf);
         }
     }
 
@@ -128,8 +274,9 @@ pid_t create_occurence(const char *server, const char *port,
 void usage_error(const char *cmd) {
     fprintf(stderr,
             "Usage: %s <servername> <port> "
-            "[<script> <occurences>]\n",
-            cmd);
+            "[<script> <occurences>]\n"
+            "       %s <servername> <port> load [<options>]\n",
+            cmd, cmd);
 }
 
 /*
@@ -146,6 +293,11 @@ void usage_error(const char *cmd) {
  *         script-file to the server and prints responses (if any exist)
  */
 int main(int argc, const char *argv[]) {
+    // The load generator takes options of its own (see load.h).
+    if (argc >= 4 && strcmp(argv[3], "load") == 0) {
+        return run_load(argv[1], argv[2], argc - 3, (char **)argv + 3);
+    }
+
     // parse args
     if (argc != 3 && argc != 5) {
         usage_error(argv[0]);
@@ -1,6 +1,9 @@
 #include "./comm.h"
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,68 +11,342 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /* Serverside I/O functions */
 
-int lsock;
+#define MAX_LISTENERS 64
 
-static void *listener(void (*server)(FILE *));
+/*
+ * One accepting socket and the thread that runs accept on it. With
+ * SO_REUSEPORT several of these share the port and the kernel spreads
+ * incoming connections over them.
+ */
+typedef struct listener {
+    int sock;
+    pthread_t thread;
+    void (*server)(FILE *);
+} listener_t;
 
-static int comm_port;
+static listener_t listeners[MAX_LISTENERS];
+static int num_listeners;
+static const char *listen_path;  // Unix domain socket to remove on stop
 
-pthread_t start_listener(int port, void (*server)(FILE *)) {
-    comm_port = port;
+// Set by comm_stop_listener() to make the listener threads return.
+static int comm_stopping;
+
+static void *listener(listener_t *self);
+
+static void *admin_listener(void (*server)(FILE *));
+
+static char admin_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/* Creates, binds and starts listening on one TCP socket for the port. */
+static int open_listen_socket(const comm_config_t *config, int reuseport) {
+    int sock;
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    // Lets a restarted server bind while connections it drained are still
+    // in TIME_WAIT.
+    int one = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+        perror("setsockopt");
+    }
+    if (reuseport &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        exit(1);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config->port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        if (close(sock) < 0) perror("close");
+        exit(1);
+    }
+
+    if (listen(sock, config->backlog) < 0) {
+        perror("listen");
+        if (close(sock) < 0) perror("close");
+        exit(1);
+    }
+    return sock;
+}
+
+/* Creates, binds and starts listening on a Unix domain socket at path,
+ * replacing any stale socket file left behind by a previous run. */
+static int open_unix_socket(const char *path, int backlog) {
+    int sock;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        if (close(sock) < 0) perror("close");
+        exit(1);
+    }
+
+    if (listen(sock, backlog) < 0) {
+        perror("listen");
+        if (close(sock) < 0) perror("close");
+        exit(1);
+    }
+    return sock;
+}
+
+/* Opens the listening sockets described by config and starts one accept
+ * thread per socket. More than one listener puts every socket on the port
+ * in SO_REUSEPORT mode; zero listeners means one per online core. The
+ * sockets are all bound before this returns, so bind errors surface in
+ * the caller's thread. */
+void start_listener(const comm_config_t *config, void (*server)(FILE *)) {
+    int count = config->listeners;
+    if (count <= 0) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (count < 1) {
+        count = 1;
+    } else if (count > MAX_LISTENERS - 1) {
+        count = MAX_LISTENERS - 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        listeners[i].sock = open_listen_socket(config, count > 1);
+        listeners[i].server = server;
+    }
+    fprintf(stderr, "listening on port %d with %d listener%s\n", config->port,
+            count, count > 1 ? "s" : "");
+    // Co-located clients skip the TCP stack on the Unix domain socket.
+    if (config->unix_path) {
+        listeners[count].sock = open_unix_socket(config->unix_path, config->backlog);
+        listeners[count].server = server;
+        fprintf(stderr, "listening on %s\n", config->unix_path);
+        listen_path = config->unix_path;
+        count++;
+    }
+    num_listeners = count;
+
+    for (int i = 0; i < count; i++) {
+        int err;
+        if ((err = pthread_create(&listeners[i].thread, 0,
+                                  (void *(*)(void *))listener,
+                                  &listeners[i])))
+            handle_error_en(err, "pthread_create");
+    }
+}
+
+void *listener(listener_t *self) {
+    while (1) {
+        int csock;
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        // The accepted socket stays blocking: client threads read and
+        // write it through stdio.
+        if ((csock = accept4(self->sock, (struct sockaddr *)&client_addr,
+                             &client_len, SOCK_CLOEXEC)) < 0) {
+            if (__atomic_load_n(&comm_stopping, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
+        }
+
+        if (client_addr.ss_family == AF_INET) {
+            // Responses are single short lines; don't let Nagle hold them
+            // back waiting for the client's delayed ack.
+            int one = 1;
+            if (setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+                perror("setsockopt TCP_NODELAY");
+            }
+            struct sockaddr_in *in = (struct sockaddr_in *)&client_addr;
+            fprintf(stderr, "received connection from %s#%hu\n",
+                    inet_ntoa(in->sin_addr), in->sin_port);
+        } else {
+            fprintf(stderr, "received local connection\n");
+        }
+
+        FILE *cxstr;
+        if (!(cxstr = fdopen(csock, "w+"))) {
+            perror("fdopen");
+            if (close(csock) < 0) perror("close");
+            continue;
+        }
+
+        self->server(cxstr);
+    }
+
+    if (close(self->sock) < 0) perror("close");
+    return NULL;
+}
+
+/* Makes the listener threads stop accepting connections and joins them.
+ * Shutting a listening socket down wakes up a blocked accept. */
+void comm_stop_listener(void) {
+    __atomic_store_n(&comm_stopping, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < num_listeners; i++) {
+        if (shutdown(listeners[i].sock, SHUT_RDWR) < 0) perror("shutdown");
+    }
+    for (int i = 0; i < num_listeners; i++) {
+        int err;
+        if ((err = pthread_join(listeners[i].thread, 0)))
+            handle_error_en(err, "pthread_join");
+    }
+    num_listeners = 0;
+    if (listen_path) {
+        unlink(listen_path);
+    }
+}
+
+/* Connects to another server, as a client would, and returns the
+ * connection as a stream, or NULL on failure. */
+FILE *comm_connect(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err;
+    if ((err = getaddrinfo(host, port, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return NULL;
+    }
+
+    int sock = -1;
+    for (struct addrinfo *res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+
+    if (sock < 0) {
+        fprintf(stderr, "could not connect to %s#%s\n", host, port);
+        return NULL;
+    }
+
+    FILE *cxstr;
+    if (!(cxstr = fdopen(sock, "w+"))) {
+        perror("fdopen");
+        if (close(sock) < 0) perror("close");
+        return NULL;
+    }
+    return cxstr;
+}
+
+/* Returns 1 if the peer has closed the connection or it has been drained.
+ * Only meaningful on connections the caller never expects to read from. */
+int comm_peer_gone(FILE *cxstr) {
+    struct pollfd pfd = {fileno(cxstr), POLLIN | POLLRDHUP, 0};
+    if (poll(&pfd, 1, 0) < 0) {
+        return 0;
+    }
+    return pfd.revents != 0;
+}
+
+/* Returns 1 if the client is connected over a Unix domain socket, and so
+ * is on this host and may share memory with the server. */
+int comm_is_local(FILE *cxstr) {
+    int domain;
+    socklen_t len = sizeof(domain);
+    if (getsockopt(fileno(cxstr), SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0) {
+        return 0;
+    }
+    return domain == AF_UNIX;
+}
+
+/* Closes the receive side of a client connection. The client's next read
+ * sees end of file, while a response still being written goes out. */
+void comm_drain(FILE *cxstr) {
+    if (shutdown(fileno(cxstr), SHUT_RD) < 0 && errno != ENOTCONN)
+        perror("shutdown");
+}
+
+/* Starts the thread that owns the administrative Unix domain socket at path.
+ * Unlike the client listener, admin connections are served one at a time
+ * inside the admin thread itself: serve_func runs the whole session and
+ * the stream is closed when it returns. */
+pthread_t start_admin_listener(const char *path, void (*server)(FILE *)) {
     pthread_t tid;
     int err;
 
-    if ((err = pthread_create(&tid, 0, (void *(*)(void *))listener,
+    if (strlen(path) >= sizeof(admin_path)) {
+        fprintf(stderr, "admin socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(admin_path, path);
+
+    if ((err = pthread_create(&tid, 0, (void *(*)(void *))admin_listener,
                               (void *)server)))
         handle_error_en(err, "pthread_create");
- 
+
     return tid;
 }
 
-void *listener(void (*server)(FILE *)) {
-    if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+void *admin_listener(void (*server)(FILE *)) {
+    int asock;
+    if ((asock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(1);
     }
 
-    struct sockaddr_in addr;
+    struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(comm_port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, admin_path);
 
-    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    // A stale socket file from a previous run would make bind fail.
+    unlink(admin_path);
+    if (bind(asock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("bind");
-        if (close(lsock) < 0) perror("close");
+        if (close(asock) < 0) perror("close");
         exit(1);
     }
 
-    if (listen(lsock, 100) < 0) {
+    if (listen(asock, 4) < 0) {
         perror("listen");
-        if (close(lsock) < 0) perror("close");
+        if (close(asock) < 0) perror("close");
         exit(1);
     }
 
-    fprintf(stderr, "listening on port %d\n", comm_port);
+    fprintf(stderr, "admin channel on %s\n", admin_path);
 
     while (1) {
         int csock;
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-
-        if ((csock = accept(lsock, (struct sockaddr *)&client_addr,
-                            &client_len)) < 0) {
+        if ((csock = accept(asock, NULL, NULL)) < 0) {
             perror("accept");
             continue;
         }
 
-        fprintf(stderr, "received connection from %s#%hu\n",
-                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
-
         FILE *cxstr;
         if (!(cxstr = fdopen(csock, "w+"))) {
             perror("fdopen");
@@ -78,6 +355,7 @@ void *listener(void (*server)(FILE *)) {
         }
 
         server(cxstr);
+        comm_shutdown(cxstr);
     }
 
     return NULL;
@@ -87,16 +365,76 @@ void comm_shutdown(FILE *cxstr) {
     if (fclose(cxstr) < 0) perror("fclose");
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
-            fprintf(stderr, "client connection terminated\n");
+/* Sends len bytes of response followed by a newline. A response as large
+ * as a big value goes to the socket straight from the caller's memory:
+ * stdio only buffers what does not fill a whole buffer.
+ * Returns 0 on success, or -1 if the connection is gone. */
+int comm_send(FILE *cxstr, const char *response, size_t len) {
+    if (fwrite(response, 1, len, cxstr) != len || fputc('\n', cxstr) == EOF ||
+        fflush(cxstr) == EOF) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the next line, newline included, into *line, which is grown with
+ * realloc as needed and must be freed by the caller, like getline(). A
+ * line longer than COMM_MAXLINE is read to its end and comes back empty.
+ * Returns 0 on success, or -1 at end of file. */
+int comm_read_line(FILE *cxstr, char **line, size_t *cap) {
+    size_t len = 0;
+    int overlong = 0;
+    if (*cap < BUFLEN) {
+        char *grown;
+        if ((grown = realloc(*line, BUFLEN)) == NULL) {
             return -1;
         }
+        *line = grown;
+        *cap = BUFLEN;
+    }
+    while (1) {
+        if (fgets(*line + len, *cap - len, cxstr) == NULL) {
+            if (len == 0) {
+                return -1;
+            }
+            break;
+        }
+        len += strlen(*line + len);
+        if (len > 0 && (*line)[len - 1] == '\n') {
+            break;
+        }
+        if (len < *cap - 1) {
+            continue;  // End of file follows a last line without a newline
+        }
+        if (*cap >= COMM_MAXLINE) {
+            overlong = 1;
+            len = 0;
+            continue;
+        }
+        size_t grown_cap = *cap * 2 < COMM_MAXLINE ? *cap * 2 : COMM_MAXLINE;
+        char *grown;
+        if ((grown = realloc(*line, grown_cap)) == NULL) {
+            return -1;
+        }
+        *line = grown;
+        *cap = grown_cap;
+    }
+    if (overlong) {
+        (*line)[0] = '\0';
+    }
+    return 0;
+}
+
+/* Sends the response to the previous command, if any, and reads the next
+ * command into *command as comm_read_line() does.
+ * Returns 0 on success, or -1 once the client is gone. */
+int comm_serve(FILE *cxstr, const char *response, size_t len, char **command, size_t *cap) {
+    if (len > 0 && comm_send(cxstr, response, len) < 0) {
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
     }
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
+    if (comm_read_line(cxstr, command, cap) < 0) {
         fprintf(stderr, "client connection terminated\n");
         return -1;
     }
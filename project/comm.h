@@ -5,7 +5,12 @@
 #include <pthread.h>
 #include <stdio.h>
 
+// Room for a response message, or an administrative command.
 #define BUFLEN 256
+
+// Longest command line accepted from a client, enough for the largest key
+// and value (see value.h). Longer lines are discarded and read as empty.
+#define COMM_MAXLINE ((1 << 20) + 8192)
 #define handle_error_en(en, msg) \
     do {                         \
         errno = en;              \
@@ -13,8 +18,26 @@
         exit(EXIT_FAILURE);      \
     } while (0)
 
-pthread_t start_listener(int port, void (*serve_func)(FILE *));
+/*
+ * How the server listens for clients.
+ */
+typedef struct comm_config {
+    int port;
+    int backlog;  // Passed to listen() for each socket
+    int listeners;  // Accepting sockets and threads, 0 for one per core
+    const char *unix_path;  // Extra Unix domain socket for local clients, or NULL
+} comm_config_t;
+
+void start_listener(const comm_config_t *config, void (*serve_func)(FILE *));
+pthread_t start_admin_listener(const char *path, void (*serve_func)(FILE *));
+void comm_stop_listener(void);
+void comm_drain(FILE *cxstr);
+int comm_is_local(FILE *cxstr);
+int comm_peer_gone(FILE *cxstr);
+FILE *comm_connect(const char *host, const char *port);
 void comm_shutdown(FILE *cxstr);
-int comm_serve(FILE *cxstr, char *resp, char *cmd);
+int comm_send(FILE *cxstr, const char *resp, size_t len);
+int comm_read_line(FILE *cxstr, char **line, size_t *cap);
+int comm_serve(FILE *cxstr, const char *resp, size_t len, char **cmd, size_t *cap);
 
 #endif  // COMM_H_
@@ -1,308 +1,2132 @@
 #include <errno.h>
+#include <sched.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include "./bloom.h"
 #include "./db.h"
+#include "./numa.h"
+#include "./trace.h"
 
-#define MAXLEN 256
 // #define lock(lt, lk) ((lt))? pthread_rwlock_wrlock(lk): pthread_rwlock_rdlock(lk)
 // #define trylock(lt, lk) ((lt))? pthread_rwlock_trywrlock(lk): pthread_rwlock_tryrdlock(lk)
 // The root node of the binary tree, unlike all 
 // other nodes in the tree, this one is never 
 // freed (it's allocated in the data region).
 
+int trylock(int lock_type, pthread_rwlock_t* lock);
+
 void lock(int lock_type, pthread_rwlock_t* lock){
 	// There are two locktypes. 0 indicates read-lock and 1 indicates write-lock.
     // Locktype variable passed in as an argument must therefore be restricted to
     // these two integers.
 	assert(!lock_type || lock_type == 1);
+	if (trace_sampling()){
+		// A sampled command records the locks it has to wait for.
+		if (trylock(lock_type, lock)){
+			return;
+		}
+		trace_begin(TRACE_LOCK_WAIT);
+	}
 	if (lock_type){
 		if (pthread_rwlock_wrlock(lock)){
 			perror("could not lock write-lock\n");
 			exit(1);
 		}
-		return;
-	}
-	if (pthread_rwlock_rdlock(lock)){
+	} else if (pthread_rwlock_rdlock(lock)){
 		perror("could not lock read-lock\n");
 		exit(1);
 	}
+	trace_end(TRACE_LOCK_WAIT);
 }
 
-void trylock(int lock_type, pthread_rwlock_t* lock){
+// Returns 1 if the lock was taken, 0 if it is held elsewhere.
+int trylock(int lock_type, pthread_rwlock_t* lock){
 	// There are two locktypes. 0 indicates read-lock and 1 indicates write-lock.
     // Locktype variable passed in as an argument must therefore be restricted to
     // these two integers.
 	assert(!lock_type || lock_type == 1);
-	if (lock_type){
-		if (pthread_rwlock_trywrlock(lock)){
-			perror("trywrlock failure\n");
-			exit(1);
-		}
-		return;
+	int err = lock_type ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock);
+	if (err == EBUSY){
+		return 0;
 	}
-	if (pthread_rwlock_tryrdlock(lock)){
-		perror("could not lock read-lock\n");
+	if (err){
+		perror("trylock failure\n");
+		exit(1);
+	}
+	return 1;
+}
+
+
+
+
+void unlock(pthread_rwlock_t* lock){
+	if (pthread_rwlock_unlock(lock)){
+		perror("could not unlock read-write lock\n");
 		exit(1);
 	}
 }
 
+/*
+ * The database is one or more trees, the shards, each under a head node
+ * whose key sorts before every other. A key's hash picks its shard. A
+ * single shard takes its nodes from the heap; once db_shard() splits the
+ * database, every shard belongs to a NUMA node and takes its nodes from
+ * there, so that a thread running on that node walks local memory only.
+ */
+typedef struct shard {
+    node_t head;
+    int node;  // NUMA node holding the shard's nodes and keys, -1 for the heap
+    struct keyspace *space;  // Keyspace the shard belongs to
+} __attribute__((aligned(64))) shard_t;
+
+/*
+ * Every keyspace has a shard of its own for each shard of the default
+ * one, on the same NUMA node, so that splitting the database splits every
+ * keyspace alike. Keyspaces are only ever added, into the next free entry
+ * of spaces, and num_spaces published after it; they are freed together
+ * by db_cleanup().
+ */
+struct keyspace {
+    char name[32];
+    shard_t *shards;
+    long quota;  // Bytes of keys and values it may hold, 0 for no limit
+    long op_ns;  // Nanoseconds between commands at its rate limit, 0 for none
+    long next_op;  // When the rate limit lets the next command in
+    // Counters for db_space_stats()
+    long keys;
+    long bytes;
+    unsigned long ops;
+    unsigned long throttled;
+    unsigned long throttle_ns;
+    unsigned long over_quota;
+};
+
+// How far ahead of its rate limit a keyspace may run before it sleeps.
+#define SPACE_BURST_NS 100000000L
+
+static char head_name[] = "";
+static keyspace_t default_space;
+static shard_t first_shard = {{.name = head_name, .rw_lock = PTHREAD_RWLOCK_INITIALIZER}, -1,
+                              &default_space};
+static keyspace_t default_space = {"default", &first_shard};
+static int num_shards = 1;
+
+static keyspace_t *spaces[DB_MAX_SPACES] = {&default_space};
+static int num_spaces = 1;
+static pthread_mutex_t spaces_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread keyspace_t *my_space;
+
+static inline keyspace_t *space_get(void) {
+    return my_space ? my_space : &default_space;
+}
+
+/* The shard name is filed in, in the calling thread's keyspace. */
+static shard_t *shard_of(const char *name) {
+    shard_t *shards = space_get()->shards;
+    if (num_shards == 1)
+        return shards;
+    // FNV-1a
+    unsigned long h = 14695981039346656037UL;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211UL;
+    }
+    return &shards[h % num_shards];
+}
+
+/* The i-th shard of every keyspace taken together, for walks over the
+ * whole database; i runs up to num_spaces * num_shards. */
+static shard_t *shard_at(int i) {
+    return &spaces[i / num_shards]->shards[i % num_shards];
+}
+
+static inline int is_head(node_t *node) {
+    return node->name == head_name;
+}
+
+/*
+ * Keys as searches compare them. A probe is made once per search from the
+ * key searched for; key_cmp() orders it against a node's key as strcmp()
+ * orders the strings. Built with FIXED_KEYS that is two integer compares
+ * against the key held in the node; otherwise it is strcmp() itself, and
+ * the generic build is what it would be without this layer.
+ */
+#ifdef FIXED_KEYS
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "FIXED_KEYS assumes a little-endian machine"
+#endif
+typedef fixed_key_t probe_t;
+
+static inline probe_t key_probe(const char *name) {
+    unsigned char bytes[16] = {0};
+    uint64_t hi, lo;
+    memcpy(bytes, name, strnlen(name, 16));
+    memcpy(&hi, bytes, 8);
+    memcpy(&lo, bytes + 8, 8);
+    return (probe_t){__builtin_bswap64(hi), __builtin_bswap64(lo)};
+}
+
+static inline probe_t node_probe(const node_t *node) {
+    return node->key;
+}
+
+static inline int key_cmp(probe_t probe, const node_t *node) {
+    if (probe.hi != node->key.hi)
+        return probe.hi < node->key.hi ? -1 : 1;
+    return (probe.lo > node->key.lo) - (probe.lo < node->key.lo);
+}
+
+// Longer keys cannot be in the tree, and must not match one by their first 16 bytes.
+#define key_fits(name) (strnlen(name, MAX_KEYLEN + 1) <= MAX_KEYLEN)
+#else
+typedef const char *probe_t;
+
+static inline probe_t key_probe(const char *name) {
+    return name;
+}
+
+static inline probe_t node_probe(const node_t *node) {
+    return node->name;
+}
+
+static inline int key_cmp(probe_t probe, const node_t *node) {
+    return strcmp(probe, node->name);
+}
+
+#define key_fits(name) 1
+#endif
+
+int db_shard(int count) {
+    int nodes = numa_nodes();
+    shard_t *split = &first_shard;
+    assert(num_spaces == 1);
+    if (count <= 0)
+        count = nodes;
+    if (count > 1) {
+        if ((split = aligned_alloc(64, sizeof(shard_t) * count)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memset(split, 0, sizeof(shard_t) * count);
+        for (int i = 0; i < count; i++) {
+            split[i].head.name = head_name;
+            if (pthread_rwlock_init(&split[i].head.rw_lock, 0)) {
+                perror("could not initialize read-write lock:\n");
+                exit(1);
+            }
+            split[i].node = i % nodes;
+            split[i].space = &default_space;
+        }
+    }
+    if (default_space.shards != &first_shard) {
+        for (int i = 0; i < num_shards; i++)
+            pthread_rwlock_destroy(&default_space.shards[i].head.rw_lock);
+        free(default_space.shards);
+    }
+    default_space.shards = split;
+    num_shards = count;
+    return count;
+}
+
+int db_key_node(char *name) {
+    return shard_of(name)->node;
+}
+
+/* Returns 1 if name may name a keyspace. */
+static int space_name_ok(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= sizeof(default_space.name))
+        return 0;
+    for (; *name; name++) {
+        if (!isalnum((unsigned char)*name) && *name != '_' && *name != '-')
+            return 0;
+    }
+    return 1;
+}
+
+keyspace_t *db_space(const char *name) {
+    int n = __atomic_load_n(&num_spaces, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(spaces[i]->name, name) == 0)
+            return spaces[i];
+    }
+    return 0;
+}
+
+keyspace_t *db_space_create(const char *name, long quota, long ops) {
+    keyspace_t *space;
+    if (!space_name_ok(name))
+        return 0;
+    if (pthread_mutex_lock(&spaces_mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    if ((space = db_space(name)) == 0 && num_spaces < DB_MAX_SPACES &&
+        (space = calloc(1, sizeof(keyspace_t))) != 0) {
+        if ((space->shards = aligned_alloc(64, sizeof(shard_t) * num_shards)) == 0) {
+            free(space);
+            space = 0;
+        } else {
+            snprintf(space->name, sizeof(space->name), "%s", name);
+            memset(space->shards, 0, sizeof(shard_t) * num_shards);
+            for (int i = 0; i < num_shards; i++) {
+                space->shards[i].head.name = head_name;
+                if (pthread_rwlock_init(&space->shards[i].head.rw_lock, 0)) {
+                    perror("could not initialize read-write lock:\n");
+                    exit(1);
+                }
+                space->shards[i].node = default_space.shards[i].node;
+                space->shards[i].space = space;
+            }
+            spaces[num_spaces] = space;
+            __atomic_store_n(&num_spaces, num_spaces + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (space) {
+        __atomic_store_n(&space->quota, quota > 0 ? quota : 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&space->op_ns, ops > 0 ? 1000000000L / ops : 0, __ATOMIC_RELAXED);
+    }
+    if (pthread_mutex_unlock(&spaces_mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    return space;
+}
+
+void db_space_use(keyspace_t *space) {
+    my_space = space == &default_space ? 0 : space;
+}
+
+keyspace_t *db_space_current(void) {
+    return space_get();
+}
+
+const char *db_space_name(keyspace_t *space) {
+    return space->name;
+}
+
+void db_space_list(char *buf, int len) {
+    int n = __atomic_load_n(&num_spaces, __ATOMIC_ACQUIRE);
+    int used = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < n && used < len; i++)
+        used += snprintf(buf + used, len - used, "%s%s", i ? " " : "", spaces[i]->name);
+}
+
+static long space_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void db_space_admit(void) {
+    keyspace_t *space = space_get();
+    long op_ns = __atomic_load_n(&space->op_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&space->ops, 1, __ATOMIC_RELAXED);
+    if (op_ns == 0)
+        return;
+    // Every command takes the next slot of the keyspace's schedule, which
+    // never starts further back than a burst's worth; a command whose slot
+    // is still to come sleeps until then.
+    long now = space_clock_ns();
+    long slot = __atomic_load_n(&space->next_op, __ATOMIC_RELAXED);
+    long start;
+    do {
+        start = slot < now - SPACE_BURST_NS ? now - SPACE_BURST_NS : slot;
+    } while (!__atomic_compare_exchange_n(&space->next_op, &slot, start + op_ns, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    long wait = start - now;
+    if (wait <= 0)
+        return;
+    __atomic_fetch_add(&space->throttled, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&space->throttle_ns, wait, __ATOMIC_RELAXED);
+    struct timespec ts = {wait / 1000000000L, wait % 1000000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* Charges the calling thread's keyspace bytes more, or credits it with
+ * -bytes. Returns 0, charging nothing, if that takes it over its quota. */
+static int space_charge(long bytes) {
+    keyspace_t *space = space_get();
+    long quota = __atomic_load_n(&space->quota, __ATOMIC_RELAXED);
+    long used = __atomic_add_fetch(&space->bytes, bytes, __ATOMIC_RELAXED);
+    if (bytes > 0 && quota > 0 && used > quota) {
+        __atomic_fetch_sub(&space->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&space->over_quota, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+void db_space_stats(keyspace_t *space, char *buf, int len) {
+    long op_ns = __atomic_load_n(&space->op_ns, __ATOMIC_RELAXED);
+    snprintf(buf, len,
+             "keys=%ld bytes=%ld quota=%ld ops=%lu rate_limit=%ld throttled=%lu "
+             "throttle_ms=%.1f over_quota=%lu",
+             __atomic_load_n(&space->keys, __ATOMIC_RELAXED),
+             __atomic_load_n(&space->bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&space->quota, __ATOMIC_RELAXED),
+             __atomic_load_n(&space->ops, __ATOMIC_RELAXED), op_ns ? 1000000000L / op_ns : 0,
+             __atomic_load_n(&space->throttled, __ATOMIC_RELAXED),
+             __atomic_load_n(&space->throttle_ns, __ATOMIC_RELAXED) / 1e6,
+             __atomic_load_n(&space->over_quota, __ATOMIC_RELAXED));
+}
+
+/* Memory for the nodes and keys of shard. */
+static void *shard_alloc(shard_t *shard, size_t size) {
+    return shard->node < 0 ? malloc(size) : numa_node_alloc(shard->node, size);
+}
+
+static void shard_free(shard_t *shard, void *obj, size_t size) {
+    if (shard->node < 0) {
+        free(obj);
+    } else {
+        numa_node_free(shard->node, obj, size);
+    }
+}
+
+// Number of keys in the tree, maintained by db_add() and db_remove().
+static long num_keys;
+
+/* Counts delta more keys in the database and the calling thread's keyspace. */
+static inline void count_keys(long delta) {
+    __atomic_fetch_add(&num_keys, delta, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&space_get()->keys, delta, __ATOMIC_RELAXED);
+}
+
+/* Bytes a keyspace is charged for holding a key name_len long with value. */
+static inline long entry_bytes(size_t name_len, const value_t *value) {
+    return name_len + value->len;
+}
+
+void (*db_change_hook)(char op, const char *name, value_t *value);
+int db_read_only;
+
+/* Reports a successful mutation to the change hook, if one is set. Called
+ * while the node that changed is still write-locked, so that the order
+ * in which the hook sees changes to one key is the order they happened. */
+static inline void db_changed(char op, const char *name, value_t *value) {
+    void (*hook)(char, const char *, value_t *) = db_change_hook;
+    // Replicas and watchers follow the default keyspace only.
+    if (hook && my_space == 0)
+        hook(op, name, value);
+}
+
+/*
+ * Multi-version concurrency control.
+ *
+ * Every change to a key pushes a new version onto its node, stamped with
+ * a commit timestamp from commit_clock; a removal pushes a version with
+ * no value. A commit pushes its versions first, still pending, then takes
+ * its timestamp and stamps them with it, all with the nodes write-locked;
+ * everything else it does (the index, the change hook) comes after. Each
+ * commit is visible once its own versions are stamped, whatever other
+ * commits are still under way, so writers never wait for one another
+ * beyond the locks on the nodes they share.
+ *
+ * Readers take no locks. A reader announces itself in its thread's slot,
+ * takes commit_clock as its snapshot, and walks the tree, picking in every
+ * node the newest version no newer than its snapshot. A pending version
+ * may yet be stamped with a timestamp within the snapshot, so a reader
+ * that meets one waits for its stamp; that is only ever the few
+ * instructions between a commit's timestamp and its stores, and only
+ * readers of the keys that commit writes wait at all. Since the versions
+ * are in place before the timestamp is taken, a snapshot that covers a
+ * timestamp finds every version stamped with it: readers see all of a
+ * commit or none of it, and a writer that finds a key already in the state
+ * it asked for (a version stamped under the node's lock) can answer at
+ * once, as any read that starts later sees the same. Writers still lock
+ * nodes against one another (see descend()), but only to keep structural
+ * changes apart.
+ *
+ * Nodes are never unlinked by removals; a key only moves to another node
+ * when rebalancing copies the node (see db_rebalance()), and the copy
+ * takes over its versions. The garbage collector thread trims versions no
+ * snapshot can see any more and unlinks nodes whose last version is an
+ * old removal, once they have at most one child. What it takes out of the
+ * tree is freed only after every reader that might still be looking at it
+ * has finished (the reader slots' epochs, as in epoch-based reclamation).
+ */
+static unsigned long commit_clock = 1;  // Last timestamp handed out
+
+// The timestamp of a pushed version whose commit has not taken its own yet
+#define TS_PENDING (~0UL)
+
+// Reads that met a pending version and waited for its stamp
+static unsigned long pending_waits;
+
+// Spins on a pending version before yielding the CPU
+#define PENDING_SPINS 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// A snapshot announced while the real one is being taken: older than all.
+#define SNAP_PENDING 0UL
+#define SNAP_IDLE (~0UL)
+
+/*
+ * The slot through which one thread's reads are seen by the collector,
+ * on a cache line of its own.
+ */
+typedef struct reader {
+    unsigned long epoch;  // Collector epoch when the read began, 0 when idle
+    unsigned long snap;  // Snapshot being read, SNAP_IDLE when idle
+    int in_use;  // Owned by a live thread
+    struct reader *next;
+} __attribute__((aligned(64))) reader_t;
+
+static reader_t *readers;
+static pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static __thread reader_t *my_reader;
+
+/* Thread-exit destructor that hands a reader slot over to a new thread. */
+static void reader_release(void *arg) {
+    reader_t *r = (reader_t *)arg;
+    __atomic_store_n(&r->snap, SNAP_IDLE, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void reader_key_create(void) {
+    int err;
+    if ((err = pthread_key_create(&reader_key, reader_release))) {
+        errno = err;
+        perror("pthread_key_create");
+        exit(1);
+    }
+}
+
+/* Returns the calling thread's reader slot, taking one on first use. */
+static reader_t *reader_get(void) {
+    reader_t *r;
+    if (my_reader)
+        return my_reader;
+    pthread_once(&reader_once, reader_key_create);
+    if (pthread_mutex_lock(&readers_mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    for (r = readers; r; r = r->next) {
+        if (!__atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (r == 0) {
+        if (posix_memalign((void **)&r, sizeof(reader_t), sizeof(reader_t))) {
+            perror("posix_memalign");
+            exit(1);
+        }
+        r->next = readers;
+        __atomic_store_n(&readers, r, __ATOMIC_RELEASE);
+    }
+    // A reused slot is being read by the collector all along.
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->snap, SNAP_IDLE, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->in_use, 1, __ATOMIC_RELEASE);
+    if (pthread_mutex_unlock(&readers_mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    pthread_setspecific(reader_key, r);
+    my_reader = r;
+    return r;
+}
+
+static struct gc_state {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stopping;
+    unsigned long epoch;  // Advanced once per collection cycle
+    node_t *dirty;  // Nodes with versions or removals to look at, linked by gc_next
+    struct retired *limbo;  // Taken out of the tree, not yet freed
+    size_t limbo_len;
+    size_t limbo_cap;
+    long versions;  // Versions allocated
+    long removed;  // Nodes in the tree whose last version is a removal
+    unsigned long unlinked;  // Nodes taken out of the tree so far
+    unsigned long trimmed;  // Versions taken out of nodes so far
+} gc = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* Begins a read at a snapshot and returns it. The snapshot covers every
+ * timestamp handed out so far, including those of commits still stamping
+ * their versions, which version_at() waits for. */
+static unsigned long read_begin(void) {
+    reader_t *r = reader_get();
+    unsigned long snap;
+    // Announcing a pending snapshot first keeps the collector from trimming
+    // versions the real one may need while it is being taken.
+    __atomic_store_n(&r->snap, SNAP_PENDING, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->epoch, __atomic_load_n(&gc.epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    snap = __atomic_load_n(&commit_clock, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->snap, snap, __ATOMIC_SEQ_CST);
+    return snap;
+}
+
+static void read_end(void) {
+    reader_t *r = my_reader;
+    __atomic_store_n(&r->snap, SNAP_IDLE, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Takes the timestamp of a commit whose versions are all pushed, still
+ * pending, with their nodes write-locked; the read-modify-write publishes
+ * the pushes to every snapshot that covers the timestamp. Nothing may
+ * come between this and commit_stamp() of those versions: readers of
+ * their keys wait for it. */
+static unsigned long commit_begin(void) {
+    return __atomic_add_fetch(&commit_clock, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Stamps version, pushed by a commit, with the commit's timestamp ts,
+ * which makes it visible. */
+static inline void commit_stamp(version_t *version, unsigned long ts) {
+    __atomic_store_n(&version->ts, ts, __ATOMIC_RELEASE);
+}
+
+/* Returns the timestamp of version, waiting for its commit to stamp it if
+ * it is pending. */
+static unsigned long version_ts(version_t *version) {
+    unsigned long ts = __atomic_load_n(&version->ts, __ATOMIC_ACQUIRE);
+    if (ts != TS_PENDING)
+        return ts;
+    __atomic_fetch_add(&pending_waits, 1, __ATOMIC_RELAXED);
+    for (int spins = 0; (ts = __atomic_load_n(&version->ts, __ATOMIC_ACQUIRE)) == TS_PENDING;
+         spins++) {
+        // The stamp is a few instructions away unless the writer was
+        // preempted right there.
+        if (spins < PENDING_SPINS)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+    return ts;
+}
+
+static version_t *version_constructor(value_t *value) {
+    version_t *version = (version_t *)malloc(sizeof(version_t));
+    if (version == 0)
+        return 0;
+    version->ts = 0;
+    version->value = value;
+    version->older = 0;
+    __atomic_fetch_add(&gc.versions, 1, __ATOMIC_RELAXED);
+    return version;
+}
+
+/* Frees a version and every older one. */
+static void version_destructor(version_t *version) {
+    while (version) {
+        version_t *older = version->older;
+        value_release(version->value);
+        free(version);
+        __atomic_fetch_sub(&gc.versions, 1, __ATOMIC_RELAXED);
+        version = older;
+    }
+}
+
+/* Pushes version onto node, which the caller has write-locked, pending
+ * until commit_stamp(). */
+static void version_push(node_t *node, version_t *version) {
+    version->ts = TS_PENDING;
+    version->older = node->versions;
+    __atomic_store_n(&node->versions, version, __ATOMIC_RELEASE);
+}
+
+/* Returns the version of node that a read at snap sees, or 0 if the key
+ * did not exist yet at snap. */
+static version_t *version_at(node_t *node, unsigned long snap) {
+    version_t *version = __atomic_load_n(&node->versions, __ATOMIC_ACQUIRE);
+    while (version && version_ts(version) > snap)
+        version = __atomic_load_n(&version->older, __ATOMIC_ACQUIRE);
+    return version;
+}
+
+/* Returns 1 if the newest version of node, which the caller has locked,
+ * holds a value. */
+static inline int node_live(node_t *node) {
+    return node->versions && node->versions->value;
+}
+
+/* Files node under value, its newest version, in the secondary index, or
+ * takes it out if value is NULL. Called with node write-locked, for every
+ * version pushed onto it, so the index follows the latest commits. */
+static void node_reindex(node_t *node, value_t *value) {
+    if (!index_enabled)
+        return;
+    index_remove(&node->ix);
+    if (value)
+        index_insert(&node->ix, value);
+}
+
+/* Hands node to the collector. Called with node write-locked. */
+static void gc_enqueue(node_t *node) {
+    if (node->gc_queued)
+        return;
+    node->gc_queued = 1;
+    node_t *top = __atomic_load_n(&gc.dirty, __ATOMIC_RELAXED);
+    do {
+        node->gc_next = top;
+    } while (!__atomic_compare_exchange_n(&gc.dirty, &top, node, 1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/* Creates a node for arg_name, name_len bytes long, holding a copy of the
+ * name and no versions yet. */
+node_t *node_constructor(char *arg_name, size_t name_len, node_t *arg_left, node_t *arg_right) {
+    if (name_len > MAX_KEYLEN)
+        return 0;
+
+    shard_t *shard = shard_of(arg_name);
+    node_t *new_node = (node_t *)shard_alloc(shard, sizeof(node_t));
+    
+    if (new_node == 0)
+        return 0;
+    
+    if ((new_node->name = (char *)shard_alloc(shard, name_len+1)) == 0) {
+        shard_free(shard, new_node, sizeof(node_t));
+        return 0;
+    }
+    memcpy(new_node->name, arg_name, name_len+1);
+#ifdef FIXED_KEYS
+    new_node->key = key_probe(arg_name);
+#endif
+    // Heap memory is first touched here, on the node this thread runs on.
+    new_node->home = shard->node < 0 ? numa_current_node() : shard->node;
+    new_node->versions = 0;
+    new_node->gc_next = 0;
+    new_node->gc_queued = 0;
+    new_node->unlinked = 0;
+    new_node->block = 0;
+    new_node->shard = shard;
+    memset(&new_node->ix, 0, sizeof(new_node->ix));
+
+    if (pthread_rwlock_init(&new_node->rw_lock, 0)) {
+    	perror("could not initialize read-write lock:\n");
+        shard_free(shard, new_node->name, name_len+1);
+        shard_free(shard, new_node, sizeof(node_t));
+        return 0;
+    }
+    new_node->lchild = arg_left;
+    new_node->rchild = arg_right;
+    return new_node;
+}
+
+
+/*
+ * A block of memory holding the nodes of one rebuild (see db_rebalance()),
+ * their keys after them. It is freed with the last of its nodes.
+ */
+typedef struct node_block {
+    int count;  // Nodes laid out in the block
+    int live;  // Of those, not yet freed
+    size_t size;  // Bytes allocated
+} node_block_t;
+
+// Room in a block before its first node, for the block's header.
+#define BLOCK_HEADER 64
+
+// Nodes in a block start on cache lines of their own.
+#define NODE_STRIDE ((sizeof(node_t) + 63) & ~(size_t)63)
+
+#define BLOCK_NODE(block, i) ((node_t *)((char *)(block) + BLOCK_HEADER + (i) * NODE_STRIDE))
+
+// Bytes held by blocks
+static long block_bytes;
+
+// Value of unlinked for a node replaced by a copy, which took over its
+// versions and index link.
+#define NODE_MOVED 2
+
+void node_destructor(node_t *node) {
+    shard_t *shard = node->shard;
+    if (node->unlinked != NODE_MOVED)
+        version_destructor(node->versions);
+    if (pthread_rwlock_destroy(&node->rw_lock)) {
+        perror("could not destroy read-write lock:\n");
+        exit(1);
+    }
+    if (node->block == 0) {
+        shard_free(shard, node->name, strlen(node->name) + 1);
+        shard_free(shard, node, sizeof(node_t));
+    } else if (--node->block->live == 0) {
+        __atomic_fetch_sub(&block_bytes, node->block->size, __ATOMIC_RELAXED);
+        shard_free(shard, node->block, node->block->size);
+    }
+}
+
+/* Finds the node holding name without taking any locks. The caller must
+ * be inside read_begin()/read_end(). */
+static node_t *find(char *name) {
+    shard_t *shard = shard_of(name);
+    probe_t probe = key_probe(name);
+    int cmp;
+    // Every key sorts after the head's empty one.
+    node_t *node = __atomic_load_n(&shard->head.rchild, __ATOMIC_ACQUIRE);
+    while (node && (cmp = key_cmp(probe, node)) != 0) {
+        node = cmp < 0 ? __atomic_load_n(&node->lchild, __ATOMIC_ACQUIRE)
+                       : __atomic_load_n(&node->rchild, __ATOMIC_ACQUIRE);
+    }
+    // Where the search ended stands for where its whole path lies.
+    numa_count(node ? node->home : shard->node);
+    return node;
+}
+
+/* db_query() for a key whose length is known. */
+static value_t *query(char *name, size_t name_len) {
+    value_t *value = 0;
+    if (!key_fits(name))
+        return 0;
+    // A key the filter has not counted was not present when the filter
+    // was read, so the query may as well have run then.
+    if (bloom_enabled && !bloom_check(name, name_len))
+        return 0;
+    unsigned long snap = read_begin();
+    node_t *target = find(name);
+    version_t *version = target ? version_at(target, snap) : 0;
+    // The reference keeps the value alive after the read ends, even if
+    // the key is removed while the caller is still sending it.
+    if (version && version->value)
+        value = value_ref(version->value);
+    read_end();
+    if (bloom_enabled && value == 0)
+        bloom_false_positive();
+    return value;
+}
+
+value_t *db_query(char *name) {
+    return query(name, strlen(name));
+}
+
+/* The keys collected by db_keys(), separated by spaces. */
+typedef struct key_list {
+    char *buf;
+    size_t len;
+    size_t cap;
+} key_list_t;
+
+static int key_list_append(index_link_t *link, void *arg) {
+    key_list_t *list = (key_list_t *)arg;
+    node_t *node = (node_t *)((char *)link - offsetof(node_t, ix));
+    // The index is shared; other keyspaces' keys are not listed.
+    if (node->shard->space != space_get())
+        return 0;
+    const char *name = node->name;
+    size_t name_len = strlen(name);
+    size_t need = list->len + (list->len > 0) + name_len;
+    if (need > MAX_VALUELEN)
+        return 1;
+    if (need > list->cap) {
+        size_t cap = list->cap ? list->cap : 256;
+        while (cap < need)
+            cap *= 2;
+        char *grown = realloc(list->buf, cap);
+        if (grown == NULL)
+            return 1;
+        list->buf = grown;
+        list->cap = cap;
+    }
+    if (list->len > 0)
+        list->buf[list->len++] = ' ';
+    memcpy(list->buf + list->len, name, name_len);
+    list->len += name_len;
+    return 0;
+}
+
+/* db_keys() for a value whose length is known. */
+static value_t *keys_of(char *value, size_t value_len) {
+    key_list_t list = {NULL, 0, 0};
+    value_t *probe;
+    value_t *keys = NULL;
+    // Stored the way a key holding it would store it, compressed or not.
+    if ((probe = value_create(value, value_len)) == NULL)
+        return NULL;
+    index_lookup(probe, key_list_append, &list);
+    value_release(probe);
+    if (list.len > 0)
+        keys = value_create(list.buf, list.len);
+    free(list.buf);
+    return keys;
+}
+
+value_t *db_keys(char *value) {
+    return keys_of(value, strlen(value));
+}
+
+/* Descends from the head of shard towards name with read-lock coupling,
+ * keeping both the current node and its parent read-locked. Stops at the
+ * node holding name, or at the node whose child slot for name is empty.
+ *
+ * On return *parentp is the last node passed that does not hold name and
+ * *gparentp is its parent, or NULL when *parentp is the head; both are
+ * read-locked. Returns the node holding name, read-locked as well, or 0. */
+static node_t *descend(shard_t *shard, char *name, node_t **gparentp, node_t **parentp) {
+    probe_t probe = key_probe(name);
+    node_t *gparent = 0;
+    node_t *parent = &shard->head;
+    node_t *next;
+    int cmp = 1;  // Every key sorts after the head's empty one.
+    lock(0, &parent->rw_lock);
+    while (1) {
+        next = cmp < 0 ? parent->lchild : parent->rchild;
+        if (next == 0)
+            break;
+        lock(0, &next->rw_lock);
+        if ((cmp = key_cmp(probe, next)) == 0)
+            break;
+        if (gparent)
+            unlock(&gparent->rw_lock);
+        gparent = parent;
+        parent = next;
+    }
+    numa_count(next ? next->home : shard->node);
+    *gparentp = gparent;
+    *parentp = parent;
+    return next;
+}
+
+/* Trades the read lock on parent for a write lock. The caller must hold a
+ * read lock on the parent's parent, if any: that is what keeps parent in
+ * place meanwhile, since unlinking parent needs that node write-locked. */
+static void upgrade(node_t *parent) {
+    unlock(&parent->rw_lock);
+    lock(1, &parent->rw_lock);
+}
+
+/* Counts descents thrown away because the tree changed during an upgrade. */
+static long write_restarts;
+
+/* db_add() for a key and value whose lengths are known. */
+static int add(char *name, size_t name_len, char *value, size_t value_len) {
+    node_t *gparent;
+    node_t *parent;
+    node_t *target;
+    node_t *newnode;
+    node_t **slot;
+    value_t *val;
+    version_t *version;
+
+    if (!key_fits(name))
+        return(-1);
+    if ((val = value_create(value, value_len)) == 0)
+        return(-1);
+    if ((version = version_constructor(val)) == 0) {
+        value_release(val);
+        return(-1);
+    }
+    // Charged up front, and given back if nothing is added after all
+    long bytes = name_len + val->len;
+    if (!space_charge(bytes)) {
+        version_destructor(version);
+        return(-3);
+    }
+
+    // Writers descend with read locks, like readers, so that adds to
+    // disjoint parts of the tree never serialize on the head. Only the
+    // node that receives the new child is write-locked, at the very end.
+    while (1) {
+        if ((target = descend(shard_of(name), name, &gparent, &parent)) != 0) {
+            // The key has a node. Unless it was removed, it is already
+            // in the database; otherwise the add revives that node.
+            if (gparent)
+                unlock(&gparent->rw_lock);
+            upgrade(target);
+            unlock(&parent->rw_lock);
+            if (node_live(target)) {
+                unlock(&target->rw_lock);
+                version_destructor(version);
+                space_charge(-bytes);
+                return(0);
+            }
+            // Counted before the key is visible, so that the filter never
+            // rejects a key a reader could find.
+            if (bloom_enabled)
+                bloom_add(name, name_len);
+            version_push(target, version);
+            commit_stamp(version, commit_begin());
+            node_reindex(target, val);
+            __atomic_fetch_sub(&gc.removed, 1, __ATOMIC_RELAXED);
+            count_keys(1);
+            gc_enqueue(target);
+            db_changed('a', name, val);
+            unlock(&target->rw_lock);
+            return(1);
+        }
+        upgrade(parent);
+        slot = key_cmp(key_probe(name), parent) < 0 ? &parent->lchild : &parent->rchild;
+        if (*slot == 0)
+            break;
+        // Another add filled the slot while we held no lock on parent.
+        unlock(&parent->rw_lock);
+        if (gparent)
+            unlock(&gparent->rw_lock);
+        __atomic_fetch_add(&write_restarts, 1, __ATOMIC_RELAXED);
+    }
+    if (gparent)
+        unlock(&gparent->rw_lock);
+
+    if ((newnode = node_constructor(name, name_len, 0, 0)) == 0) {
+        unlock(&parent->rw_lock);
+        version_destructor(version);
+        space_charge(-bytes);
+        return(-1);
+    }
+    if (bloom_enabled)
+        bloom_add(name, name_len);
+    version_push(newnode, version);
+    // Readers may follow the new link as soon as it is stored; it is in
+    // place before the timestamp, so that every snapshot that covers the
+    // timestamp finds the node.
+    __atomic_store_n(slot, newnode, __ATOMIC_RELEASE);
+    commit_stamp(version, commit_begin());
+    node_reindex(newnode, val);
+    count_keys(1);
+    db_changed('a', name, val);
+    // Parent to whom new node is to be added.
+    unlock(&parent->rw_lock);
+    return(1);
+}
+
+int db_add(char *name, char *value) {
+    return add(name, strlen(name), value, strlen(value));
+}
+
+/* db_remove() for a key whose length is known. */
+static int remove_key(char *name, size_t name_len) {
+    node_t *gparent;
+    node_t *parent;
+    node_t *dnode;
+    version_t *version;
+
+    if (!key_fits(name))
+        return(0);
+    if (bloom_enabled && !bloom_check(name, name_len))
+        return(0);
+    if ((version = version_constructor(0)) == 0)
+        return(0);
+
+    // first, find the node to be removed, with read locks only
+    if ((dnode = descend(shard_of(name), name, &gparent, &parent)) == 0) {
+        // it's not there
+        unlock(&parent->rw_lock);
+        if (gparent)
+            unlock(&gparent->rw_lock);
+        version_destructor(version);
+        if (bloom_enabled)
+            bloom_false_positive();
+        return(0);
+    }
+    if (gparent)
+        unlock(&gparent->rw_lock);
+    // The read lock on parent keeps dnode linked until it is write-locked.
+    upgrade(dnode);
+    unlock(&parent->rw_lock);
+    if (!node_live(dnode)) {
+        // Removed already
+        unlock(&dnode->rw_lock);
+        version_destructor(version);
+        if (bloom_enabled)
+            bloom_false_positive();
+        return(0);
+    }
+
+    // A removal is a version without a value. The node stays in the tree,
+    // with its key, for readers at older snapshots; the collector unlinks
+    // it once none is left.
+    space_charge(-entry_bytes(name_len, dnode->versions->value));
+    version_push(dnode, version);
+    commit_stamp(version, commit_begin());
+    node_reindex(dnode, 0);
+    __atomic_fetch_add(&gc.removed, 1, __ATOMIC_RELAXED);
+    count_keys(-1);
+    gc_enqueue(dnode);
+    db_changed('d', name, 0);
+    unlock(&dnode->rw_lock);
+    // Uncounted only once no new reader can find the key.
+    if (bloom_enabled)
+        bloom_remove(name, name_len);
+    return(1);
+}
+
+int db_remove(char *name) {
+    return remove_key(name, strlen(name));
+}
+
+/*
+ * Transactions.
+ *
+ * A transaction buffers its writes and remembers, for every key it looked
+ * at, the timestamp of the key's value at the time (0 if the key had none).
+ * A missing key is remembered as missing, whether it was removed or never
+ * added, since the collector may unlink a removed key's node in between
+ * and it is still missing all the same. Reads take the latest committed state of a key and take no
+ * locks. At commit, every key the transaction touched is write-locked in
+ * key order and checked against those timestamps; if none changed, what
+ * the transaction read is still the state of the database, and its writes
+ * are pushed under one commit timestamp, so that readers see all or none
+ * of them. The transaction is serialized at that timestamp.
+ *
+ * Checking a key that has no node needs something to lock, so commit
+ * first gives every such key an empty node: one with no versions, which
+ * readers take for a missing key and the collector unlinks if nothing is
+ * written to it.
+ */
+
+// Keys one transaction may touch.
+#define TXN_MAX_KEYS 1024
+
+typedef struct txn_entry {
+    char *name;
+    int read;  // The outcome depended on the key's state...
+    unsigned long read_ts;  // ...which was the value with this timestamp, 0 for none
+    int write;  // The key is written at commit...
+    value_t *value;  // ...with this value, or removed if NULL
+    node_t *node;  // Found or made for the key at commit
+    version_t *version;  // Allocated for the write at commit
+    version_t *pushed;  // The version once pushed onto the node
+    int was_live;  // The key was present when it was pushed
+} txn_entry_t;
+
+struct txn {
+    txn_entry_t *entries;
+    int num_entries;
+    int cap;
+};
+
+static unsigned long txn_commits;
+static unsigned long txn_conflicts;
+
+txn_t *txn_begin(void) {
+    return (txn_t *)calloc(1, sizeof(txn_t));
+}
+
+void txn_abort(txn_t *txn) {
+    if (txn == NULL)
+        return;
+    for (int i = 0; i < txn->num_entries; i++) {
+        free(txn->entries[i].name);
+        value_release(txn->entries[i].value);
+        if (txn->entries[i].version)
+            version_destructor(txn->entries[i].version);
+    }
+    free(txn->entries);
+    free(txn);
+}
+
+/* Returns the entry of txn for name, adding one if there is none.
+ * Returns NULL if the transaction is full or memory ran out. */
+static txn_entry_t *txn_entry(txn_t *txn, char *name) {
+    txn_entry_t *entry;
+    for (int i = 0; i < txn->num_entries; i++) {
+        if (strcmp(txn->entries[i].name, name) == 0)
+            return &txn->entries[i];
+    }
+    if (txn->num_entries == TXN_MAX_KEYS) {
+        errno = E2BIG;
+        return NULL;
+    }
+    if (txn->num_entries == txn->cap) {
+        int cap = txn->cap ? txn->cap * 2 : 8;
+        txn_entry_t *grown = realloc(txn->entries, cap * sizeof(txn_entry_t));
+        if (grown == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        txn->entries = grown;
+        txn->cap = cap;
+    }
+    entry = &txn->entries[txn->num_entries];
+    memset(entry, 0, sizeof(*entry));
+    if ((entry->name = strdup(name)) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    txn->num_entries++;
+    return entry;
+}
+
+/* Returns a reference to the value of entry's key as the transaction sees
+ * it, or NULL if the key has none. A key not written by the transaction is
+ * read from the database, and the version read is remembered for commit. */
+static value_t *txn_read(txn_entry_t *entry) {
+    value_t *value = NULL;
+    if (entry->write)
+        return entry->value ? value_ref(entry->value) : NULL;
+    unsigned long snap = read_begin();
+    node_t *node = find(entry->name);
+    version_t *version = node ? version_at(node, snap) : 0;
+    if (!entry->read) {
+        entry->read = 1;
+        entry->read_ts = version && version->value ? version_ts(version) : 0;
+    }
+    if (version && version->value)
+        value = value_ref(version->value);
+    read_end();
+    return value;
+}
+
+int txn_query(txn_t *txn, char *name, value_t **valuep) {
+    txn_entry_t *entry;
+    if (!key_fits(name))
+        return 0;
+    if ((entry = txn_entry(txn, name)) == NULL)
+        return errno == E2BIG ? -2 : -1;
+    return (*valuep = txn_read(entry)) != NULL;
+}
+
+/* txn_add() for a value whose length is known. */
+static int txn_put(txn_t *txn, char *name, char *value, size_t value_len) {
+    txn_entry_t *entry;
+    value_t *old;
+    value_t *val;
+    if (!key_fits(name))
+        return -1;
+    if ((entry = txn_entry(txn, name)) == NULL)
+        return errno == E2BIG ? -2 : -1;
+    if ((old = txn_read(entry)) != NULL) {
+        value_release(old);
+        return 0;
+    }
+    if ((val = value_create(value, value_len)) == NULL)
+        return -1;
+    entry->write = 1;
+    entry->value = val;
+    return 1;
+}
+
+int txn_add(txn_t *txn, char *name, char *value) {
+    return txn_put(txn, name, value, strlen(value));
+}
+
+int txn_remove(txn_t *txn, char *name) {
+    txn_entry_t *entry;
+    value_t *old;
+    if (!key_fits(name))
+        return 0;
+    if ((entry = txn_entry(txn, name)) == NULL)
+        return errno == E2BIG ? -2 : -1;
+    if ((old = txn_read(entry)) == NULL)
+        return 0;
+    value_release(old);
+    value_release(entry->value);
+    entry->write = 1;
+    entry->value = NULL;
+    return 1;
+}
+
+/* Returns the node for name, making an empty one if there is none. The
+ * node is not locked; the caller must be inside read_begin()/read_end(),
+ * which keeps the node from being freed, and must check that it is still
+ * linked once it locks it. Returns NULL if memory ran out. */
+static node_t *node_materialize(char *name) {
+    node_t *gparent;
+    node_t *parent;
+    node_t *target;
+    node_t *newnode;
+    node_t **slot;
+
+    while (1) {
+        if ((target = descend(shard_of(name), name, &gparent, &parent)) != 0) {
+            unlock(&target->rw_lock);
+            unlock(&parent->rw_lock);
+            if (gparent)
+                unlock(&gparent->rw_lock);
+            return target;
+        }
+        upgrade(parent);
+        slot = key_cmp(key_probe(name), parent) < 0 ? &parent->lchild : &parent->rchild;
+        if (*slot == 0)
+            break;
+        unlock(&parent->rw_lock);
+        if (gparent)
+            unlock(&gparent->rw_lock);
+        __atomic_fetch_add(&write_restarts, 1, __ATOMIC_RELAXED);
+    }
+    if (gparent)
+        unlock(&gparent->rw_lock);
+    if ((newnode = node_constructor(name, strlen(name), 0, 0)) == 0) {
+        unlock(&parent->rw_lock);
+        return 0;
+    }
+    // Counted as removed until written, and left to the collector if it never is.
+    __atomic_fetch_add(&gc.removed, 1, __ATOMIC_RELAXED);
+    gc_enqueue(newnode);
+    __atomic_store_n(slot, newnode, __ATOMIC_RELEASE);
+    unlock(&parent->rw_lock);
+    return newnode;
+}
+
+static int txn_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const txn_entry_t *)a)->name, ((const txn_entry_t *)b)->name);
+}
+
+static void txn_unlock(txn_t *txn, int n) {
+    for (int i = 0; i < n; i++)
+        unlock(&txn->entries[i].node->rw_lock);
+}
+
+/* Pushes the write of entry onto its node, which is write-locked, pending
+ * until the commit takes its timestamp. */
+static void txn_apply(txn_entry_t *entry) {
+    node_t *node = entry->node;
 
+    entry->was_live = node_live(node);
+    // Adding and then removing a missing key leaves nothing to write.
+    if (!entry->was_live && entry->value == NULL)
+        return;
+    // Counted before the key is visible, as db_add() does
+    if (bloom_enabled && !entry->was_live)
+        bloom_add(node->name, strlen(node->name));
+    version_push(node, entry->version);
+    entry->pushed = entry->version;
+    entry->version = NULL;
+}
 
+/* Does what follows the write of entry once its version is stamped. */
+static void txn_publish(txn_entry_t *entry) {
+    node_t *node = entry->node;
+    int was_live = entry->was_live;
+    value_t *value = entry->value;
 
-node_t head = {"", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER};
+    node_reindex(node, node->versions->value);
+    if (was_live && value) {
+        // Replaced by a remove and an add of the same key.
+        db_changed('d', node->name, 0);
+        db_changed('a', node->name, value);
+    } else if (value) {
+        __atomic_fetch_sub(&gc.removed, 1, __ATOMIC_RELAXED);
+        count_keys(1);
+        db_changed('a', node->name, value);
+    } else {
+        __atomic_fetch_add(&gc.removed, 1, __ATOMIC_RELAXED);
+        count_keys(-1);
+        db_changed('d', node->name, 0);
+    }
+    gc_enqueue(node);
+}
 
-node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left, node_t *arg_right) {
-    size_t name_len = strlen(arg_name);
-    size_t val_len = strlen(arg_value);
-    if (name_len > MAXLEN || val_len > MAXLEN)
-        return 0;
+int txn_commit(txn_t *txn) {
+    int ret = 1;
+    int n = txn->num_entries;
+    int locked;
+    unsigned long ts;
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
-    
-    if (new_node == 0)
-        return 0;
-    
-    if ((new_node->name = (char *)malloc(name_len+1)) == 0) {
-        free(new_node);
-        return 0;
+    for (int i = 0; i < n; i++) {
+        txn_entry_t *entry = &txn->entries[i];
+        if (!entry->write)
+            continue;
+        value_t *value = entry->value ? value_ref(entry->value) : NULL;
+        if ((entry->version = version_constructor(value)) == 0) {
+            value_release(value);
+            txn_abort(txn);
+            return -1;
+        }
     }
-    
-    if ((new_node->value = (char *)malloc(val_len+1)) == 0) {
-        free(new_node->name);
-        free(new_node);
-        return 0;
+    if (n == 0) {
+        txn_abort(txn);
+        return 1;
     }
+    qsort(txn->entries, n, sizeof(txn_entry_t), txn_entry_cmp);
 
-    if ((snprintf(new_node->name, MAXLEN, "%s", arg_name)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
-    } else if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
+    // Keeps the nodes found below from being freed while this runs.
+    read_begin();
+    while (1) {
+        for (int i = 0; i < n; i++) {
+            txn_entry_t *entry = &txn->entries[i];
+            if ((entry->node = find(entry->name)) == 0 &&
+                (entry->node = node_materialize(entry->name)) == 0) {
+                read_end();
+                txn_abort(txn);
+                return -1;
+            }
+        }
+        // Locked in key order, but without waiting: a writer may be holding a
+        // read lock on one of these nodes while it waits for another.
+        for (locked = 0; locked < n; locked++) {
+            node_t *node = txn->entries[locked].node;
+            if (!trylock(1, &node->rw_lock))
+                break;
+            if (node->unlinked) {
+                // Unlinked by the collector since it was found
+                unlock(&node->rw_lock);
+                break;
+            }
+        }
+        if (locked == n)
+            break;
+        txn_unlock(txn, locked);
+        __atomic_fetch_add(&write_restarts, 1, __ATOMIC_RELAXED);
+        sched_yield();
     }
 
-    if (pthread_rwlock_init(&new_node->rw_lock, 0)) {
-    	perror("could not initialize read-write lock:\n");
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
-        return 0;
+    for (int i = 0; i < n; i++) {
+        txn_entry_t *entry = &txn->entries[i];
+        node_t *node = entry->node;
+        // A new node's first version is stamped under its parent's lock
+        // only, so it may still be pending here.
+        if (entry->read && (node_live(node) ? version_ts(node->versions) : 0) != entry->read_ts) {
+            ret = 0;
+            break;
+        }
     }
-    new_node->lchild = arg_left;
-    new_node->rchild = arg_right;
-    return new_node;
+    if (ret) {
+        // With every key locked, the bytes the writes add and free are known.
+        long bytes = 0;
+        for (int i = 0; i < n; i++) {
+            txn_entry_t *entry = &txn->entries[i];
+            if (!entry->write)
+                continue;
+            if (entry->value)
+                bytes += entry_bytes(strlen(entry->name), entry->value);
+            if (node_live(entry->node))
+                bytes -= entry_bytes(strlen(entry->name), entry->node->versions->value);
+        }
+        if (!space_charge(bytes))
+            ret = -3;
+    }
+    if (ret > 0) {
+        for (int i = 0; i < n; i++) {
+            if (txn->entries[i].write)
+                txn_apply(&txn->entries[i]);
+        }
+        // One timestamp for all the writes: readers see all or none.
+        ts = commit_begin();
+        for (int i = 0; i < n; i++) {
+            if (txn->entries[i].pushed)
+                commit_stamp(txn->entries[i].pushed, ts);
+        }
+        for (int i = 0; i < n; i++) {
+            if (txn->entries[i].pushed)
+                txn_publish(&txn->entries[i]);
+        }
+        txn_unlock(txn, n);
+        // Uncounted once no new reader can find the keys
+        for (int i = 0; i < n; i++) {
+            txn_entry_t *entry = &txn->entries[i];
+            if (bloom_enabled && entry->pushed && entry->was_live && !entry->value)
+                bloom_remove(entry->name, strlen(entry->name));
+        }
+    } else {
+        txn_unlock(txn, n);
+    }
+    read_end();
+    if (ret >= 0)
+        __atomic_fetch_add(ret ? &txn_commits : &txn_conflicts, 1, __ATOMIC_RELAXED);
+    txn_abort(txn);
+    return ret;
 }
 
+/*
+ * Something taken out of the tree by the collector: a node, or a chain of
+ * versions trimmed off a node, and the epoch in which that happened.
+ */
+typedef struct retired {
+    unsigned long epoch;
+    node_t *node;
+    version_t *versions;
+} retired_t;
 
-void node_destructor(node_t *node) {
-    if (node->name != 0)
-        free(node->name);
-    if (node->value != 0)
-        free(node->value);
-    if (pthread_rwlock_destroy(&node->rw_lock)) {
-        perror("could not destroy read-write lock:\n");
-        free(node);
-        exit(1);
+static void gc_retire(node_t *node, version_t *versions) {
+    if (gc.limbo_len == gc.limbo_cap) {
+        size_t cap = gc.limbo_cap ? gc.limbo_cap * 2 : 1024;
+        retired_t *grown = realloc(gc.limbo, cap * sizeof(retired_t));
+        if (grown == 0) {
+            perror("realloc");
+            exit(1);
+        }
+        gc.limbo = grown;
+        gc.limbo_cap = cap;
     }
-    free(node);
+    retired_t *item = &gc.limbo[gc.limbo_len];
+    __atomic_store_n(&gc.limbo_len, gc.limbo_len + 1, __ATOMIC_RELAXED);
+    item->epoch = __atomic_load_n(&gc.epoch, __ATOMIC_SEQ_CST);
+    item->node = node;
+    item->versions = versions;
 }
 
-node_t *search(char *, node_t *, node_t **, int locktype);
+/* Frees what was retired before the oldest epoch any reader announced:
+ * readers that began later cannot have reached it. */
+static void gc_reclaim(void) {
+    unsigned long min = __atomic_load_n(&gc.epoch, __ATOMIC_SEQ_CST);
+    for (reader_t *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < min)
+            min = epoch;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < gc.limbo_len; i++) {
+        retired_t *item = &gc.limbo[i];
+        if (item->epoch >= min) {
+            gc.limbo[kept++] = *item;
+        } else if (item->node) {
+            node_destructor(item->node);
+        } else {
+            version_destructor(item->versions);
+        }
+    }
+    __atomic_store_n(&gc.limbo_len, kept, __ATOMIC_RELAXED);
+}
 
-void db_query(char *name, char *result, int len) {
-    // TODO: Make this thread-safe!
-    node_t *target;
-    lock(0, &head.rw_lock);
-    target = search(name, &head, 0, 0);
-    if (target == 0) {
-        snprintf(result, len, "not found");
+/* Returns the oldest snapshot any reader may still be reading. */
+static unsigned long gc_oldest_snapshot(void) {
+    // commit_clock is read before the slots: a reader that announces itself
+    // after the scan takes a snapshot no older than this.
+    unsigned long oldest = __atomic_load_n(&commit_clock, __ATOMIC_SEQ_CST);
+    for (reader_t *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long snap = __atomic_load_n(&r->snap, __ATOMIC_SEQ_CST);
+        if (snap < oldest)
+            oldest = snap;
+    }
+    return oldest;
+}
+
+/* Takes node, whose last version is a removal no snapshot can see past,
+ * out of the tree if it has at most one child. Locks as a writer does:
+ * the parent with the grandparent read-locked, then the node. */
+static void gc_unlink(node_t *node) {
+    node_t *gparent;
+    node_t *parent;
+    node_t **slot;
+    node_t *target = descend(node->shard, node->name, &gparent, &parent);
+    if (target)
+        unlock(&target->rw_lock);
+    if (target != node) {
+        unlock(&parent->rw_lock);
+        if (gparent)
+            unlock(&gparent->rw_lock);
         return;
-    } else {
-        snprintf(result, len, "%s", target->value);
-        pthread_rwlock_unlock(&target->rw_lock);
+    }
+    upgrade(parent);
+    if (gparent)
+        unlock(&gparent->rw_lock);
+    slot = key_cmp(node_probe(node), parent) < 0 ? &parent->lchild : &parent->rchild;
+    lock(1, &node->rw_lock);
+    // Revived, removed again or handed back to the collector meanwhile, or
+    // it routes searches to two subtrees: leave it for now. A node with two
+    // children is looked at again once one of them is unlinked.
+    if (*slot != node || node_live(node) || (node->versions && node->versions->older) ||
+        node->gc_queued ||
+        (node->lchild && node->rchild)) {
+        unlock(&node->rw_lock);
+        unlock(&parent->rw_lock);
         return;
     }
+    __atomic_store_n(slot, node->lchild ? node->lchild : node->rchild, __ATOMIC_RELEASE);
+    node->unlinked = 1;
+    if (!is_head(parent) && !node_live(parent))
+        gc_enqueue(parent);
+    unlock(&node->rw_lock);
+    unlock(&parent->rw_lock);
+    __atomic_fetch_sub(&gc.removed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&gc.unlinked, 1, __ATOMIC_RELAXED);
+    // Readers already at the node still find its children and its removal.
+    gc_retire(node, 0);
 }
 
-int db_add(char *name, char *value) {
-    // TODO: Make this thread-safe!
-    node_t *parent;
-    node_t *target;
-    node_t *newnode;
-    lock(1, &head.rw_lock);
-    if ((target = search(name, &head, &parent, 1)) != 0) {
-    	if (pthread_rwlock_unlock(&target->rw_lock)){
-        	perror("could not unlock read-write lock\n");
-        	exit(1);
-        }
-        if (pthread_rwlock_unlock(&parent->rw_lock)){
-        	perror("could not unlock read-write lock\n");
-        	exit(1);
-        }
-        return(0);
+/* Trims the versions of node that no snapshot from oldest on can see, and
+ * unlinks the node if all that is left is an old removal. */
+static void gc_node(node_t *node, unsigned long oldest) {
+    version_t *version;
+    version_t *cut = 0;
+    int dead;
+
+    lock(1, &node->rw_lock);
+    node->gc_queued = 0;
+    if (node->unlinked == NODE_MOVED) {
+        // Its copy was handed over in its place.
+        unlock(&node->rw_lock);
+        return;
     }
-    
-    newnode = node_constructor(name, value, 0, 0);
+    // The newest version no newer than oldest is what the oldest reader
+    // sees; every reader stops there or sooner, so older ones can go.
+    for (version = node->versions;
+         version && __atomic_load_n(&version->ts, __ATOMIC_ACQUIRE) > oldest;
+         version = version->older)
+        ;
+    if (version && version->older) {
+        cut = version->older;
+        __atomic_store_n(&version->older, 0, __ATOMIC_RELEASE);
+    }
+    // A node without versions was made for a transaction that never wrote it.
+    dead = !node_live(node) &&
+           (!node->versions || __atomic_load_n(&node->versions->ts, __ATOMIC_ACQUIRE) <= oldest);
+    if ((node->versions && node->versions->older) || (!node_live(node) && !dead))
+        gc_enqueue(node);  // Look again in the next cycle
+    unlock(&node->rw_lock);
 
-    if (strcmp(name, parent->name) < 0)
-        parent->lchild = newnode;
-    else
-        parent->rchild = newnode;
-    // Parent to whom new node is to be added.
-    if (pthread_rwlock_unlock(&parent->rw_lock)){
-    	perror("could not unlock read-write lock\n");
-    	exit(1);
+    if (cut) {
+        for (version = cut; version; version = version->older)
+            __atomic_fetch_add(&gc.trimmed, 1, __ATOMIC_RELAXED);
+        gc_retire(0, cut);
     }
-    return(1);
+    if (dead)
+        gc_unlink(node);
 }
 
-int db_remove(char *name) {
-    // TODO: Make this thread-safe!
+/* Runs one collection: advances the epoch, works through the nodes
+ * handed over since the last one and frees what readers are done with. */
+static void gc_cycle(void) {
+    __atomic_add_fetch(&gc.epoch, 1, __ATOMIC_SEQ_CST);
+    unsigned long oldest = gc_oldest_snapshot();
+    node_t *node = __atomic_exchange_n(&gc.dirty, 0, __ATOMIC_ACQUIRE);
+    while (node) {
+        node_t *next = node->gc_next;
+        gc_node(node, oldest);
+        node = next;
+    }
+    gc_reclaim();
+}
+
+/*
+ * Rebalancing.
+ *
+ * Keys are only ever added as leaves, so the shape of a tree follows the
+ * order its keys arrived in, and its nodes lie wherever the heap put them.
+ * When db_rebalance() allows it, the collector walks the trees one at a
+ * time. It reads a tree in key order, without locks, noting the size and
+ * height of every subtree, and then looks for scapegoats from the top
+ * down: subtrees with a child that holds more than REBALANCE_ALPHA of
+ * their nodes, or taller than a tree that balanced can be. It rebuilds
+ * each scapegoat it meets whole and only goes on below one it could not
+ * rebuild. A rebuilt subtree is as balanced as its size allows, and cut
+ * into parts of up to REBALANCE_NODES nodes, each laid out breadth first
+ * in one new block, with the parts below it hanging off it. One store to
+ * the parent's link swaps the copy in. Every walk weighs the whole tree
+ * again, so a rebuilt subtree that keys later pile up in is found and
+ * rebuilt in turn, and one that stays balanced is left as it is.
+ *
+ * The originals and the parent are write-locked meanwhile, with trylock
+ * only, so that a writer holding any of them keeps the subtree as it is
+ * until the next walk. Holding those locks also keeps writers off the
+ * originals for good, as with unlinking: a writer only reaches a node
+ * through its read-locked parent. Readers already on the originals find
+ * the same versions there, and the originals are retired like unlinked
+ * nodes once their copies took over their versions and index links.
+ *
+ * Only the collector moves nodes, so what a walk read of a tree stays true
+ * of it but for the leaves writers added since. Those went into the gaps
+ * between the keys read, and each gap has one empty link in the copy, so
+ * a rebuild hangs them there rather than start over.
+ */
+
+// Nodes in a part of a rebuilt subtree: a tree of height 5.
+#define REBALANCE_NODES 31
+
+// Share of a subtree's nodes one child may hold before the subtree is
+// rebuilt. A subtree taller than one balanced that way can be is rebuilt
+// as well.
+#define REBALANCE_ALPHA 0.7
+
+// CPU time saved up while there is nothing to rebuild, in seconds.
+#define REBALANCE_MAX_CREDIT 0.04
+
+/* A node as the walk read it, at its position in key order. */
+typedef struct walk_node {
+    node_t *node;
+    node_t *left;  // Its children, as read
+    node_t *right;
+    int lo;  // Its subtree spans lo to hi in key order
+    int hi;
+    int lidx;  // Positions of its children, -1 for none
+    int ridx;
+    int height;
+} walk_node_t;
+
+/* A node on the way down while the walk reads a tree. */
+typedef struct walk_frame {
+    node_t *node;
+    node_t *left;
+    node_t *right;
+    int lo;
+    int idx;
+    int lidx;
+    int stage;  // 0 before its left subtree, 1 before its right, 2 after
+} walk_frame_t;
+
+/* A subtree the walk has yet to weigh, and where it hangs. */
+typedef struct walk_todo {
+    int idx;
+    int depth;
     node_t *parent;
-    node_t *dnode;
-    node_t *next;
+} walk_todo_t;
 
-    // first, find the node to be removed
-    lock(1, &head.rw_lock);
-    if ((dnode = search(name, &head, &parent, 1)) == 0) {
-        // it's not there
-        if (pthread_rwlock_unlock(&parent->rw_lock)){
-        	perror("could not unlock read-write lock\n");
-        	exit(1);
+/* Nodes of a rebuild, from lo to hi in key order, yet to be laid out in a
+ * part, at level below the rebuilt subtree's root, to hang from slot. */
+typedef struct walk_range {
+    int lo;
+    int hi;
+    int level;
+    node_t **slot;
+} walk_range_t;
+
+/* A copy a rebuild made, of the node read at position from. */
+typedef struct walk_copy {
+    node_t *copy;
+    int from;
+    int level;
+} walk_copy_t;
+
+static struct rebalance_state {
+    int percent;  // Share of a CPU it may take, 0 when off
+    double credit;  // CPU seconds it may still take
+    double last;  // When the credit was last topped up
+    int shard;  // Next shard to walk, of shard_at()'s, -1 between walks
+    unsigned long walk_ts;  // commit_clock when the last walk began
+    // Room for walking one tree, kept for the next
+    walk_node_t *read;  // In key order
+    int cap_read;
+    walk_frame_t *frames;
+    int cap_frames;
+    walk_todo_t *todo;
+    int cap_todo;
+    walk_range_t *ranges;
+    int num_ranges;
+    int cap_ranges;
+    walk_copy_t *copies;
+    int num_copies;
+    int cap_copies;
+    node_t ***gaps;  // Empty links of the copy, by the position of the key after them
+    int gap_base;  // Position of the first key of the subtree rebuilt
+    int cap_gaps;
+    node_block_t **blocks;
+    int num_blocks;
+    int cap_blocks;
+    // The walk under way: depths of the nodes as it leaves them
+    unsigned long nodes;
+    unsigned long depth_sum;
+    int height;
+    // Counters for db_stats()
+    unsigned long walks;
+    unsigned long rebuilds;
+    unsigned long moved;
+    unsigned long skips;  // Subtrees left as they were for a writer or lack of memory
+    unsigned long cpu_ns;
+    unsigned long last_nodes;
+    unsigned long last_depth_sum;
+    int last_height;
+} rb = {.shard = -1};
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Makes room for n elements of size bytes in the array at *arrayp, of *cap
+ * elements. Returns 0, or -1 if memory ran out. */
+static int walk_grow(void *arrayp, int *cap, int n, size_t size) {
+    if (n <= *cap)
+        return 0;
+    int grown_cap = *cap ? *cap : 256;
+    while (grown_cap < n)
+        grown_cap *= 2;
+    void *grown = realloc(*(void **)arrayp, grown_cap * size);
+    if (grown == 0)
+        return -1;
+    *(void **)arrayp = grown;
+    *cap = grown_cap;
+    return 0;
+}
+
+/* Reads the subtree under root into rb.read, in key order, and stores the
+ * position of root in *rootp. Called inside read_begin()/read_end().
+ * Returns the number of nodes read, or -1 if memory ran out. */
+static int walk_read(node_t *root, int *rootp) {
+    int n = 0, depth = 0, ret = -1;
+    if (root == 0)
+        return 0;
+    if (walk_grow(&rb.frames, &rb.cap_frames, 1, sizeof(walk_frame_t)))
+        return -1;
+    rb.frames[depth++] = (walk_frame_t){.node = root};
+    while (depth > 0) {
+        walk_frame_t *f = &rb.frames[depth - 1];
+        node_t *child;
+        if (f->stage == 0) {
+            f->lo = n;
+            f->left = __atomic_load_n(&f->node->lchild, __ATOMIC_ACQUIRE);
+            f->right = __atomic_load_n(&f->node->rchild, __ATOMIC_ACQUIRE);
+            child = f->left;
+        } else if (f->stage == 1) {
+            f->lidx = f->left ? ret : -1;
+            if (walk_grow(&rb.read, &rb.cap_read, n + 1, sizeof(walk_node_t)))
+                return -1;
+            f->idx = n++;
+            child = f->right;
+        } else {
+            walk_node_t *w = &rb.read[f->idx];
+            w->node = f->node;
+            w->left = f->left;
+            w->right = f->right;
+            w->lo = f->lo;
+            w->hi = n - 1;
+            w->lidx = f->lidx;
+            w->ridx = f->right ? ret : -1;
+            int lheight = w->lidx < 0 ? 0 : rb.read[w->lidx].height;
+            int rheight = w->ridx < 0 ? 0 : rb.read[w->ridx].height;
+            w->height = 1 + (lheight > rheight ? lheight : rheight);
+            ret = f->idx;
+            depth--;
+            continue;
+        }
+        f->stage++;
+        if (child) {
+            if (walk_grow(&rb.frames, &rb.cap_frames, depth + 1, sizeof(walk_frame_t)))
+                return -1;
+            rb.frames[depth++] = (walk_frame_t){.node = child};
         }
-        return(0);
     }
+    *rootp = ret;
+    return n;
+}
 
-    // We found it, if the node has no
-    // right child, then we can merely replace its parent's pointer to
-    // it with the node's left child.
+/* Returns 1 if the subtree of the node read at idx is a scapegoat. */
+static int walk_unbalanced(int idx) {
+    walk_node_t *w = &rb.read[idx];
+    int size = w->hi - w->lo + 1;
+    double most = REBALANCE_ALPHA * size;
+    if (idx - w->lo > most || w->hi - idx > most)
+        return 1;
+    // Every level of a tree balanced that way leaves at most REBALANCE_ALPHA
+    // of the nodes of the one above it.
+    int height = 1;
+    for (double left = size; (left *= REBALANCE_ALPHA) >= 1;)
+        height++;
+    return w->height > height;
+}
 
+/* Lays out the nodes of r nearest its root, splitting every range of keys
+ * at its middle and numbering them breadth first, as one part in a new
+ * block of shard, and queues the ranges below them in rb.ranges. Returns
+ * 0, or -1 if memory ran out. */
+static int walk_layout(shard_t *shard, walk_range_t r) {
+    struct sub {
+        int lo;
+        int hi;
+        int level;
+        int up;  // Number in the block of the copy it hangs from, -1 for r's slot
+        int right;  // Hangs on the right of it
+        int mid;  // Position of its own copy's node, -1 if not in the part
+    } subs[2 * REBALANCE_NODES + 1];
+    int head = 0, tail = 0, m = 0;
+    size_t size = BLOCK_HEADER;
+    subs[tail++] = (struct sub){r.lo, r.hi, r.level, -1, 0, -1};
+    while (head < tail) {
+        struct sub *s = &subs[head++];
+        if (s->lo > s->hi || m == REBALANCE_NODES)
+            continue;
+        s->mid = (s->lo + s->hi + 1) / 2;
+        size += NODE_STRIDE + strlen(rb.read[s->mid].node->name) + 1;
+        subs[tail++] = (struct sub){s->lo, s->mid - 1, s->level + 1, m, 0, -1};
+        subs[tail++] = (struct sub){s->mid + 1, s->hi, s->level + 1, m, 1, -1};
+        m++;
+    }
+    size = (size + 63) & ~(size_t)63;
+    if (walk_grow(&rb.blocks, &rb.cap_blocks, rb.num_blocks + 1, sizeof(node_block_t *)) ||
+        walk_grow(&rb.copies, &rb.cap_copies, rb.num_copies + m, sizeof(walk_copy_t)) ||
+        walk_grow(&rb.ranges, &rb.cap_ranges, rb.num_ranges + tail, sizeof(walk_range_t)))
+        return -1;
+    node_block_t *block = shard->node < 0 ? aligned_alloc(64, size)
+                                          : numa_node_alloc(shard->node, size);
+    if (block == 0)
+        return -1;
+    block->count = block->live = m;
+    block->size = size;
+    rb.blocks[rb.num_blocks++] = block;
 
-    // TODO: Must I be locking dnode's children?
-    if (dnode->rchild == 0) {
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->lchild;
-        else
-            parent->rchild = dnode->lchild;
-        if (pthread_rwlock_unlock(&dnode->rw_lock)){
-	    	perror("could not unlock read-write lock\n");
-	    	exit(1);
-	    }
-	    if (pthread_rwlock_unlock(&parent->rw_lock)){
-	    	perror("could not unlock read-write lock\n");
-	    	exit(1);
-	    }
-        // done with dnode
-        node_destructor(dnode);
-    } else if (dnode->lchild == 0) {
-        // ditto if the node had no left child
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->rchild;
-        else
-            parent->rchild = dnode->rchild;
-        if (pthread_rwlock_unlock(&dnode->rw_lock)){
-	    	perror("could not unlock read-write lock\n");
-	    	exit(1);
-	    }
-	    if (pthread_rwlock_unlock(&parent->rw_lock)){
-	    	perror("could not unlock read-write lock\n");
-	    	exit(1);
-	    }
-        // done with dnode
-        node_destructor(dnode);
-    } else {
-        // Find the lexicographically smallest node in the right subtree and
-        // replace the node to be deleted with that node. This new node thus is
-        // lexicographically smaller than all nodes in its right subtree, and
-        // greater than all nodes in its left subtree
-        if (pthread_rwlock_unlock(&parent->rw_lock)){
-	    	perror("could not unlock read-write lock\n");
-	    	exit(1);
-	    }
-        next = dnode->rchild;
-        lock(1, &next->rw_lock);
-        node_t **pnext = &dnode->rchild;        
-        while (next->lchild != 0) {
-            // work our way down the lchild chain, finding the smallest node
-            // in the subtree.
-            node_t *nextl = next->lchild;
-            lock(1, &nextl->rw_lock);        
-            pnext = &next->lchild;
-            if (pthread_rwlock_unlock(&next->rw_lock)){
-		    	perror("could not unlock read-write lock\n");
-		    	exit(1);
-		    }
-            next = nextl;
-        }
-        
-        dnode->name = realloc(dnode->name, strlen(next->name)+1);
-        dnode->value = realloc(dnode->value, strlen(next->value)+1);
-        snprintf(dnode->name, MAXLEN, "%s", next->name);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
-        *pnext = next->rchild;
-        if (pthread_rwlock_unlock(&next->rw_lock)){
-            perror("could not unlock read-write lock\n");
+    char *names = (char *)BLOCK_NODE(block, m);
+    int n = 0;
+    for (int i = 0; i < tail; i++) {
+        struct sub *s = &subs[i];
+        node_t **slot = s->up < 0     ? r.slot
+                        : s->right ? &BLOCK_NODE(block, s->up)->rchild
+                                   : &BLOCK_NODE(block, s->up)->lchild;
+        if (s->lo > s->hi) {
+            *slot = 0;
+            rb.gaps[s->lo - rb.gap_base] = slot;
+            continue;
+        }
+        if (s->mid < 0) {
+            rb.ranges[rb.num_ranges++] = (walk_range_t){s->lo, s->hi, s->level, slot};
+            continue;
+        }
+        node_t *orig = rb.read[s->mid].node;
+        node_t *copy = BLOCK_NODE(block, n++);
+        size_t len = strlen(orig->name) + 1;
+        memcpy(names, orig->name, len);
+        copy->name = names;
+        names += len;
+#ifdef FIXED_KEYS
+        copy->key = orig->key;
+#endif
+        copy->versions = 0;
+        copy->lchild = copy->rchild = 0;
+        copy->gc_next = 0;
+        copy->gc_queued = 0;
+        copy->unlinked = 0;
+        memset(&copy->ix, 0, sizeof(copy->ix));
+        copy->home = shard->node < 0 ? numa_current_node() : shard->node;
+        copy->block = block;
+        copy->shard = shard;
+        if (pthread_rwlock_init(&copy->rw_lock, 0)) {
+            perror("could not initialize read-write lock:\n");
             exit(1);
         }
-        node_destructor(next);
-        // Need to unlock dnode's rw_lock.
-        if (pthread_rwlock_unlock(&dnode->rw_lock)){
-	    	perror("could not unlock read-write lock\n");
-	    	exit(1);
-	    }
+        rb.copies[rb.num_copies++] = (walk_copy_t){copy, s->mid, s->level};
+        *slot = copy;
     }
-    return(1);
+    return 0;
 }
 
-node_t *search(char *name, node_t *parent, node_t **parentpp, int locktype) {
-    // Search the tree, starting at parent, for a node containing
-    // name (the "target node").  Return a pointer to the node,
-    // if found, otherwise return 0.  If parentpp is not 0, then it points
-    // to a location at which the address of the parent of the target node
-    // is stored.  If the target node is not found, the location pointed to
-    // by parentpp is set to what would be the the address of the parent of
-    // the target node, if it were there.
-    //
-    // TODO: Make this thread-safe!
-    node_t *next;
-    node_t *result;
-    // TODO: What if parent is null?
-    // trylock(locktype, &parent->rw_lock);
-    if (strcmp(name, parent->name) < 0) {
-        next = parent->lchild;
-    } else {
-        next = parent->rchild;
+/* Copies the subtree of the node read at idx, which hangs off parent at
+ * depth, into balanced parts in blocks of shard and swaps the copy in.
+ * Called inside read_begin()/read_end(). Returns 1 if it did, 0 if a
+ * writer held one of the nodes or memory ran out. */
+static int walk_rebuild(shard_t *shard, node_t *parent, int idx, int depth) {
+    walk_node_t *top = &rb.read[idx];
+    node_t *root;
+    int ok = 1;
+
+    // Everything but the versions and index links is laid out before any
+    // lock is taken.
+    rb.num_ranges = rb.num_copies = rb.num_blocks = 0;
+    rb.gap_base = top->lo;
+    if (walk_grow(&rb.ranges, &rb.cap_ranges, 1, sizeof(walk_range_t)) ||
+        walk_grow(&rb.gaps, &rb.cap_gaps, top->hi - top->lo + 2, sizeof(node_t **)))
+        return 0;
+    rb.ranges[rb.num_ranges++] = (walk_range_t){top->lo, top->hi, 0, &root};
+    for (int i = 0; ok && i < rb.num_ranges; i++)
+        ok = walk_layout(shard, rb.ranges[i]) == 0;
+
+    node_t **slot = key_cmp(node_probe(top->node), parent) < 0 ? &parent->lchild
+                                                              : &parent->rchild;
+    int locked = top->lo;
+    if (ok && (ok = trylock(1, &parent->rw_lock)) && (parent->unlinked || *slot != top->node)) {
+        unlock(&parent->rw_lock);
+        ok = 0;
     }
-    if (next == NULL) {
-        result = NULL;
-    } else {
-    	lock(locktype, &next->rw_lock);
-        if (strcmp(name, next->name) == 0) {
-            result = next;
-        } else {
-        	if (pthread_rwlock_unlock(&parent->rw_lock)){
-        		perror("could not unlock read-write lock\n");
-        		exit(1);
-        	}
-            return search(name, next, parentpp, locktype);
+    for (; ok && locked <= top->hi; locked++) {
+        if (!trylock(1, &rb.read[locked].node->rw_lock))
+            break;
+    }
+    if (ok && locked <= top->hi) {
+        while (locked > top->lo)
+            unlock(&rb.read[--locked].node->rw_lock);
+        unlock(&parent->rw_lock);
+        ok = 0;
+    }
+    if (!ok) {
+        for (int i = 0; i < rb.num_copies; i++)
+            pthread_rwlock_destroy(&rb.copies[i].copy->rw_lock);
+        for (int i = 0; i < rb.num_blocks; i++)
+            shard_free(shard, rb.blocks[i], rb.blocks[i]->size);
+        return 0;
+    }
+
+    for (int i = top->lo; i <= top->hi; i++) {
+        walk_node_t *w = &rb.read[i];
+        if (w->left == 0 && w->node->lchild)
+            *rb.gaps[i - rb.gap_base] = w->node->lchild;
+        if (w->right == 0 && w->node->rchild)
+            *rb.gaps[i + 1 - rb.gap_base] = w->node->rchild;
+    }
+    for (int i = 0; i < rb.num_copies; i++) {
+        node_t *copy = rb.copies[i].copy;
+        node_t *orig = rb.read[rb.copies[i].from].node;
+        copy->versions = orig->versions;
+        index_move(&orig->ix, &copy->ix);
+        if (orig->gc_queued)
+            gc_enqueue(copy);
+    }
+    // Readers may follow the new link as soon as it is stored.
+    __atomic_store_n(slot, root, __ATOMIC_RELEASE);
+    for (int i = top->lo; i <= top->hi; i++) {
+        rb.read[i].node->unlinked = NODE_MOVED;
+        unlock(&rb.read[i].node->rw_lock);
+    }
+    unlock(&parent->rw_lock);
+    for (int i = top->lo; i <= top->hi; i++)
+        gc_retire(rb.read[i].node, 0);
+    for (int i = 0; i < rb.num_blocks; i++)
+        __atomic_fetch_add(&block_bytes, rb.blocks[i]->size, __ATOMIC_RELAXED);
+    for (int i = 0; i < rb.num_copies; i++) {
+        int at = depth + rb.copies[i].level;
+        rb.nodes++;
+        rb.depth_sum += at;
+        if (at > rb.height)
+            rb.height = at;
+    }
+    __atomic_fetch_add(&rb.moved, rb.num_copies, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Walks the tree of shard: rebuilds the scapegoats nearest its top and
+ * notes the depths of the nodes as it leaves them. */
+static void walk_tree(shard_t *shard) {
+    int root, num_todo = 0;
+    read_begin();
+    int n = walk_read(__atomic_load_n(&shard->head.rchild, __ATOMIC_ACQUIRE), &root);
+    // Its subtrees are disjoint, so there are never more left to weigh
+    // than nodes read.
+    if (n > 0 && walk_grow(&rb.todo, &rb.cap_todo, n, sizeof(walk_todo_t)) == 0)
+        rb.todo[num_todo++] = (walk_todo_t){root, 1, &shard->head};
+    else if (n < 0)
+        __atomic_fetch_add(&rb.skips, 1, __ATOMIC_RELAXED);
+    while (num_todo > 0) {
+        walk_todo_t t = rb.todo[--num_todo];
+        walk_node_t *w = &rb.read[t.idx];
+        if (walk_unbalanced(t.idx)) {
+            int rebuilt = walk_rebuild(shard, t.parent, t.idx, t.depth);
+            __atomic_fetch_add(rebuilt ? &rb.rebuilds : &rb.skips, 1, __ATOMIC_RELAXED);
+            if (rebuilt)
+                continue;
         }
+        rb.nodes++;
+        rb.depth_sum += t.depth;
+        if (t.depth > rb.height)
+            rb.height = t.depth;
+        if (w->ridx >= 0)
+            rb.todo[num_todo++] = (walk_todo_t){w->ridx, t.depth + 1, w->node};
+        if (w->lidx >= 0)
+            rb.todo[num_todo++] = (walk_todo_t){w->lidx, t.depth + 1, w->node};
     }
-    if (parentpp != NULL) {
-        *parentpp = parent;
-    } else {
-    	if (pthread_rwlock_unlock(&parent->rw_lock)){
-        	perror("could not unlock read-write lock\n");
-        	exit(1);
+    read_end();
+}
+
+/* Takes the next step of the walk. Returns 0 if there is nothing to do:
+ * the last walk is over and nothing changed since it began. */
+static int rebalance_step(void) {
+    if (rb.shard < 0) {
+        unsigned long clock = __atomic_load_n(&commit_clock, __ATOMIC_RELAXED);
+        if (clock == rb.walk_ts)
+            return 0;
+        rb.walk_ts = clock;
+        rb.shard = 0;
+        rb.nodes = rb.depth_sum = 0;
+        rb.height = 0;
+    }
+    if (rb.shard == __atomic_load_n(&num_spaces, __ATOMIC_ACQUIRE) * num_shards) {
+        __atomic_store_n(&rb.last_nodes, rb.nodes, __ATOMIC_RELAXED);
+        __atomic_store_n(&rb.last_depth_sum, rb.depth_sum, __ATOMIC_RELAXED);
+        __atomic_store_n(&rb.last_height, rb.height, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&rb.walks, 1, __ATOMIC_RELAXED);
+        rb.shard = -1;
+        return 1;
+    }
+    walk_tree(shard_at(rb.shard++));
+    return 1;
+}
+
+/* Spends the collector's share of CPU time on rebalancing, as far as
+ * there is anything to do. */
+static void rebalance_run(void) {
+    int percent = __atomic_load_n(&rb.percent, __ATOMIC_RELAXED);
+    double now = clock_seconds(CLOCK_MONOTONIC);
+    if (percent > 0 && rb.last > 0)
+        rb.credit += (now - rb.last) * percent / 100;
+    rb.last = now;
+    if (rb.credit > REBALANCE_MAX_CREDIT)
+        rb.credit = REBALANCE_MAX_CREDIT;
+    if (percent <= 0 || rb.credit <= 0)
+        return;
+    double start = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    double spent = 0;
+    while (spent < rb.credit && rebalance_step())
+        spent = clock_seconds(CLOCK_THREAD_CPUTIME_ID) - start;
+    rb.credit -= spent;
+    __atomic_fetch_add(&rb.cpu_ns, (unsigned long)(spent * 1e9), __ATOMIC_RELAXED);
+}
+
+unsigned long db_rebalance(int percent) {
+    __atomic_store_n(&rb.percent, percent < 0 ? 0 : percent > 100 ? 100 : percent,
+                     __ATOMIC_RELAXED);
+    return __atomic_load_n(&rb.walks, __ATOMIC_RELAXED);
+}
+
+// How often the collector runs.
+#define GC_INTERVAL_MS 20
+
+static void *gc_main(void *arg) {
+    if (pthread_mutex_lock(&gc.mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    while (!gc.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += GC_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        int err = pthread_cond_timedwait(&gc.cond, &gc.mutex, &deadline);
+        if (err && err != ETIMEDOUT) {
+            errno = err;
+            perror("pthread_cond_timedwait");
+            exit(1);
+        }
+        if (pthread_mutex_unlock(&gc.mutex)) {
+            perror("mutex could not be unlocked: \n");
+            exit(1);
+        }
+        gc_cycle();
+        rebalance_run();
+        if (pthread_mutex_lock(&gc.mutex)) {
+            perror("mutex could not be locked: \n");
+            exit(1);
         }
     }
-    return result;
+    if (pthread_mutex_unlock(&gc.mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    return NULL;
+}
+
+void db_gc_start(void) {
+    int err;
+    gc.stopping = 0;
+    if ((err = pthread_create(&gc.thread, 0, gc_main, 0))) {
+        errno = err;
+        perror("pthread_create");
+        exit(1);
+    }
+    gc.running = 1;
+}
+
+void db_gc_stop(void) {
+    if (!gc.running)
+        return;
+    if (pthread_mutex_lock(&gc.mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    gc.stopping = 1;
+    if (pthread_cond_signal(&gc.cond)) {
+        perror("pthread_cond_signal failure: \n");
+        exit(1);
+    }
+    if (pthread_mutex_unlock(&gc.mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    if (pthread_join(gc.thread, 0)) {
+        perror("pthread_join");
+        exit(1);
+    }
+    gc.running = 0;
 }
 
 static inline void print_spaces(int lvl, FILE *out) {
@@ -312,8 +2136,9 @@ static inline void print_spaces(int lvl, FILE *out) {
 }
 
 /* Recursively traverses the database tree and prints nodes
- * pre-order. */
-void db_print_recurs(node_t *node, int lvl, FILE *out) {
+ * pre-order, as they are at snapshot snap. Nodes whose key does not
+ * exist at snap still route to their children and are printed as such. */
+void db_print_recurs(node_t *node, int lvl, FILE *out, unsigned long snap) {
     // print spaces to differentiate levels
     print_spaces(lvl, out);
 
@@ -322,18 +2147,18 @@ void db_print_recurs(node_t *node, int lvl, FILE *out) {
         fprintf(out, "(null)\n");
         return;
     }
-    lock(0, &node->rw_lock);
-    if (node == &head) {
+    version_t *version = version_at(node, snap);
+    if (is_head(node)) {
         fprintf(out, "(root)\n");
+    } else if (version && version->value) {
+        fprintf(out, "%s ", node->name);
+        value_write(version->value, out);
+        fputc('\n', out);
     } else {
-        fprintf(out, "%s %s\n", node->name, node->value);
-    }
-    db_print_recurs(node->lchild, lvl + 1, out);
-    db_print_recurs(node->rchild, lvl + 1, out);
-    if (pthread_rwlock_unlock(&node->rw_lock)){
-        perror("could not unlock read-write lock\n");
-        exit(1);
+        fprintf(out, "%s (removed)\n", node->name);
     }
+    db_print_recurs(__atomic_load_n(&node->lchild, __ATOMIC_ACQUIRE), lvl + 1, out, snap);
+    db_print_recurs(__atomic_load_n(&node->rchild, __ATOMIC_ACQUIRE), lvl + 1, out, snap);
 }
 
 /* Prints the whole database, using db_print_recurs, to a file with
@@ -344,29 +2169,174 @@ void db_print_recurs(node_t *node, int lvl, FILE *out) {
  * Returns 0 on success, or -1 if the file could not be opened
  * for writing. */
 int db_print(char *filename) {
-    FILE *out;
-    if (filename == NULL) {        
-        db_print_recurs(&head, 0, stdout);
-       
-        return 0;
-    }
+    FILE *out = stdout;
     
     // skip over leading whitespace
-    while (isspace(*filename)) {
+    while (filename != NULL && isspace(*filename)) {
         filename++;
     }
 
-    if (*filename == '\0') {        
-        db_print_recurs(&head, 0, stdout);
+    if (filename != NULL && *filename != '\0' && (out = fopen(filename, "w+")) == NULL) {
+        return -1;
+    }
+    unsigned long snap = read_begin();
+    int trees = __atomic_load_n(&num_spaces, __ATOMIC_ACQUIRE) * num_shards;
+    for (int i = 0; i < trees; i++)
+        db_print_recurs(&shard_at(i)->head, 0, out, snap);
+    read_end();
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
+
+/* Recursively writes node and its subtree as add commands, pre-order, as
+ * they are at snapshot snap. Writers carry on meanwhile; they only add
+ * versions newer than snap. */
+static int db_snapshot_recurs(node_t *node, FILE *out, unsigned long snap) {
+    if (node == NULL) {
         return 0;
     }
+    version_t *version = version_at(node, snap);
+    if (!is_head(node) && version && version->value &&
+        (fprintf(out, "a %s ", node->name) < 0 ||
+         value_write(version->value, out) < 0 || fputc('\n', out) == EOF)) {
+        return -1;
+    }
+    if (db_snapshot_recurs(__atomic_load_n(&node->lchild, __ATOMIC_ACQUIRE), out, snap) < 0)
+        return -1;
+    return db_snapshot_recurs(__atomic_load_n(&node->rchild, __ATOMIC_ACQUIRE), out, snap);
+}
+
+/* Writes every entry of space to out as add commands, pre-order, one
+ * shard after the other. The entries are those of a single snapshot, taken when the dump begins.
+ *
+ * Returns 0 on success, or -1 on a write error. */
+static int space_dump(keyspace_t *space, FILE *out) {
+    unsigned long snap = read_begin();
+    int ret = 0;
+    for (int i = 0; i < num_shards && ret == 0; i++)
+        ret = db_snapshot_recurs(&space->shards[i].head, out, snap);
+    read_end();
+    return ret;
+}
+
+int db_dump(FILE *out) {
+    return space_dump(&default_space, out);
+}
 
-    if ((out = fopen(filename, "w+")) == NULL) {
+/* Writes a consistent snapshot of space to filename by way of a
+ * temporary file, so a reader never sees a half-written snapshot.
+ *
+ * Returns 0 on success, or -1 on failure. */
+static int space_snapshot(keyspace_t *space, char *filename) {
+    char *tmpname;
+    FILE *out;
+
+    if (asprintf(&tmpname, "%s.tmp", filename) < 0) {
         return -1;
     }
-    db_print_recurs(&head, 0, out);
-    fclose(out);
-    return 0;
+    if ((out = fopen(tmpname, "w")) == NULL) {
+        free(tmpname);
+        return -1;
+    }
+    int ret = space_dump(space, out);
+    if (fclose(out) != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmpname, filename) < 0) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        unlink(tmpname);
+    }
+    free(tmpname);
+    return ret;
+}
+
+/* Writes the default keyspace to filename and every other one to
+ * filename, a dot and its name.
+ *
+ * Returns 0 on success, or -1 if any of them failed. */
+int db_snapshot(char *filename) {
+    while (filename != NULL && isspace(*filename)) {
+        filename++;
+    }
+    if (filename == NULL || *filename == '\0') {
+        return -1;
+    }
+    int ret = space_snapshot(&default_space, filename);
+    int n = __atomic_load_n(&num_spaces, __ATOMIC_ACQUIRE);
+    for (int i = 1; i < n; i++) {
+        char *name;
+        if (asprintf(&name, "%s.%s", filename, spaces[i]->name) < 0) {
+            ret = -1;
+            continue;
+        }
+        if (space_snapshot(spaces[i], name) < 0)
+            ret = -1;
+        free(name);
+    }
+    return ret;
+}
+
+long db_size(void) {
+    return __atomic_load_n(&num_keys, __ATOMIC_RELAXED);
+}
+
+void db_stats(char *buf, int len) {
+    // Read after the oldest snapshot, so that the lag cannot come out negative
+    unsigned long oldest = gc_oldest_snapshot();
+    unsigned long clock = __atomic_load_n(&commit_clock, __ATOMIC_SEQ_CST);
+    int n = snprintf(buf, len,
+                     "keys=%ld write_restarts=%ld commit_ts=%lu snapshot_lag=%lu pending_waits=%lu "
+                     "versions=%ld removed_nodes=%ld gc_unlinked=%lu gc_trimmed=%lu gc_limbo=%zu "
+                     "txn_commits=%lu txn_conflicts=%lu ",
+                     db_size(), __atomic_load_n(&write_restarts, __ATOMIC_RELAXED), clock,
+                     clock - oldest,
+                     __atomic_load_n(&pending_waits, __ATOMIC_RELAXED),
+                     __atomic_load_n(&gc.versions, __ATOMIC_RELAXED),
+                     __atomic_load_n(&gc.removed, __ATOMIC_RELAXED),
+                     __atomic_load_n(&gc.unlinked, __ATOMIC_RELAXED),
+                     __atomic_load_n(&gc.trimmed, __ATOMIC_RELAXED),
+                     __atomic_load_n(&gc.limbo_len, __ATOMIC_RELAXED),
+                     __atomic_load_n(&txn_commits, __ATOMIC_RELAXED),
+                     __atomic_load_n(&txn_conflicts, __ATOMIC_RELAXED));
+    if (n < len && index_enabled) {
+        index_stats(buf + n, len - n);
+        n += strlen(buf + n);
+    }
+    if (n < len && __atomic_load_n(&rb.percent, __ATOMIC_RELAXED) > 0) {
+        unsigned long nodes = __atomic_load_n(&rb.last_nodes, __ATOMIC_RELAXED);
+        n += snprintf(buf + n, len - n,
+                      "rebalance_walks=%lu rebalance_rebuilds=%lu rebalance_moved=%lu "
+                      "rebalance_skips=%lu rebalance_bytes=%ld rebalance_cpu_ms=%.1f "
+                      "tree_height=%d tree_depth=%.2f ",
+                      __atomic_load_n(&rb.walks, __ATOMIC_RELAXED),
+                      __atomic_load_n(&rb.rebuilds, __ATOMIC_RELAXED),
+                      __atomic_load_n(&rb.moved, __ATOMIC_RELAXED),
+                      __atomic_load_n(&rb.skips, __ATOMIC_RELAXED),
+                      __atomic_load_n(&block_bytes, __ATOMIC_RELAXED),
+                      __atomic_load_n(&rb.cpu_ns, __ATOMIC_RELAXED) / 1e6,
+                      __atomic_load_n(&rb.last_height, __ATOMIC_RELAXED),
+                      nodes ? (double)__atomic_load_n(&rb.last_depth_sum, __ATOMIC_RELAXED) / nodes
+                            : 0.0);
+    }
+    if (n < len && bloom_enabled) {
+        bloom_stats(buf + n, len - n);
+        n += strlen(buf + n);
+    }
+    int n_spaces = __atomic_load_n(&num_spaces, __ATOMIC_ACQUIRE);
+    if (n < len && n_spaces > 1)
+        n += snprintf(buf + n, len - n, "keyspaces=%d ", n_spaces);
+    if (n < len && default_space.shards != &first_shard) {
+        n += snprintf(buf + n, len - n, "shards=%d ", num_shards);
+        if (n < len) {
+            numa_stats(buf + n, len - n);
+            n += strlen(buf + n);
+        }
+    }
+    if (n < len)
+        value_stats(buf + n, len - n);
 }
 
 /* Recursively destroys node and all its children. */
@@ -381,90 +2351,239 @@ void db_cleanup_recurs(node_t *node) {
     node_destructor(node);
 }
 
-/* Destroys all nodes in the database other than the head.
- * No threads should be using the database when this is called. */
+/* Destroys all nodes in the database other than the heads, along with
+ * everything the collector has retired. No threads should be using the
+ * database when this is called, and the collector must be stopped. */
 void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+    for (int i = 0; i < num_spaces * num_shards; i++) {
+        shard_t *shard = shard_at(i);
+        db_cleanup_recurs(shard->head.lchild);
+        db_cleanup_recurs(shard->head.rchild);
+        shard->head.lchild = shard->head.rchild = 0;
+    }
+    gc.dirty = 0;
+    for (size_t i = 0; i < gc.limbo_len; i++) {
+        if (gc.limbo[i].node)
+            node_destructor(gc.limbo[i].node);
+        else
+            version_destructor(gc.limbo[i].versions);
+    }
+    free(gc.limbo);
+    gc.limbo = 0;
+    free(rb.read);
+    free(rb.frames);
+    free(rb.todo);
+    free(rb.ranges);
+    free(rb.copies);
+    free(rb.blocks);
+    free(rb.gaps);
+    rb.read = 0;
+    rb.frames = 0;
+    rb.todo = 0;
+    rb.ranges = 0;
+    rb.copies = 0;
+    rb.blocks = 0;
+    rb.gaps = 0;
+    rb.cap_read = rb.cap_frames = rb.cap_todo = rb.cap_ranges = rb.cap_copies = rb.cap_blocks = 0;
+    rb.cap_gaps = 0;
+    rb.shard = -1;
+    index_cleanup();
+    bloom_clear();
+    gc.limbo_len = gc.limbo_cap = 0;
+    gc.removed = 0;
+    num_keys = 0;
+    while (num_spaces > 1) {
+        keyspace_t *space = spaces[--num_spaces];
+        for (int i = 0; i < num_shards; i++)
+            pthread_rwlock_destroy(&space->shards[i].head.rw_lock);
+        free(space->shards);
+        free(space);
+    }
+    default_space.keys = default_space.bytes = 0;
+}
+
+/* Cleanup routine that frees a line buffer grown by getline(). */
+static void free_line(void *arg) {
+    free(*(char **)arg);
 }
 
 /* Interprets the given command string and calls the appropriate database
- * function. Writes up to len-1 bytes of the response message string produced 
- * by the database to the response buffer. */
-void interpret_command(char *command, char *response, int len) {
-    char value[MAXLEN];
-    char ibuf[MAXLEN];
-    char name[MAXLEN];
-    int sscanf_ret;
-
-    if (strlen(command) <= 1) {
+ * function, or the transaction function if txn is not NULL. Writes up to
+ * len-1 bytes of the response message string produced by the database to
+ * the response buffer, or hands back the value found by a query through
+ * valuep (see db.h). */
+static void interpret(txn_t *txn, char *command, char *response, int len, value_t **valuep) {
+    command_t cmd;
+    int ret;
+
+    trace_begin(TRACE_PARSE);
+    ret = parse_command(command, &cmd);
+    trace_end(TRACE_PARSE);
+    if (ret < 0) {
         snprintf(response, len, "ill-formed command");
         return;
     }
+    interpret_parsed(txn, &cmd, response, len, valuep);
+}
+
+void interpret_parsed(txn_t *txn, const command_t *cmdp, char *response, int len,
+                      value_t **valuep) {
+    command_t cmd = *cmdp;
+    char *name;
+    char *value;
+    char *line = NULL;
+    size_t line_cap = 0;
+    value_t *found;
+    int ret;
+
+    name = value = cmd.argc > 0 ? cmd.argv[0].data : NULL;
 
     // which command is it?
-    switch (command[0]) {
+    switch (cmd.op) {
     case 'q':
          // Query
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1) {
+        if (cmd.argc < 1) {
             snprintf(response, len, "ill-formed command");
             return;
         }
-        db_query(name, response, len);
-        if (strlen(response) == 0) {
+        found = NULL;
+        trace_begin(TRACE_QUERY);
+        ret = txn ? txn_query(txn, name, &found)
+                  : (found = query(name, cmd.argv[0].len)) != NULL;
+        trace_end(TRACE_QUERY);
+        if (ret < 0) {
+            snprintf(response, len, ret == -2 ? "transaction too large" : "out of memory");
+        } else if (found == NULL) {
             snprintf(response, len, "not found");
+        } else if (valuep) {
+            response[0] = '\0';
+            *valuep = found;
+        } else {
+            value_t *plain = value_inflate(found);
+            snprintf(response, len, "%s", plain ? plain->data : "out of memory");
+            value_release(plain);
+            value_release(found);
         }
 
         return;
 
     case 'a':
         // Add to the database
-        sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-        if (sscanf_ret < 2) {
+        if (db_read_only) {
+            snprintf(response, len, "read-only replica");
+            return;
+        }
+        if (cmd.argc < 2) {
             snprintf(response, len, "ill-formed command");
             return;
         }
-        if (db_add(name, value)) {
+        if (cmd.argv[0].len > MAX_KEYLEN) {
+            snprintf(response, len, "key too long");
+            return;
+        }
+        value = cmd.argv[1].data;
+        if (cmd.argv[1].len > MAX_VALUELEN) {
+            snprintf(response, len, "value too long");
+            return;
+        }
+        trace_begin(TRACE_ADD);
+        ret = txn ? txn_put(txn, name, value, cmd.argv[1].len)
+                  : add(name, cmd.argv[0].len, value, cmd.argv[1].len);
+        trace_end(TRACE_ADD);
+        if (ret > 0) {
             snprintf(response, len, "added");
-        } else {
+        } else if (ret == 0) {
             snprintf(response, len, "already in database");
+        } else if (ret == -3) {
+            snprintf(response, len, "keyspace over quota");
+        } else if (ret == -2) {
+            snprintf(response, len, "transaction too large");
+        } else {
+            snprintf(response, len, "out of memory");
         }
 
         return;
 
     case 'd':
         // Delete from the database
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1) {
+        if (db_read_only) {
+            snprintf(response, len, "read-only replica");
+            return;
+        }
+        if (cmd.argc < 1) {
             snprintf(response, len, "ill-formed command");
             return;
         }
-        if (db_remove(name)) {
+        trace_begin(TRACE_REMOVE);
+        ret = txn ? txn_remove(txn, name) : remove_key(name, cmd.argv[0].len);
+        trace_end(TRACE_REMOVE);
+        if (ret > 0) {
             snprintf(response, len, "removed");
-        } else {
+        } else if (ret == 0) {
             snprintf(response, len, "not in database");
+        } else {
+            snprintf(response, len, ret == -2 ? "transaction too large" : "out of memory");
         }
 
         return;
 
+    case 'v':
+        // Keys holding a value, from the secondary index
+        if (cmd.argc < 1) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (txn) {
+            snprintf(response, len, "not allowed in a transaction");
+            return;
+        }
+        if (!index_enabled) {
+            snprintf(response, len, "no value index");
+            return;
+        }
+        if (cmd.argv[0].len > MAX_VALUELEN) {
+            snprintf(response, len, "value too long");
+            return;
+        }
+        if ((found = keys_of(value, cmd.argv[0].len)) == NULL) {
+            snprintf(response, len, "not found");
+        } else if (valuep) {
+            response[0] = '\0';
+            *valuep = found;
+        } else {
+            value_t *plain = value_inflate(found);
+            snprintf(response, len, "%s", plain ? plain->data : "out of memory");
+            value_release(plain);
+            value_release(found);
+        }
+        return;
+
     case 'f':
         // process the commands in a file (silently)
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1) {
+        if (db_read_only) {
+            snprintf(response, len, "read-only replica");
+            return;
+        }
+        if (cmd.argc < 1) {
             snprintf(response, len, "ill-formed command");
             return;
         }
+        if (txn) {
+            snprintf(response, len, "not allowed in a transaction");
+            return;
+        }
 
         FILE *finput = fopen(name, "r");
         if (!finput) {
             snprintf(response, len, "bad file name");
             return;
         }
-        while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-            pthread_testcancel();  // fgets is not a cancellation point
-            interpret_command(ibuf, response, len);
+        pthread_cleanup_push(free_line, &line);
+        while (getline(&line, &line_cap, finput) > 0) {
+            pthread_testcancel();  // getline is not a cancellation point
+            interpret(NULL, line, response, len, NULL);
         }
+        pthread_cleanup_pop(1);
         fclose(finput);
         snprintf(response, len, "file processed");
         return;
@@ -474,3 +2593,11 @@ void interpret_command(char *command, char *response, int len) {
         return;
     }
 }
+
+void interpret_command(char *command, char *response, int len, value_t **valuep) {
+    interpret(NULL, command, response, len, valuep);
+}
+
+void txn_interpret(txn_t *txn, char *command, char *response, int len, value_t **valuep) {
+    interpret(txn, command, response, len, valuep);
+}
@@ -2,59 +2,199 @@
 #define DB_H_
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "./index.h"
+#include "./parse.h"
+#include "./value.h"
+
+/*
+ * One committed state of a key: its value, or no value where the key was
+ * removed, stamped with the timestamp of the commit that made it. A node's
+ * versions run from newest to oldest.
+ */
+typedef struct version {
+    unsigned long ts;
+    value_t *value;
+    struct version *older;
+} version_t;
+
+#ifdef FIXED_KEYS
+/*
+ * A key of at most 16 bytes as two integers, its bytes in big-endian order
+ * and padded with zeros, so that comparing the integers orders keys the
+ * way strcmp() does. Built with FIXED_KEYS, searches compare these and
+ * never read the key's string.
+ */
+typedef struct fixed_key {
+    uint64_t hi;
+    uint64_t lo;
+} fixed_key_t;
+#endif
 
 typedef struct node {
-    char *name;
-    char *value;
+    char *name;  // Never changes while the node is in the tree
+#ifdef FIXED_KEYS
+    fixed_key_t key;  // name, as searches compare it
+#endif
+    version_t *versions;
     struct node *lchild;
     struct node *rchild;
-    pthread_rwlock_t rw_lock;
+    pthread_rwlock_t rw_lock;  // Orders writers; readers take no locks
+    struct node *gc_next;  // Link in the collector's list of nodes to look at
+    int gc_queued;  // On that list
+    int unlinked;  // Taken out of the tree by the collector
+    index_link_t ix;  // Files the key under its value in the secondary index
+    int home;  // NUMA node the node was allocated on
+    struct node_block *block;  // Memory shared with the nodes of a rebuild, or NULL
+    struct shard *shard;  // Tree the node is in
 } node_t;
 
-extern node_t head;
+/**
+  * db_shard() splits the database into count trees, each under its own head, and files every
+  * key in one of them by a hash of the key. The trees are spread over the NUMA nodes (see
+  * numa.h), and the nodes and keys of each are allocated on its NUMA node; count 0 makes one
+  * tree per NUMA node. Otherwise, or with a count of 1, the database is a single tree
+  * allocated from the heap. Call it while the database is empty and no other thread uses it.
+  * Returns the number of trees.
+  */
+int db_shard(int count);
+
+/*
+ * A keyspace: a database of its own within the server, with trees under heads of its own, so
+ * that the keys of one tenant never share a node or a node's lock with another's. Every
+ * thread works in the keyspace it selected last, the default one until it selects another.
+ * A keyspace is charged the bytes of the keys and values it holds against its memory quota,
+ * and the commands run in it are paced to its rate limit.
+ *
+ * Keyspaces separate names, memory and rates, not resources: they share the commit clock,
+ * the value index and its locks, the Bloom filter, and the collector thread that trims,
+ * unlinks and rebuilds for all of them. A commit never waits for another's, but a tenant
+ * that writes heavily still takes its share of those.
+ */
+typedef struct keyspace keyspace_t;
+
+// Keyspaces one database may hold, the default one included
+#define DB_MAX_SPACES 64
+
+/**
+  * db_space_create() makes a keyspace called name, or finds the one that has that name, and
+  * sets its limits: quota bytes of keys and values, and ops commands a second, 0 for none.
+  * A name is up to 31 letters, digits, '_' and '-'; the default keyspace is "default". Call
+  * it once db_shard() has split the database, if it is to be. Keyspaces last until
+  * db_cleanup().
+  * Returns the keyspace, or NULL if the name is bad, DB_MAX_SPACES are made already or
+  * memory ran out.
+  */
+keyspace_t *db_space_create(const char *name, long quota, long ops);
+
+/**
+  * db_space() returns the keyspace called name, or NULL if there is none.
+  */
+keyspace_t *db_space(const char *name);
+
+/**
+  * db_space_use() makes space the calling thread's keyspace, NULL for the default one.
+  * db_space_current() returns the calling thread's keyspace, db_space_name() a keyspace's
+  * name.
+  */
+void db_space_use(keyspace_t *space);
+keyspace_t *db_space_current(void);
+const char *db_space_name(keyspace_t *space);
+
+/**
+  * db_space_list() writes the names of every keyspace, separated by spaces, into buf.
+  */
+void db_space_list(char *buf, int len);
+
+/**
+  * db_space_admit() counts one command of the calling thread's keyspace and, if the keyspace
+  * is ahead of its rate limit by more than a tenth of a second's worth of commands, sleeps
+  * until it is not. Call it before the command waits for anything else, so that a throttled
+  * keyspace holds nothing up.
+  */
+void db_space_admit(void);
+
+/**
+  * db_space_stats() writes the counters of space as space-separated key=value pairs into
+  * buf: its keys, the bytes charged and its quota, commands admitted and its rate limit,
+  * commands throttled and the time they slept, and writes refused for the quota.
+  */
+void db_space_stats(keyspace_t *space, char *buf, int len);
+
+/**
+  * db_key_node() returns the NUMA node holding the tree that name is filed in, or -1 if the
+  * database is not split by db_shard().
+  */
+int db_key_node(char *name);
+
+/**
+  * When set, db_change_hook is called after every successful db_add() ("a", with the 
+  * value) and db_remove() ("d", with a null value), once the change is visible and while
+  * the changed node is still locked. Changes to any one key therefore reach the hook in the order they were made.
+  * Only changes to the default keyspace are reported.
+  * The hook takes its own reference to value if it keeps it.
+  */
+extern void (*db_change_hook)(char op, const char *name, value_t *value);
 
-node_t *search(char *name, node_t *parent, node_t **parentp, int locktype);
+/**
+  * When non-zero, interpret_command() refuses the commands that modify the database.
+  */
+extern int db_read_only;
 
 /**
-  * The db_query() function calls search() to retrieve the node associated with the 
-  * given key. If such a node is found, the function retrieves the value stored in 
-  * that node and returns it. 
+  * The db_query() function reads the given key at a snapshot of the database taken when it
+  * begins, without taking any locks, so it never holds writers up; it only waits for one
+  * that is in the few instructions between taking its timestamp and stamping the key's
+  * version with it. If the key has a value at that snapshot, the function takes a reference to it and returns
+  * it; the caller releases it with value_release().
+  * Returns NULL if the key is not in the database.
   */
-void db_query(char *name, char *result, int len);
+value_t *db_query(char *name);
 
 /**
-  * db_add() uses search() to determine if the given key is already in the database. 
-  * If the key is not in the database, the function creates a new node with the given 
-  * key and value and inserts this node into the database as a child of the parent node 
-  * returned by search().
-  * Returns 1 on success and 0 on failure
+  * db_keys() returns a value holding the keys whose value equals value, separated by
+  * spaces, most recently set first, as many as fit in a value. The caller releases it with
+  * value_release(). Needs the secondary index (see index.h).
+  * Returns NULL if no key holds value or memory ran out.
+  */
+value_t *db_keys(char *value);
+
+/**
+  * db_add() descends the tree with read locks to determine if the given key is already in 
+  * the database. If the key is not in the database, the function write-locks the node that 
+  * would be its parent, checks that the child slot is still empty (starting over if not), 
+  * and inserts a new node with the given key and value there. If the key still has a node
+  * from before it was removed, the new value is pushed onto that node as its newest version
+  * instead. The value is copied before the descent, so that no lock is held while a large
+  * value is copied.
+  * Returns 1 on success, 0 if the key is already present, -1 if memory ran out and -3 if the
+  * key and value would take the keyspace over its quota.
   */
 int db_add(char *name, char *value);
 
 /**
-  * The db_remove() function calls search() to retrieve the node associated with the given 
-  * key. If such a node is found, the function must delete it while preserving the tree 
-  * ordering constraints. There are three cases that may occur, depending on the children of 
-  * the node to be removed:
-  * 	- Both children are NULL: In this case, the function simply deletes the node and sets 
-  *	the corresponding pointer of the parent node to NULL.
-  *	- One child is NULL: In this case, the function replaces the node with its non-NULL child.
-  *	- Neither child is NULL: In this case, the function finds the leftmost child of the node's 
-  *	right subtree and replaces the removed node with this one. Since the replacement node has no 
-  * 	left child, it is easy to remove it from its current position, and since it is the leftmost 
-  * 	child of its subtree it can occupy the position of the deleted node and satisfy the tree's 
-  *	ordering constraints.
+  * The db_remove() function descends the tree with read locks to find the node associated 
+  * with the given key, write-locks it and pushes a version without a value onto it. The 
+  * node stays in the tree, so readers at older snapshots still find the key's earlier 
+  * value; the collector started by db_gc_start() unlinks it once no snapshot can see that 
+  * value any more and the node has at most one child.
+  * Returns 1 if the key was removed, 0 if it was not in the database.
   */
 int db_remove(char *name);
 
 /** 
   * The interpret_command() function gets called by the server to interpret a command from a client, 
-  * call database functions, and store the response.
+  * call database functions, and store the response. Keys and values are split off the command in 
+  * place, so command is modified. When valuep is not NULL, a query that finds its key stores a 
+  * reference to the value in *valuep and leaves response empty, so that the caller can stream the 
+  * value out without copying it and then release it. That value may be compressed (see value.h).
+  * Otherwise the value is copied into response, uncompressed.
   */
-void interpret_command(char *command, char *response, int resp_capacity);
+void interpret_command(char *command, char *response, int resp_capacity, value_t **valuep);
 
 /**
-  * The db_print() function performs a pre-order traversal of the tree, printing each  node's 
+  * The db_print() function performs a pre-order traversal of each tree, printing each node's 
   representation and then recursively printing its left and right subtrees. It will attempt 
   * to print to a file with the given filename, or stdout if none is provided. 
   * Returns 0 on success or -1 on failure (invalid file)
@@ -62,7 +202,113 @@ void interpret_command(char *command, char *response, int resp_capacity);
 int db_print(char *filename);
 
 /**
-  * The db_cleanup() function frees all dynamically-allocated nodes in the database. This function 
+  * The db_snapshot() function writes every entry of the database to the file with the 
+  * given name as a sequence of "a <key> <value>" commands, in pre-order, so that running 
+  * them in order, as the "-s" option does at startup, rebuilds a tree of the same shape. The entries are
+  * those of one snapshot of the database, taken when the dump begins; writers are not held
+  * up while it is written. The snapshot is written to a temporary file which is renamed
+  * over filename once complete. That is the default keyspace; every other keyspace is written
+  * the same way to filename, a dot and its name, from a snapshot of its own.
+  * Returns 0 on success or -1 on failure.
+  */
+int db_snapshot(char *filename);
+
+/**
+  * The db_dump() function writes the same "a <key> <value>" lines as db_snapshot() to out, for
+  * the default keyspace.
+  * Returns 0 on success or -1 on a write error.
+  */
+int db_dump(FILE *out);
+
+/*
+ * A transaction: a set of queries, adds and removes that takes effect all at once, or not
+ * at all, when committed. Transactions are serializable: a committed transaction saw the
+ * database exactly as it was at its commit.
+ */
+typedef struct txn txn_t;
+
+/**
+  * txn_begin() starts a transaction. Returns NULL if memory ran out.
+  */
+txn_t *txn_begin(void);
+
+/**
+  * txn_query(), txn_add() and txn_remove() work like db_query(), db_add() and db_remove(),
+  * but on the database as txn sees it: the latest committed state, with the transaction's
+  * own adds and removes applied. The adds and removes are only buffered in txn. txn_query()
+  * stores the reference to the value found, if any, in *valuep.
+  * Return 1 on success, 0 if the key is missing (txn_query(), txn_remove()) or already
+  * present (txn_add()), -1 if memory ran out, and -2 if txn already touches as many keys
+  * as one transaction may.
+  */
+int txn_query(txn_t *txn, char *name, value_t **valuep);
+int txn_add(txn_t *txn, char *name, char *value);
+int txn_remove(txn_t *txn, char *name);
+
+/**
+  * txn_commit() write-locks the nodes of every key txn touched and checks that none of
+  * those keys changed since txn looked at it. If none did, it applies the buffered adds
+  * and removes under a single commit timestamp, so that readers see either all of them
+  * or none; otherwise it applies nothing. It frees txn either way.
+  * Returns 1 if the transaction committed, 0 if it conflicted with another commit, -1 if
+  * memory ran out and -3 if its writes would take the keyspace over its quota.
+  */
+int txn_commit(txn_t *txn);
+
+/**
+  * txn_abort() discards txn and everything it buffered. Accepts NULL.
+  */
+void txn_abort(txn_t *txn);
+
+/**
+  * txn_interpret() interprets a "q", "a" or "d" command as interpret_command() does, but
+  * within txn. Other commands are refused.
+  */
+void txn_interpret(txn_t *txn, char *command, char *response, int resp_capacity,
+                   value_t **valuep);
+
+/**
+  * interpret_parsed() interprets a command that parse_command() already split, as
+  * interpret_command() does, or as txn_interpret() does if txn is not NULL. For callers that
+  * look at the words of a command themselves before handing it to the database.
+  */
+void interpret_parsed(txn_t *txn, const command_t *cmd, char *response, int resp_capacity,
+                      value_t **valuep);
+
+/**
+  * db_gc_start() starts the thread that frees versions no snapshot can see any more and
+  * unlinks nodes of removed keys. db_gc_stop() stops it; call it before db_cleanup().
+  */
+void db_gc_start(void);
+void db_gc_stop(void);
+
+/**
+  * db_rebalance() lets the collector thread spend up to percent of a CPU's time on rebuilding
+  * the trees, 0 (the default) stopping it. It walks them one at a time, weighs every subtree,
+  * and rebuilds those nearest the top that are out of balance, scapegoat-style: a subtree with
+  * a child holding more than 70% of its nodes, or taller than that allows. A rebuilt subtree is
+  * balanced and laid out breadth-first in blocks of up to 31 nodes, every node on cache lines
+  * of its own. Each rebuild takes write locks on the subtree's nodes only while it swaps the
+  * copies in, and gives way to any writer holding one of them. A new walk begins once the
+  * database changed after the last one began.
+  * Returns the number of walks over the whole database finished so far.
+  */
+unsigned long db_rebalance(int percent);
+
+/**
+  * The db_size() function returns the number of keys currently stored in the database.
+  */
+long db_size(void);
+
+/**
+  * The db_stats() function writes database counters as space-separated key=value pairs 
+  * into buf.
+  */
+void db_stats(char *buf, int len);
+
+/**
+  * The db_cleanup() function frees all dynamically-allocated nodes in the database, and every 
+  * keyspace but the default one. This function 
   * should be used in server.c to clean up the database before exiting. You should only do this when 
   * you are certain that no other threads are currently using or will be using the database. You should 
   * check the variables in the server_control_t struct located near the top of server.c to ensure that all 
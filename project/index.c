@@ -0,0 +1,258 @@
+#include "./index.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Secondary index from values to keys (see index.h) */
+
+// Independently locked parts of the index; a value's hash picks its part.
+#define INDEX_STRIPES 64
+
+typedef struct index_entry {
+    uint64_t hash;
+    value_t *value;  // The value of one of the links, all of them equal
+    long count;  // Links filed under the entry
+    index_link_t *links;
+    struct index_entry *next;  // In the stripe's bucket
+} index_entry_t;
+
+typedef struct stripe {
+    pthread_mutex_t mutex;
+    index_entry_t **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+} __attribute__((aligned(64))) stripe_t;
+
+int index_enabled;
+
+static stripe_t stripes[INDEX_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static long index_values;  // Entries, one per distinct value
+static long index_keys;  // Links filed
+static long index_bytes;  // Entries and buckets allocated, links filed
+static unsigned long index_dropped;  // Links not filed for lack of memory
+
+static void init_stripes(void) {
+    for (int i = 0; i < INDEX_STRIPES; i++) {
+        if (pthread_mutex_init(&stripes[i].mutex, 0)) {
+            perror("could not initialize mutex");
+            exit(1);
+        }
+    }
+}
+
+/* FNV-1a over the stored form of value. */
+static uint64_t value_hash(const value_t *value) {
+    uint64_t h = 14695981039346656037ULL ^ value->compressed;
+    for (size_t i = 0; i < value->len; i++) {
+        h ^= (unsigned char)value->data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int value_equal(const value_t *a, const value_t *b) {
+    return a->compressed == b->compressed && a->len == b->len &&
+           memcmp(a->data, b->data, a->len) == 0;
+}
+
+static void stripe_lock(stripe_t *stripe) {
+    if (pthread_mutex_lock(&stripe->mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+}
+
+static void stripe_unlock(stripe_t *stripe) {
+    if (pthread_mutex_unlock(&stripe->mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+static stripe_t *stripe_of(uint64_t hash) {
+    pthread_once(&stripes_once, init_stripes);
+    return &stripes[hash % INDEX_STRIPES];
+}
+
+/* Returns the bucket of the stripe for hash. The low bits of the hash
+ * picked the stripe, so the bucket comes from the rest. */
+static index_entry_t **bucket_of(stripe_t *stripe, uint64_t hash) {
+    return &stripe->buckets[(hash / INDEX_STRIPES) & (stripe->num_buckets - 1)];
+}
+
+/* Doubles the buckets of stripe once it holds more entries than buckets.
+ * Returns -1 if that was needed but memory ran out. */
+static int stripe_grow(stripe_t *stripe) {
+    if (stripe->num_entries < stripe->num_buckets)
+        return 0;
+    size_t old_num = stripe->num_buckets;
+    index_entry_t **old = stripe->buckets;
+    size_t num = old_num ? old_num * 2 : 16;
+    index_entry_t **buckets = calloc(num, sizeof(index_entry_t *));
+    if (buckets == NULL)
+        return old ? 0 : -1;  // Longer chains will do
+    stripe->buckets = buckets;
+    stripe->num_buckets = num;
+    for (size_t i = 0; i < old_num; i++) {
+        index_entry_t *entry = old[i];
+        while (entry) {
+            index_entry_t *next = entry->next;
+            index_entry_t **bucket = bucket_of(stripe, entry->hash);
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(old);
+    __atomic_fetch_add(&index_bytes, (num - old_num) * sizeof(index_entry_t *),
+                       __ATOMIC_RELAXED);
+    return 0;
+}
+
+int index_insert(index_link_t *link, value_t *value) {
+    uint64_t hash = value_hash(value);
+    stripe_t *stripe = stripe_of(hash);
+    index_entry_t *entry;
+
+    stripe_lock(stripe);
+    if (stripe_grow(stripe) < 0) {
+        stripe_unlock(stripe);
+        __atomic_fetch_add(&index_dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    for (entry = *bucket_of(stripe, hash); entry; entry = entry->next) {
+        if (entry->hash == hash && value_equal(entry->value, value))
+            break;
+    }
+    if (entry == NULL) {
+        if ((entry = malloc(sizeof(index_entry_t))) == NULL) {
+            stripe_unlock(stripe);
+            __atomic_fetch_add(&index_dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        index_entry_t **bucket = bucket_of(stripe, hash);
+        entry->hash = hash;
+        entry->value = value;
+        entry->count = 0;
+        entry->links = NULL;
+        entry->next = *bucket;
+        *bucket = entry;
+        stripe->num_entries++;
+        __atomic_fetch_add(&index_values, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&index_bytes, sizeof(index_entry_t), __ATOMIC_RELAXED);
+    }
+    link->entry = entry;
+    link->value = value;
+    link->prev = NULL;
+    link->next = entry->links;
+    if (entry->links)
+        entry->links->prev = link;
+    entry->links = link;
+    entry->count++;
+    stripe_unlock(stripe);
+    __atomic_fetch_add(&index_keys, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&index_bytes, sizeof(index_link_t), __ATOMIC_RELAXED);
+    return 0;
+}
+
+void index_remove(index_link_t *link) {
+    index_entry_t *entry = link->entry;
+    if (entry == NULL)
+        return;
+    stripe_t *stripe = stripe_of(entry->hash);
+
+    stripe_lock(stripe);
+    if (link->prev)
+        link->prev->next = link->next;
+    else
+        entry->links = link->next;
+    if (link->next)
+        link->next->prev = link->prev;
+    link->entry = NULL;
+    if (--entry->count == 0) {
+        index_entry_t **prevp = bucket_of(stripe, entry->hash);
+        while (*prevp != entry)
+            prevp = &(*prevp)->next;
+        *prevp = entry->next;
+        stripe->num_entries--;
+        free(entry);
+        __atomic_fetch_sub(&index_values, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&index_bytes, sizeof(index_entry_t), __ATOMIC_RELAXED);
+    } else if (entry->value == link->value) {
+        // The entry's value goes with the link; any other will do as well.
+        entry->value = entry->links->value;
+    }
+    stripe_unlock(stripe);
+    __atomic_fetch_sub(&index_keys, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&index_bytes, sizeof(index_link_t), __ATOMIC_RELAXED);
+}
+
+void index_move(index_link_t *from, index_link_t *to) {
+    index_entry_t *entry = from->entry;
+    if (entry == NULL)
+        return;
+    stripe_t *stripe = stripe_of(entry->hash);
+
+    stripe_lock(stripe);
+    *to = *from;
+    if (to->prev)
+        to->prev->next = to;
+    else
+        entry->links = to;
+    if (to->next)
+        to->next->prev = to;
+    from->entry = NULL;
+    stripe_unlock(stripe);
+}
+
+long index_lookup(value_t *value, int (*fn)(index_link_t *link, void *arg), void *arg) {
+    uint64_t hash = value_hash(value);
+    stripe_t *stripe = stripe_of(hash);
+    index_entry_t *entry = NULL;
+    long n = 0;
+
+    stripe_lock(stripe);
+    if (stripe->num_buckets) {
+        for (entry = *bucket_of(stripe, hash); entry; entry = entry->next) {
+            if (entry->hash == hash && value_equal(entry->value, value))
+                break;
+        }
+    }
+    for (index_link_t *link = entry ? entry->links : NULL; link; link = link->next) {
+        n++;
+        if (fn(link, arg))
+            break;
+    }
+    stripe_unlock(stripe);
+    return n;
+}
+
+void index_stats(char *buf, int len) {
+    snprintf(buf, len, "index_values=%ld index_keys=%ld index_bytes=%ld index_dropped=%lu ",
+             __atomic_load_n(&index_values, __ATOMIC_RELAXED),
+             __atomic_load_n(&index_keys, __ATOMIC_RELAXED),
+             __atomic_load_n(&index_bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&index_dropped, __ATOMIC_RELAXED));
+}
+
+void index_cleanup(void) {
+    for (int i = 0; i < INDEX_STRIPES; i++) {
+        stripe_t *stripe = &stripes[i];
+        for (size_t b = 0; b < stripe->num_buckets; b++) {
+            index_entry_t *entry = stripe->buckets[b];
+            while (entry) {
+                index_entry_t *next = entry->next;
+                free(entry);
+                entry = next;
+            }
+        }
+        free(stripe->buckets);
+        stripe->buckets = NULL;
+        stripe->num_buckets = stripe->num_entries = 0;
+    }
+    index_values = index_keys = index_bytes = 0;
+}
@@ -0,0 +1,61 @@
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include "./value.h"
+
+/*
+ * A secondary index from values to the keys that hold them. Every key in
+ * the index owns a link, embedded in its node; the links of the keys that
+ * hold equal values hang off one entry for that value. Values are compared
+ * as stored, which is deterministic: equal values are compressed, or not,
+ * to the same bytes.
+ */
+typedef struct index_link {
+    struct index_link *prev;
+    struct index_link *next;
+    struct index_entry *entry;  // The value's entry, NULL while not indexed
+    value_t *value;  // The value the key holds, owned by the key's node
+} index_link_t;
+
+/**
+  * When non-zero, the database keeps the index up to date. Set it before any key is added.
+  */
+extern int index_enabled;
+
+/**
+  * index_insert() files link under value. index_remove() takes it out again, and does
+  * nothing if link is not indexed. The caller serializes calls for the same link, and keeps
+  * value alive for as long as link is filed under it.
+  * index_insert() returns 0 on success, or -1 if memory ran out; the link is then not indexed,
+  * which index_stats() reports.
+  */
+int index_insert(index_link_t *link, value_t *value);
+void index_remove(index_link_t *link);
+
+/**
+  * index_move() files to in the place of from, which is taken out, with the same value and in
+  * the same position among the links filed under it. Does nothing if from is not indexed.
+  * The caller serializes calls for both links.
+  */
+void index_move(index_link_t *from, index_link_t *to);
+
+/**
+  * index_lookup() calls fn for the link of every key holding a value equal to value, most
+  * recently indexed first, with the index locked against changes to that value. fn stops the
+  * walk by returning non-zero.
+  * Returns the number of links fn was called for.
+  */
+long index_lookup(value_t *value, int (*fn)(index_link_t *link, void *arg), void *arg);
+
+/**
+  * index_stats() writes the index counters as key=value pairs into buf.
+  */
+void index_stats(char *buf, int len);
+
+/**
+  * index_cleanup() frees the index. Every link must have been removed, or be about to be
+  * freed without being removed.
+  */
+void index_cleanup(void);
+
+#endif  // INDEX_H_
@@ -0,0 +1,462 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "./load.h"
+
+// From client.c
+int get_socket(const char *server, const char *port);
+
+// Room for a response line; longer ones (large values) are skipped over.
+#define LOAD_BUFLEN 4096
+
+// How long the commands of a step may take to be answered after it ends.
+#define DRAIN_NS 5000000000ULL
+
+// Latency buckets: exact below 32 ns, then 16 to every power of two, which
+// keeps every bucket within about 6% of the latencies in it.
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct histogram {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long total;
+    uint64_t max;
+} histogram_t;
+
+typedef struct conn {
+    int fd;
+    uint64_t due;  // When the command in flight was due to be sent
+    size_t len;  // Bytes of the response read so far
+    char buf[LOAD_BUFLEN];
+} conn_t;
+
+typedef struct load_thread {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    conn_t *conns;
+    // Results of the current step
+    histogram_t hist;
+    unsigned long done;
+    unsigned long unanswered;  // Commands not answered in time, or never sent
+    uint64_t last_done;
+    int lost;  // A connection broke
+} load_thread_t;
+
+// Options, and the step all threads are running
+static struct load_config {
+    int threads;
+    int conns;
+    long keys;
+    int read_percent;
+    double step_seconds;
+    double limit_ms;
+    double start_rate;
+    double growth_percent;
+    int closed;
+    // The step
+    int active;  // Connections per thread in use
+    double rate;  // Commands per second per thread, 0 for closed loop
+    int preload;  // Add every key once instead
+    uint64_t start;
+    uint64_t end;
+} cfg = {4, 16, 10000, 90, 2, 10, 1000, 50, 0};
+
+// Next key to add while preloading
+static long preload_next;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - 4;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+/* The smallest latency that falls in bucket i. */
+static uint64_t hist_value(int i) {
+    if (i < 2 * HIST_SUB)
+        return i;
+    int shift = i / HIST_SUB - 1;
+    return (uint64_t)(i % HIST_SUB + HIST_SUB) << shift;
+}
+
+static void hist_record(histogram_t *h, uint64_t v) {
+    h->count[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(histogram_t *into, const histogram_t *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->count[i] += h->count[i];
+    into->total += h->total;
+    if (h->max > into->max)
+        into->max = h->max;
+}
+
+/* The latency that a share q of the recorded ones do not exceed, rounded
+ * up to the top of its bucket. */
+static uint64_t hist_percentile(const histogram_t *h, double q) {
+    unsigned long rank = (unsigned long)(q * h->total + 0.5);
+    unsigned long seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->count[i];
+        if (seen >= rank) {
+            uint64_t top = hist_value(i + 1) - 1;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Writes the next command of t into buf. Returns its length, or 0 if there
+ * is none: the keys are all added while preloading. */
+static int next_command(load_thread_t *t, char *buf, size_t len) {
+    if (cfg.preload) {
+        long key = __atomic_fetch_add(&preload_next, 1, __ATOMIC_RELAXED);
+        return key < cfg.keys ? snprintf(buf, len, "a k%ld v%ld\n", key, key) : 0;
+    }
+    long key = rand_r(&t->seed) % cfg.keys;
+    int pick = rand_r(&t->seed) % 100;
+    if (pick < cfg.read_percent)
+        return snprintf(buf, len, "q k%ld\n", key);
+    // Adds and removes in equal numbers keep about half the keys present.
+    if (pick % 2)
+        return snprintf(buf, len, "a k%ld v%d\n", key, pick);
+    return snprintf(buf, len, "d k%ld\n", key);
+}
+
+/* Sends the command in buf on c, due at due. Returns 0, or -1 if the
+ * connection is gone. */
+static int conn_send(conn_t *c, const char *buf, int len, uint64_t due) {
+    c->due = due;
+    while (len > 0) {
+        ssize_t n = send(c->fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Reads what c has to read. Returns 1 once the response to its command is
+ * in, 0 if it is still coming, or -1 if the connection is gone. */
+static int conn_receive(conn_t *c) {
+    ssize_t n = read(c->fd, c->buf + c->len, LOAD_BUFLEN - c->len);
+    if (n <= 0)
+        return -1;
+    char *newline = memchr(c->buf + c->len, '\n', n);
+    c->len += n;
+    if (newline == NULL) {
+        // Only the end of the line matters.
+        if (c->len == LOAD_BUFLEN)
+            c->len = 0;
+        return 0;
+    }
+    // One command is in flight at a time, so nothing follows its response.
+    c->len = 0;
+    return 1;
+}
+
+/*
+ * Runs one step in the thread arg. In open loop, command k of the thread is
+ * due at start + k / rate; each is sent once it is due, on the connection
+ * that has been free the longest so that they all take turns, late if all
+ * of them are busy, and its latency counts from when it was due. In closed
+ * loop, every connection sends a command as soon as the last one is
+ * answered.
+ */
+static void *load_thread(void *arg) {
+    load_thread_t *t = (load_thread_t *)arg;
+    int n = cfg.active;
+    int idle[n];  // Ring of free connections, oldest first
+    struct pollfd fds[n];
+    int first_idle = 0;
+    int num_idle = n;
+    int inflight = 0;
+    char command[128];
+    // Threads take turns through the interval, rather than all sending at once.
+    double interval = cfg.rate > 0 ? 1e9 / cfg.rate : 0;
+    uint64_t start = cfg.start + (uint64_t)(interval * t->id / cfg.threads);
+    uint64_t total = cfg.rate > 0 ? (uint64_t)(cfg.rate * cfg.step_seconds) : 0;
+    uint64_t sent = 0;
+    int exhausted = 0;
+
+    memset(&t->hist, 0, sizeof(t->hist));
+    t->done = t->unanswered = 0;
+    t->last_done = 0;
+    for (int i = 0; i < n; i++) {
+        idle[i] = i;
+        fds[i].fd = t->conns[i].fd;
+        fds[i].events = POLLIN;
+    }
+    struct timespec begin = {cfg.start / 1000000000, cfg.start % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &begin, NULL) == EINTR)
+        ;
+    while (1) {
+        uint64_t now = now_ns();
+        uint64_t wake = UINT64_MAX;
+        if (interval > 0) {
+            uint64_t due = now < start ? 0 : (uint64_t)((now - start) / interval) + 1;
+            if (due > total)
+                due = total;
+            for (; sent < due && num_idle > 0; sent++, inflight++) {
+                conn_t *c = &t->conns[idle[first_idle]];
+                first_idle = (first_idle + 1) % n;
+                num_idle--;
+                int len = next_command(t, command, sizeof(command));
+                if (conn_send(c, command, len, start + (uint64_t)(sent * interval)) < 0)
+                    goto lost;
+            }
+            if (sent == total && inflight == 0)
+                break;
+            if (due < total)
+                wake = start + (uint64_t)(due * interval);
+        } else {
+            while (!exhausted && num_idle > 0 && (cfg.preload || now < cfg.end)) {
+                int len = next_command(t, command, sizeof(command));
+                if (len == 0) {
+                    exhausted = 1;
+                    break;
+                }
+                if (conn_send(&t->conns[idle[first_idle]], command, len, now) < 0)
+                    goto lost;
+                first_idle = (first_idle + 1) % n;
+                num_idle--;
+                inflight++;
+            }
+            if (inflight == 0 && (exhausted || (!cfg.preload && now >= cfg.end)))
+                break;
+            if (!cfg.preload && now < cfg.end)
+                wake = cfg.end;
+        }
+        if (!cfg.preload && now >= cfg.end + DRAIN_NS) {
+            // The server is not keeping up; what it still owes is
+            // counted, not timed.
+            t->unanswered = total - sent + inflight;
+            break;
+        }
+        if (wake > cfg.end + DRAIN_NS && !cfg.preload)
+            wake = cfg.end + DRAIN_NS;
+        struct timespec timeout = {0, 0};
+        if (wake > now && wake != UINT64_MAX) {
+            timeout.tv_sec = (wake - now) / 1000000000;
+            timeout.tv_nsec = (wake - now) % 1000000000;
+        }
+        if (ppoll(fds, n, wake == UINT64_MAX ? NULL : &timeout, NULL) < 0 && errno != EINTR) {
+            perror("ppoll");
+            exit(1);
+        }
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            if (!fds[i].revents)
+                continue;
+            int ret = conn_receive(&t->conns[i]);
+            if (ret < 0)
+                goto lost;
+            if (ret == 0)
+                continue;
+            hist_record(&t->hist, now - t->conns[i].due);
+            t->done++;
+            t->last_done = now;
+            idle[(first_idle + num_idle++) % n] = i;
+            inflight--;
+        }
+    }
+    return NULL;
+lost:
+    t->lost = 1;
+    return NULL;
+}
+
+/* Runs a step on every thread and merges what they measured into hist.
+ * Returns commands answered per second, or -1 if a connection broke. */
+static double run_step(load_thread_t *threads, histogram_t *hist, unsigned long *unanswered) {
+    cfg.start = now_ns() + 10000000;
+    cfg.end = cfg.start + (uint64_t)(cfg.step_seconds * 1e9);
+    for (int i = 0; i < cfg.threads; i++) {
+        int err;
+        if ((err = pthread_create(&threads[i].thread, NULL, load_thread, &threads[i]))) {
+            errno = err;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    unsigned long done = 0;
+    // A step lasts at least as long as its schedule, preloading as long as it takes.
+    uint64_t last = cfg.preload ? cfg.start : cfg.end;
+    int lost = 0;
+    memset(hist, 0, sizeof(*hist));
+    *unanswered = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        hist_merge(hist, &threads[i].hist);
+        done += threads[i].done;
+        *unanswered += threads[i].unanswered;
+        lost |= threads[i].lost;
+        if (threads[i].last_done > last)
+            last = threads[i].last_done;
+    }
+    if (lost) {
+        fprintf(stderr, "Connection terminated.\n");
+        return -1;
+    }
+    return done / ((last - cfg.start) / 1e9);
+}
+
+static void load_usage(void) {
+    fprintf(stderr, "Usage: client <servername> <port> load [-t <threads>] [-c <connections>] "
+                    "[-k <keys>] [-r <query percent>] [-d <step seconds>] [-l <p99 limit ms>] "
+                    "[-s <start ops/s>] [-g <growth percent>] [-C]\n");
+}
+
+int run_load(const char *server, const char *port, int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:k:r:d:l:s:g:C")) != -1) {
+        switch (opt) {
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        case 'c':
+            cfg.conns = atoi(optarg);
+            break;
+        case 'k':
+            cfg.keys = atol(optarg);
+            break;
+        case 'r':
+            cfg.read_percent = atoi(optarg);
+            break;
+        case 'd':
+            cfg.step_seconds = atof(optarg);
+            break;
+        case 'l':
+            cfg.limit_ms = atof(optarg);
+            break;
+        case 's':
+            cfg.start_rate = atof(optarg);
+            break;
+        case 'g':
+            cfg.growth_percent = atof(optarg);
+            break;
+        case 'C':
+            cfg.closed = 1;
+            break;
+        default:
+            load_usage();
+            return 1;
+        }
+    }
+    if (optind != argc || cfg.threads < 1 || cfg.conns < 1 || cfg.keys < 1 ||
+        cfg.read_percent < 0 || cfg.read_percent > 100 || cfg.step_seconds <= 0 ||
+        cfg.limit_ms <= 0 || cfg.start_rate <= 0 || cfg.growth_percent <= 0) {
+        load_usage();
+        return 1;
+    }
+
+    load_thread_t *threads = calloc(cfg.threads, sizeof(load_thread_t));
+    histogram_t *hist = malloc(sizeof(histogram_t));
+    if (threads == NULL || hist == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < cfg.threads; i++) {
+        threads[i].id = i;
+        threads[i].seed = i + 1;
+        if ((threads[i].conns = calloc(cfg.conns, sizeof(conn_t))) == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        for (int j = 0; j < cfg.conns; j++) {
+            if ((threads[i].conns[j].fd = get_socket(server, port)) == -1)
+                return 1;
+        }
+    }
+
+    unsigned long unanswered;
+    cfg.active = cfg.conns;
+    cfg.preload = 1;
+    double rate = run_step(threads, hist, &unanswered);
+    if (rate < 0)
+        return 1;
+    printf("added %ld keys from %d connections at %.0f ops/s\n", cfg.keys,
+           cfg.threads * cfg.conns, rate);
+    cfg.preload = 0;
+
+    printf("%12s %12s %10s %10s %10s %10s %10s\n", cfg.closed ? "connections" : "offered/s",
+           "achieved/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    double best = 0;
+    double offered = cfg.start_rate;
+    int status = 0;
+    // Open loop spreads its schedule over every connection; closed loop
+    // adds them step by step.
+    cfg.active = cfg.closed ? 1 : cfg.conns;
+    while (1) {
+        cfg.rate = cfg.closed ? 0 : offered / cfg.threads;
+        if ((rate = run_step(threads, hist, &unanswered)) < 0) {
+            status = 1;
+            break;
+        }
+        double p99_ms = hist_percentile(hist, 0.99) / 1e6;
+        if (cfg.closed) {
+            printf("%12d ", cfg.active * cfg.threads);
+        } else {
+            printf("%12.0f ", offered);
+        }
+        printf("%12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", rate,
+               hist_percentile(hist, 0.5) / 1e3, hist_percentile(hist, 0.9) / 1e3,
+               p99_ms * 1e3, hist_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+        fflush(stdout);
+        if (unanswered > 0) {
+            printf("%lu commands unanswered %.0f s after the step\n", unanswered, DRAIN_NS / 1e9);
+            break;
+        }
+        if (p99_ms > cfg.limit_ms) {
+            printf("p99 above %g ms\n", cfg.limit_ms);
+            break;
+        }
+        if (rate > best)
+            best = rate;
+        if (cfg.closed) {
+            if (cfg.active == cfg.conns)
+                break;
+            cfg.active = cfg.active * 2 < cfg.conns ? cfg.active * 2 : cfg.conns;
+        } else {
+            // A server that falls behind its offered load is saturated,
+            // whatever its latency looks like so far.
+            if (rate < offered * 0.9) {
+                printf("achieved less than 90%% of the offered load\n");
+                break;
+            }
+            offered *= 1 + cfg.growth_percent / 100;
+        }
+    }
+    printf("highest throughput with p99 within %g ms: %.0f ops/s\n", cfg.limit_ms, best);
+
+    for (int i = 0; i < cfg.threads; i++) {
+        for (int j = 0; j < cfg.conns; j++)
+            close(threads[i].conns[j].fd);
+        free(threads[i].conns);
+    }
+    free(threads);
+    free(hist);
+    return status;
+}
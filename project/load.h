@@ -0,0 +1,38 @@
+#ifndef LOAD_H_
+#define LOAD_H_
+
+/*
+ * The client program's load generator, for finding how much traffic a
+ * running server takes before its latency gives way. Threads each drive
+ * many connections, one command in flight on each, with a mix of queries,
+ * adds and removes over a range of keys, and the offered load goes up step
+ * by step until the 99th percentile of latency crosses a limit or the
+ * server stops keeping up. Every step prints a point of the throughput
+ * against latency curve.
+ *
+ * Open loop (the default) sends commands on a fixed schedule, whatever the
+ * server does, and measures each command's latency from the time it was
+ * due, not from when a free connection finally sent it; a stalled server
+ * is charged for every command it held up, rather than for one
+ * (coordinated omission). Closed loop has each connection send its next
+ * command as soon as the last one is answered, and adds connections from
+ * step to step instead.
+ */
+
+/**
+  * run_load() runs the load generator against the server at server and port, connecting as
+  * get_socket() does, with the options in argv, argv[0] being "load":
+  *   -t <threads>      threads, each with its own connections (default 4)
+  *   -c <connections>  connections per thread (default 16)
+  *   -k <keys>         keys the commands pick from, all added first (default 10000)
+  *   -r <percent>      share of queries; the rest are adds and removes (default 90)
+  *   -d <seconds>      length of a step (default 2)
+  *   -l <ms>           99th percentile latency that ends the ramp (default 10)
+  *   -s <ops/s>        rate of the first step (default 1000)
+  *   -g <percent>      rate added at each step (default 50)
+  *   -C                closed loop: 1, 2, 4, ... connections per thread
+  * Returns the exit status of the client program.
+  */
+int run_load(const char *server, const char *port, int argc, char *argv[]);
+
+#endif  // LOAD_H_
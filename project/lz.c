@@ -0,0 +1,172 @@
+#include "./lz.h"
+#include <stdint.h>
+#include <string.h>
+
+/* LZ77 block compression for large values (see lz.h for the format) */
+
+#define LZ_MINMATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+// A match may not start in the last LZ_MFLIMIT bytes, nor run into the
+// last LZ_LASTLITERALS, which keeps the encoder's reads in bounds.
+#define LZ_MFLIMIT 12
+#define LZ_LASTLITERALS 5
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the part of a length that did not fit in its nibble. */
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Reads the part of a length that did not fit in its nibble.
+ * Returns 0 on success, or -1 if the input ends first. */
+static int get_length(const unsigned char **ipp, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ipp >= iend) {
+            return -1;
+        }
+        b = *(*ipp)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Emits one sequence: literals from anchor up to ip and, if mlen is not
+ * zero, a match of mlen bytes at offset. Returns the new output position,
+ * or NULL if the sequence would not fit before oend. */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const unsigned char *anchor, size_t lit,
+                                   size_t offset, size_t mlen) {
+    // Token, literal length bytes, literals, offset and match length bytes.
+    size_t worst = 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+    if (worst > (size_t)(oend - op)) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) {
+        op = put_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (mlen == 0) {
+        return op;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= LZ_MINMATCH;
+    *token |= mlen >= 15 ? 15 : mlen;
+    if (mlen >= 15) {
+        op = put_length(op, mlen - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *end = base + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + cap;
+    // Last position, plus one, at which each hashed 4-byte sequence was seen.
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ_MFLIMIT) {
+        const unsigned char *mflimit = end - LZ_MFLIMIT;
+        const unsigned char *mlimit = end - LZ_LASTLITERALS;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            unsigned h = hash4(seq);
+            uint32_t seen = table[h];
+            table[h] = ip - base + 1;
+            if (seen == 0 || ip - (base + seen - 1) > LZ_MAX_OFFSET ||
+                read32(base + seen - 1) != seq) {
+                ip++;
+                continue;
+            }
+            const unsigned char *ref = base + seen - 1;
+            size_t mlen = LZ_MINMATCH;
+            while (ip + mlen < mlimit && ref[mlen] == ip[mlen]) {
+                mlen++;
+            }
+            if ((op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen)) == NULL) {
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    if ((op = put_sequence(op, oend, anchor, end - anchor, 0, 0)) == NULL) {
+        return 0;
+    }
+    return op - (unsigned char *)dst;
+}
+
+long lz_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) < 0) {
+            return -1;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;  // The last sequence has no match
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst)) {
+            return -1;
+        }
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) < 0) {
+            return -1;
+        }
+        mlen += LZ_MINMATCH;
+        if (mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+        const unsigned char *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+        } else {
+            // The match overlaps what it produces, as in a run.
+            for (size_t i = 0; i < mlen; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += mlen;
+    }
+    return op - (unsigned char *)dst;
+}
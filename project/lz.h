@@ -0,0 +1,27 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+
+/*
+ * A small LZ77 block codec in the style of LZ4: a sequence is a token byte
+ * holding a literal length and a match length in its two nibbles, the
+ * literals, and a two-byte little-endian offset back into the output.
+ * Lengths that do not fit in a nibble continue in bytes of 255. The last
+ * sequence carries literals only.
+ */
+
+/**
+  * lz_compress() compresses len bytes of src into dst, which has room for cap bytes.
+  * Returns the compressed length, or 0 if it would not fit in cap.
+  */
+size_t lz_compress(const char *src, size_t len, char *dst, size_t cap);
+
+/**
+  * lz_decompress() expands len compressed bytes of src into dst, which has room for cap
+  * bytes. Every length and offset is checked, so src need not be trusted.
+  * Returns the expanded length, or -1 if src is malformed or does not fit in cap.
+  */
+long lz_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+#endif  // LZ_H_
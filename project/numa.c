@@ -0,0 +1,284 @@
+#include "./numa.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* NUMA topology, node-local memory and access accounting (see numa.h) */
+
+// Bytes mapped at a time for one size class on one node.
+#define SLAB_BYTES (1 << 20)
+
+// Object sizes: 64-byte steps up to 512, then doubling up to NUMA_ALLOC_MAX.
+#define NUM_CLASSES 12
+
+// mbind() policy: take pages from the given node while it has any free.
+#define MPOL_PREFERRED 1
+
+static struct topology {
+    int count;
+    int kernel_id[NUMA_MAX_NODES];  // The node's number in /sys and mbind()
+    cpu_set_t cpus[NUMA_MAX_NODES];
+    unsigned char cpu_node[CPU_SETSIZE];
+} topo;
+
+typedef struct free_obj {
+    struct free_obj *next;
+} free_obj_t;
+
+typedef struct node_class {
+    pthread_mutex_t mutex;
+    free_obj_t *free;
+    char *fresh;  // Unused tail of the newest slab
+    size_t fresh_left;
+} __attribute__((aligned(64))) node_class_t;
+
+static node_class_t classes[NUMA_MAX_NODES][NUM_CLASSES];
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+/*
+ * What the calling thread accessed since its last numa_follow(). Kept per
+ * thread so that counting an access never touches a shared cache line.
+ */
+static __thread struct {
+    int node;  // Where the thread runs, -1 until first looked up
+    unsigned long hits[NUMA_MAX_NODES];
+    unsigned long local;
+    unsigned long remote;
+} here = {-1};
+
+static unsigned long total_local;
+static unsigned long total_remote;
+static unsigned long moves;  // Threads moved by numa_follow()
+static unsigned long slab_bytes;
+static unsigned long unplaced;  // Slabs the kernel would not place
+
+/* Reads the first line of path into buf. Returns 0, or -1 if there is none. */
+static int read_line(const char *path, char *buf, int len) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+        return -1;
+    char *line = fgets(buf, len, in);
+    fclose(in);
+    return line ? 0 : -1;
+}
+
+/* Parses a kernel list such as "0-3,8,10-11" into set. */
+static void parse_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list >= '0' && *list <= '9') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long i = first; i <= last && i < CPU_SETSIZE; i++)
+            CPU_SET(i, set);
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+static void numa_init(void) {
+    char path[64];
+    char line[4096];
+    cpu_set_t online;
+
+    if (read_line("/sys/devices/system/node/online", line, sizeof(line)) == 0) {
+        parse_list(line, &online);
+    } else {
+        CPU_ZERO(&online);
+    }
+    for (int id = 0; id < CPU_SETSIZE; id++) {
+        cpu_set_t cpus;
+        if (!CPU_ISSET(id, &online))
+            continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        if (read_line(path, line, sizeof(line)) < 0)
+            continue;
+        parse_list(line, &cpus);
+        if (CPU_COUNT(&cpus) == 0)
+            continue;  // Memory only; threads never run there
+        if (topo.count == NUMA_MAX_NODES) {
+            // Fold the rest onto the nodes found so far.
+            int node = id % NUMA_MAX_NODES;
+            CPU_OR(&topo.cpus[node], &topo.cpus[node], &cpus);
+            continue;
+        }
+        topo.kernel_id[topo.count] = id;
+        topo.cpus[topo.count++] = cpus;
+    }
+    if (topo.count == 0) {
+        topo.count = 1;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &topo.cpus[0]);
+    }
+    for (int node = 0; node < topo.count; node++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &topo.cpus[node]))
+                topo.cpu_node[cpu] = node;
+        }
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            if (pthread_mutex_init(&classes[node][c].mutex, 0)) {
+                perror("could not initialize mutex");
+                exit(1);
+            }
+        }
+    }
+}
+
+int numa_nodes(void) {
+    pthread_once(&numa_once, numa_init);
+    return topo.count;
+}
+
+int numa_current_node(void) {
+    pthread_once(&numa_once, numa_init);
+    int cpu = sched_getcpu();
+    return (cpu < 0 || cpu >= CPU_SETSIZE) ? 0 : topo.cpu_node[cpu];
+}
+
+int numa_pin(int node) {
+    pthread_once(&numa_once, numa_init);
+    if (node < 0 || node >= topo.count)
+        return -1;
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &topo.cpus[node]) < 0)
+        return -1;
+    here.node = node;
+    return 0;
+}
+
+static int class_of(size_t size) {
+    if (size <= 512)
+        return size ? (size - 1) / 64 : 0;
+    int c = 8;
+    while ((size_t)(512 << (c - 7)) < size)
+        c++;
+    return c;
+}
+
+static size_t class_size(int c) {
+    return c < 8 ? (size_t)(c + 1) * 64 : (size_t)512 << (c - 7);
+}
+
+/* Maps a slab and asks the kernel to take its pages from node. Placement
+ * is a preference: the slab is used wherever its pages end up. */
+static char *slab_map(int node) {
+    char *slab = mmap(NULL, SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (slab == MAP_FAILED)
+        return NULL;
+    if (topo.count > 1) {
+        unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+        int id = topo.kernel_id[node];
+        mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, slab, SLAB_BYTES, MPOL_PREFERRED, mask, CPU_SETSIZE + 1, 0) < 0)
+            __atomic_fetch_add(&unplaced, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&slab_bytes, SLAB_BYTES, __ATOMIC_RELAXED);
+    return slab;
+}
+
+void *numa_node_alloc(int node, size_t size) {
+    pthread_once(&numa_once, numa_init);
+    if (node < 0 || node >= topo.count || size > NUMA_ALLOC_MAX)
+        return NULL;
+    int c = class_of(size);
+    node_class_t *nc = &classes[node][c];
+    void *obj;
+    if (pthread_mutex_lock(&nc->mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    if (nc->free) {
+        obj = nc->free;
+        nc->free = nc->free->next;
+    } else {
+        if (nc->fresh_left < class_size(c)) {
+            char *slab = slab_map(node);
+            if (slab == NULL) {
+                pthread_mutex_unlock(&nc->mutex);
+                return NULL;
+            }
+            nc->fresh = slab;
+            nc->fresh_left = SLAB_BYTES;
+        }
+        obj = nc->fresh;
+        nc->fresh += class_size(c);
+        nc->fresh_left -= class_size(c);
+    }
+    if (pthread_mutex_unlock(&nc->mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    return obj;
+}
+
+void numa_node_free(int node, void *obj, size_t size) {
+    node_class_t *nc = &classes[node][class_of(size)];
+    if (pthread_mutex_lock(&nc->mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    ((free_obj_t *)obj)->next = nc->free;
+    nc->free = obj;
+    if (pthread_mutex_unlock(&nc->mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+void numa_count(int node) {
+    if (node < 0)
+        return;
+    if (here.node < 0)
+        here.node = numa_current_node();
+    here.hits[node]++;
+    if (node == here.node) {
+        here.local++;
+    } else {
+        here.remote++;
+    }
+}
+
+int numa_follow(void) {
+    unsigned long total = 0;
+    int best = 0;
+    int count = numa_nodes();
+    for (int node = 0; node < count; node++) {
+        total += here.hits[node];
+        if (here.hits[node] > here.hits[best])
+            best = node;
+    }
+    __atomic_fetch_add(&total_local, here.local, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total_remote, here.remote, __ATOMIC_RELAXED);
+    unsigned long best_hits = here.hits[best];
+    memset(here.hits, 0, sizeof(here.hits));
+    here.local = here.remote = 0;
+    if (count > 1 && best != here.node && best_hits * 2 > total && numa_pin(best) == 0) {
+        __atomic_fetch_add(&moves, 1, __ATOMIC_RELAXED);
+        return best;
+    }
+    // An unpinned thread may have been moved by the scheduler meanwhile.
+    here.node = numa_current_node();
+    return -1;
+}
+
+void numa_counts(unsigned long *local, unsigned long *remote) {
+    *local = __atomic_load_n(&total_local, __ATOMIC_RELAXED);
+    *remote = __atomic_load_n(&total_remote, __ATOMIC_RELAXED);
+}
+
+void numa_stats(char *buf, int len) {
+    snprintf(buf, len,
+             "numa_nodes=%d numa_local=%lu numa_remote=%lu numa_moves=%lu numa_bytes=%lu "
+             "numa_unplaced=%lu ",
+             numa_nodes(), __atomic_load_n(&total_local, __ATOMIC_RELAXED),
+             __atomic_load_n(&total_remote, __ATOMIC_RELAXED),
+             __atomic_load_n(&moves, __ATOMIC_RELAXED),
+             __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&unplaced, __ATOMIC_RELAXED));
+}
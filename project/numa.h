@@ -0,0 +1,66 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include <stddef.h>
+
+/*
+ * NUMA placement: the machine's nodes, pinning threads to them, memory
+ * that lives on a given node and per-thread accounting of which nodes a
+ * thread's accesses go to. Nodes are numbered from 0 to numa_nodes() - 1,
+ * counting only nodes that have CPUs. Without NUMA, or where the topology
+ * cannot be read, the whole machine is node 0.
+ */
+
+// More nodes than this are folded onto the first ones.
+#define NUMA_MAX_NODES 64
+
+/**
+  * numa_nodes() returns the number of nodes.
+  */
+int numa_nodes(void);
+
+/**
+  * numa_current_node() returns the node of the CPU the calling thread runs on.
+  */
+int numa_current_node(void);
+
+/**
+  * numa_pin() restricts the calling thread to the CPUs of node.
+  * Returns 0 on success, or -1 if the kernel refused.
+  */
+int numa_pin(int node);
+
+/**
+  * numa_node_alloc() returns size bytes of memory placed on node, or NULL if memory ran out
+  * or size is more than NUMA_ALLOC_MAX. numa_node_free() takes them back; node and size must
+  * be those they were allocated with.
+  */
+#define NUMA_ALLOC_MAX 8192
+void *numa_node_alloc(int node, size_t size);
+void numa_node_free(int node, void *obj, size_t size);
+
+/**
+  * numa_count() records an access by the calling thread to memory on node, as local or
+  * remote to where the thread runs. Negative nodes are ignored.
+  */
+void numa_count(int node);
+
+/**
+  * numa_follow() moves the calling thread to the node that most of its accesses since the
+  * last call went to, if more than half went to one node that is not the thread's own.
+  * Returns that node, or -1 if the thread stayed.
+  */
+int numa_follow(void);
+
+/**
+  * numa_counts() stores the accesses counted so far by threads that have since called
+  * numa_follow(), as local and remote.
+  */
+void numa_counts(unsigned long *local, unsigned long *remote);
+
+/**
+  * numa_stats() writes the placement counters as space-separated key=value pairs into buf.
+  */
+void numa_stats(char *buf, int len);
+
+#endif  // NUMA_H_
@@ -0,0 +1,37 @@
+#include "./parse.h"
+#include <string.h>
+
+/* Splits client command lines into words (see parse.h) */
+
+#define SEPARATORS " \t\r\n"
+
+static inline int is_separator(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int parse_command(char *line, command_t *cmd) {
+    char *p = line;
+    if (p[0] == '\0' || p[1] == '\0')
+        return -1;
+    cmd->op = *p++;
+    cmd->argc = 0;
+    while (cmd->argc < PARSE_MAX_ARGS) {
+        // Words are usually one space apart.
+        while (is_separator(*p))
+            p++;
+        if (*p == '\0')
+            break;
+        // A value may run to a megabyte; strcspn() goes through it faster
+        // than a loop over its bytes, and stops at the same place.
+        size_t len = strcspn(p, SEPARATORS);
+        cmd->argv[cmd->argc].data = p;
+        cmd->argv[cmd->argc++].len = len;
+        p += len;
+        if (*p == '\0')
+            break;
+        *p++ = '\0';
+    }
+    // A word that runs on past op is the first of the words after it.
+    cmd->word_len = cmd->argc && cmd->argv[0].data == line + 1 ? 1 + cmd->argv[0].len : 1;
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef PARSE_H_
+#define PARSE_H_
+
+#include <stddef.h>
+
+/*
+ * One word of a command line: where it starts in the line and how long it
+ * is. The parser terminates the word in place, so data is also a string.
+ */
+typedef struct token {
+    char *data;
+    size_t len;
+} token_t;
+
+// Words a command takes after its letter; any after these are not looked at.
+#define PARSE_MAX_ARGS 2
+
+typedef struct command {
+    char op;  // The letter that names the command
+    size_t word_len;  // Length of the word op starts, such as "begin"
+    int argc;  // Words found after it
+    token_t argv[PARSE_MAX_ARGS];
+} command_t;
+
+/**
+  * parse_command() splits line into the letter it starts with and up to PARSE_MAX_ARGS words
+  * after it, separated by spaces, tabs or line ends, in one pass over line and without
+  * allocating. The words are left where they are, terminated in place, and described in cmd
+  * along with their lengths, so that nothing downstream has to measure them again. The word
+  * the letter starts is line itself, word_len long, for commands named by a whole word.
+  * Returns 0, or -1 if line is too short to hold a command.
+  */
+int parse_command(char *line, command_t *cmd);
+
+#endif  // PARSE_H_
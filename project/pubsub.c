@@ -0,0 +1,659 @@
+#include "./pubsub.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+
+/* Key-change notifications for watching connections */
+
+// Changes waiting for the dispatcher; writers drop changes beyond this.
+#define PUBSUB_BACKLOG 65536
+
+// Bytes of key a pooled event holds; longer keys take an event of their own.
+#define EVENT_NAME 64
+
+// The dispatcher tops up a writer's pool that has fewer events than this...
+#define POOL_LOW 32
+// ...with this many.
+#define POOL_BATCH 64
+
+// Notifications one watcher may fall behind before it loses some.
+#define WATCHER_QUEUE 4096
+
+#define WATCH_BUCKETS 1024
+
+/*
+ * One change, shared by the dispatch list and every watcher it is queued
+ * for. Once the last of them lets go, it goes back to the pool it came
+ * from, if any.
+ */
+typedef struct event {
+    int refs;
+    char op;
+    struct event *next;  // In the dispatch list or a pool
+    struct pool *pool;  // NULL for a key too long for a pooled event
+    char name[];
+} event_t;
+
+/*
+ * The events one writer thread takes its changes from, so that writers
+ * neither allocate nor lock while they hold the changed node. The
+ * dispatcher allocates them; the owner takes them off free, privately,
+ * and takes whatever was handed back to returned all at once, with an
+ * atomic exchange.
+ */
+typedef struct pool {
+    event_t *free;  // The owner's alone
+    event_t *returned;  // Pushed by any thread, taken by the owner
+    long stock;  // Events in free and returned
+    int in_use;  // Owned by a live thread
+    struct pool *next;
+} __attribute__((aligned(64))) pool_t;
+
+/*
+ * A watching connection. Its thread sleeps on efd, which the dispatcher
+ * signals when the queue stops being empty.
+ */
+typedef struct watcher {
+    pthread_mutex_t mutex;  // Guards the queue and overflow
+    event_t *queue[WATCHER_QUEUE];
+    unsigned head;
+    unsigned count;
+    int overflow;  // Notifications were dropped since the last "n overflow"
+    int efd;
+    FILE *out;  // Responses and notifications, apart from the commands read
+    event_t *sending;  // Taken off the queue and being written out
+    unsigned long stamp;  // Last change queued, so overlapping watches notify once
+    struct watch *watches;  // Guarded by the table mutex, as is next
+    struct watcher *next;
+} watcher_t;
+
+/*
+ * A pattern watched by one watcher: a whole key, or a prefix.
+ */
+typedef struct watch {
+    char *pattern;
+    size_t len;
+    int prefix;
+    watcher_t *watcher;
+    struct watch *next;  // In the bucket
+    struct watch *next_of_watcher;
+} watch_t;
+
+/*
+ * Changes on their way from writers to the dispatcher: a list that writers
+ * push onto, newest first, and that the dispatcher takes whole. Changes to
+ * one key are pushed with its node locked, so they keep their order.
+ */
+static struct {
+    event_t *head;
+    long backlog;
+    int lost;  // Changes were dropped since the dispatcher last looked
+    int efd;  // Signaled when the list stops being empty
+} dispatch;
+
+static pool_t *pools;  // Only ever grows
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pool_key;
+static __thread pool_t *my_pool;
+
+/*
+ * Every watch, hashed by pattern and kind. A change to a key of length n
+ * is matched by one lookup of the key and one of each of its prefixes
+ * whose length some prefix watch has.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    watch_t *buckets[WATCH_BUCKETS];
+    int prefix_watches[MAX_KEYLEN + 1];  // Prefix watches of each length
+    size_t *lens;  // The lengths that have any
+    int num_lens;
+    watcher_t *watchers;
+    unsigned long seq;  // Changes dispatched
+} table = {PTHREAD_MUTEX_INITIALIZER};
+
+static int watches;  // Read by writers without any lock
+static int num_watchers;
+static unsigned long notifications;
+static unsigned long drops;
+
+static void (*next_hook)(char op, const char *name, value_t *value);
+
+static void mutex_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+/* Pushes event onto the list at *head, which any thread may push onto and
+ * one takes whole. Returns the event that was on top. */
+static event_t *event_push(event_t **head, event_t *event) {
+    event_t *top = __atomic_load_n(head, __ATOMIC_RELAXED);
+    do {
+        event->next = top;
+    } while (!__atomic_compare_exchange_n(head, &top, event, 1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+    return top;
+}
+
+static void event_release(event_t *event) {
+    if (event == NULL || __atomic_sub_fetch(&event->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (event->pool) {
+        event_push(&event->pool->returned, event);
+        __atomic_fetch_add(&event->pool->stock, 1, __ATOMIC_RELAXED);
+    } else {
+        free(event);
+    }
+}
+
+/* Thread-exit destructor that leaves a pool, and its events, to the next
+ * writer thread. */
+static void pool_release(void *arg) {
+    __atomic_store_n(&((pool_t *)arg)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the calling thread's pool, taking one on first use, or NULL if
+ * memory ran out. */
+static pool_t *pool_get(void) {
+    pool_t *pool;
+    if (my_pool)
+        return my_pool;
+    mutex_lock(&pools_mutex);
+    for (pool = pools; pool; pool = pool->next) {
+        if (!__atomic_load_n(&pool->in_use, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (pool == NULL && posix_memalign((void **)&pool, sizeof(pool_t), sizeof(pool_t)) == 0) {
+        memset(pool, 0, sizeof(pool_t));
+        pool->next = pools;
+        __atomic_store_n(&pools, pool, __ATOMIC_RELEASE);
+    }
+    if (pool)
+        __atomic_store_n(&pool->in_use, 1, __ATOMIC_RELEASE);
+    mutex_unlock(&pools_mutex);
+    if (pool) {
+        pthread_setspecific(pool_key, pool);
+        my_pool = pool;
+    }
+    return pool;
+}
+
+/* Allocates an event for pool, or for a key len bytes long if pool is NULL. */
+static event_t *event_alloc(pool_t *pool, size_t len) {
+    event_t *event = malloc(sizeof(event_t) + (pool ? EVENT_NAME + 1 : len + 1));
+    if (event)
+        event->pool = pool;
+    return event;
+}
+
+/* Takes an event for a key len bytes long, from the calling thread's pool
+ * if it fits one. Returns NULL if there is none to be had. */
+static event_t *event_take(size_t len) {
+    pool_t *pool = len <= EVENT_NAME ? pool_get() : NULL;
+    event_t *event;
+    if (pool == NULL)
+        return event_alloc(NULL, len);
+    if (pool->free == NULL)
+        pool->free = __atomic_exchange_n(&pool->returned, NULL, __ATOMIC_ACQUIRE);
+    if ((event = pool->free) != NULL) {
+        pool->free = event->next;
+        __atomic_fetch_sub(&pool->stock, 1, __ATOMIC_RELAXED);
+        return event;
+    }
+    // Ran dry before the dispatcher could top it up
+    return event_alloc(pool, 0);
+}
+
+static void dispatch_wake(void) {
+    uint64_t one = 1;
+    if (write(dispatch.efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write");
+}
+
+/* The db_change_hook, chained in front of the one set before. Runs with
+ * the changed node write-locked, so it does no more than take an event
+ * from its thread's pool and push it onto the dispatch list. */
+static void pubsub_publish(char op, const char *name, value_t *value) {
+    if (next_hook)
+        next_hook(op, name, value);
+    if (!__atomic_load_n(&watches, __ATOMIC_ACQUIRE))
+        return;
+    size_t len = strlen(name);
+    event_t *event = NULL;
+    if (__atomic_add_fetch(&dispatch.backlog, 1, __ATOMIC_RELAXED) > PUBSUB_BACKLOG ||
+        (event = event_take(len)) == NULL) {
+        __atomic_fetch_sub(&dispatch.backlog, 1, __ATOMIC_RELAXED);
+        // Every watcher is told it missed something.
+        if (!__atomic_exchange_n(&dispatch.lost, 1, __ATOMIC_RELEASE))
+            dispatch_wake();
+        return;
+    }
+    event->refs = 1;
+    event->op = op;
+    memcpy(event->name, name, len + 1);
+    if (event_push(&dispatch.head, event) == NULL)
+        dispatch_wake();
+}
+
+static unsigned long watch_hash(const char *pattern, size_t len, int prefix) {
+    uint64_t h = 14695981039346656037ULL ^ prefix;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)pattern[i];
+        h *= 1099511628211ULL;
+    }
+    return h % WATCH_BUCKETS;
+}
+
+static void watcher_wake(watcher_t *watcher) {
+    uint64_t one = 1;
+    if (write(watcher->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("write");
+}
+
+/* Queues event for watcher. Called by the dispatcher with the table mutex
+ * held, which keeps the watcher from going away meanwhile. */
+static void watcher_push(watcher_t *watcher, event_t *event) {
+    int wake;
+    if (watcher->stamp == table.seq)
+        return;
+    watcher->stamp = table.seq;
+    mutex_lock(&watcher->mutex);
+    wake = watcher->count == 0 && !watcher->overflow;
+    if (watcher->count == WATCHER_QUEUE) {
+        watcher->overflow = 1;
+        __atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&event->refs, 1, __ATOMIC_RELAXED);
+        watcher->queue[(watcher->head + watcher->count++) % WATCHER_QUEUE] = event;
+        __atomic_fetch_add(&notifications, 1, __ATOMIC_RELAXED);
+    }
+    mutex_unlock(&watcher->mutex);
+    if (wake)
+        watcher_wake(watcher);
+}
+
+/* Marks watcher as having lost notifications. Same locking as watcher_push(). */
+static void watcher_overflow(watcher_t *watcher) {
+    mutex_lock(&watcher->mutex);
+    int wake = watcher->count == 0 && !watcher->overflow;
+    watcher->overflow = 1;
+    mutex_unlock(&watcher->mutex);
+    if (wake)
+        watcher_wake(watcher);
+}
+
+static void dispatch_lookup(event_t *event, const char *pattern, size_t len, int prefix) {
+    for (watch_t *watch = table.buckets[watch_hash(pattern, len, prefix)]; watch;
+         watch = watch->next) {
+        if (watch->prefix == prefix && watch->len == len &&
+            memcmp(watch->pattern, pattern, len) == 0)
+            watcher_push(watch->watcher, event);
+    }
+}
+
+/* Allocates events for the pools of live writer threads running low, so
+ * that they rarely have to. */
+static void dispatch_stock(void) {
+    for (pool_t *pool = __atomic_load_n(&pools, __ATOMIC_ACQUIRE); pool; pool = pool->next) {
+        if (!__atomic_load_n(&pool->in_use, __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&pool->stock, __ATOMIC_RELAXED) >= POOL_LOW)
+            continue;
+        for (int i = 0; i < POOL_BATCH; i++) {
+            event_t *event = event_alloc(pool, 0);
+            if (event == NULL)
+                break;
+            event_push(&pool->returned, event);
+            __atomic_fetch_add(&pool->stock, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *dispatch_main(void *arg) {
+    while (1) {
+        uint64_t count;
+        event_t *pushed = __atomic_exchange_n(&dispatch.head, NULL, __ATOMIC_ACQUIRE);
+        int lost = __atomic_exchange_n(&dispatch.lost, 0, __ATOMIC_ACQUIRE);
+        if (pushed == NULL && !lost) {
+            // A writer that pushes onto the empty list signals efd after
+            // the push, so nothing pushed since the exchange is missed.
+            if (read(dispatch.efd, &count, sizeof(count)) < 0 && errno != EINTR) {
+                perror("read");
+                exit(1);
+            }
+            continue;
+        }
+        // The list is newest first; changes go out in the order they were made.
+        event_t *events = NULL;
+        long taken = 0;
+        while (pushed) {
+            event_t *next = pushed->next;
+            pushed->next = events;
+            events = pushed;
+            pushed = next;
+            taken++;
+        }
+        __atomic_fetch_sub(&dispatch.backlog, taken, __ATOMIC_RELAXED);
+
+        mutex_lock(&table.mutex);
+        if (lost) {
+            for (watcher_t *watcher = table.watchers; watcher; watcher = watcher->next)
+                watcher_overflow(watcher);
+        }
+        for (event_t *event = events; event; event = event->next) {
+            size_t len = strlen(event->name);
+            table.seq++;
+            dispatch_lookup(event, event->name, len, 0);
+            for (int i = 0; i < table.num_lens; i++) {
+                if (table.lens[i] <= len)
+                    dispatch_lookup(event, event->name, table.lens[i], 1);
+            }
+        }
+        mutex_unlock(&table.mutex);
+
+        while (events) {
+            event_t *next = events->next;
+            event_release(events);
+            events = next;
+        }
+        dispatch_stock();
+    }
+    return NULL;
+}
+
+void pubsub_init(void) {
+    pthread_t thread;
+    int err;
+    // Blocking: the dispatcher sleeps in read() until a writer signals it.
+    if ((dispatch.efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    if ((err = pthread_key_create(&pool_key, pool_release)))
+        handle_error_en(err, "pthread_key_create");
+    if ((err = pthread_create(&thread, 0, dispatch_main, 0)))
+        handle_error_en(err, "pthread_create");
+    if ((err = pthread_detach(thread)))
+        handle_error_en(err, "pthread_detach");
+    next_hook = db_change_hook;
+    db_change_hook = &pubsub_publish;
+}
+
+/* Adds a watch of pattern for watcher. Called with the table mutex held.
+ * Returns 0 on success, 1 if watcher already has it, -1 if memory ran out. */
+static int watch_add(watcher_t *watcher, const char *pattern, size_t len, int prefix) {
+    watch_t *watch;
+    for (watch = watcher->watches; watch; watch = watch->next_of_watcher) {
+        if (watch->prefix == prefix && watch->len == len &&
+            memcmp(watch->pattern, pattern, len) == 0)
+            return 1;
+    }
+    if (prefix && table.prefix_watches[len] == 0) {
+        size_t *lens = realloc(table.lens, (table.num_lens + 1) * sizeof(size_t));
+        if (lens == NULL)
+            return -1;
+        table.lens = lens;
+    }
+    if ((watch = malloc(sizeof(watch_t))) == NULL)
+        return -1;
+    if ((watch->pattern = strndup(pattern, len)) == NULL) {
+        free(watch);
+        return -1;
+    }
+    if (prefix && table.prefix_watches[len]++ == 0)
+        table.lens[table.num_lens++] = len;
+    watch->len = len;
+    watch->prefix = prefix;
+    watch->watcher = watcher;
+    watch_t **bucket = &table.buckets[watch_hash(pattern, len, prefix)];
+    watch->next = *bucket;
+    *bucket = watch;
+    watch->next_of_watcher = watcher->watches;
+    watcher->watches = watch;
+    __atomic_fetch_add(&watches, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Takes watch out of the table and frees it. Called with the table mutex
+ * held; the caller unlinks it from its watcher. */
+static void watch_free(watch_t *watch) {
+    watch_t **pp = &table.buckets[watch_hash(watch->pattern, watch->len, watch->prefix)];
+    while (*pp != watch)
+        pp = &(*pp)->next;
+    *pp = watch->next;
+    if (watch->prefix && --table.prefix_watches[watch->len] == 0) {
+        for (int i = 0; i < table.num_lens; i++) {
+            if (table.lens[i] == watch->len) {
+                table.lens[i] = table.lens[--table.num_lens];
+                break;
+            }
+        }
+    }
+    __atomic_fetch_sub(&watches, 1, __ATOMIC_RELEASE);
+    free(watch->pattern);
+    free(watch);
+}
+
+/* Removes watcher's watch of pattern. Called with the table mutex held.
+ * Returns 0 on success, or -1 if watcher has no such watch. */
+static int watch_remove(watcher_t *watcher, const char *pattern, size_t len, int prefix) {
+    for (watch_t **pp = &watcher->watches; *pp; pp = &(*pp)->next_of_watcher) {
+        watch_t *watch = *pp;
+        if (watch->prefix == prefix && watch->len == len &&
+            memcmp(watch->pattern, pattern, len) == 0) {
+            *pp = watch->next_of_watcher;
+            watch_free(watch);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Cleanup routine that takes a watcher out of the table and frees it. */
+static void watcher_destroy(void *arg) {
+    watcher_t *watcher = (watcher_t *)arg;
+    mutex_lock(&table.mutex);
+    while (watcher->watches) {
+        watch_t *watch = watcher->watches;
+        watcher->watches = watch->next_of_watcher;
+        watch_free(watch);
+    }
+    for (watcher_t **pp = &table.watchers; *pp; pp = &(*pp)->next) {
+        if (*pp == watcher) {
+            *pp = watcher->next;
+            break;
+        }
+    }
+    __atomic_fetch_sub(&num_watchers, 1, __ATOMIC_RELAXED);
+    mutex_unlock(&table.mutex);
+    // The dispatcher only touches watchers in the table.
+    for (unsigned i = 0; i < watcher->count; i++)
+        event_release(watcher->queue[(watcher->head + i) % WATCHER_QUEUE]);
+    event_release(watcher->sending);
+    close(watcher->efd);
+    if (watcher->out)
+        fclose(watcher->out);
+    pthread_mutex_destroy(&watcher->mutex);
+    free(watcher);
+}
+
+/* Runs one command from a watching connection and writes its response.
+ * Returns -1 on a write error, 0 otherwise. */
+static int watcher_command(watcher_t *watcher, char *line) {
+    char *cursor = line;
+    char *cmd = strsep(&cursor, " \r\n");
+    char *pattern = cursor ? strsep(&cursor, " \r\n") : NULL;
+    const char *response;
+    int ret = 0;
+
+    int watch = strcmp(cmd, "watch") == 0;
+    if ((!watch && strcmp(cmd, "unwatch") != 0) || pattern == NULL || *pattern == '\0') {
+        response = "only watch and unwatch are allowed";
+    } else {
+        size_t len = strlen(pattern);
+        int prefix = pattern[len - 1] == '*';
+        if (prefix)
+            len--;
+        if (len > MAX_KEYLEN) {
+            response = "key too long";
+        } else {
+            mutex_lock(&table.mutex);
+            ret = watch ? watch_add(watcher, pattern, len, prefix)
+                        : watch_remove(watcher, pattern, len, prefix);
+            mutex_unlock(&table.mutex);
+            if (watch)
+                response = ret < 0 ? "out of memory" : ret ? "already watching" : "watching";
+            else
+                response = ret < 0 ? "not watching" : "unwatched";
+        }
+    }
+    if (fprintf(watcher->out, "%s\n", response) < 0 || fflush(watcher->out) == EOF)
+        return -1;
+    return 0;
+}
+
+/* Runs every whole command the client has sent so far, whether stdio has
+ * buffered it already or it still waits on the socket, without waiting for
+ * more. line, of size bytes, holds the *used bytes of a command begun
+ * earlier. Returns -1 once the client is gone, 0 otherwise. */
+static int watcher_read(watcher_t *watcher, FILE *cxstr, char *line, size_t size, size_t *used) {
+    int fd = fileno(cxstr);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return -1;
+    while (1) {
+        // Non-blocking for the read alone: out shares the socket and has to
+        // write in full to a client slow to take it.
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+            return -1;
+        char *got = fgets(line + *used, size - *used, cxstr);
+        int err = errno;
+        if (fcntl(fd, F_SETFL, flags) < 0)
+            return -1;
+        if (got == NULL) {
+            if (feof(cxstr) || err != EAGAIN)
+                return -1;
+            clearerr(cxstr);
+            return 0;
+        }
+        *used += strlen(got);
+        if (line[*used - 1] == '\n') {
+            line[*used - 1] = '\0';
+        } else if (*used < size - 1) {
+            // The rest of the command has not arrived yet; an EAGAIN may
+            // have cut it short.
+            clearerr(cxstr);
+            return 0;
+        }
+        // A command too long for line is run as far as it goes.
+        *used = 0;
+        if (watcher_command(watcher, line) < 0)
+            return -1;
+    }
+}
+
+/* Writes out everything queued for watcher. Returns 0 on success, or -1
+ * on a write error. */
+static int watcher_flush(watcher_t *watcher) {
+    uint64_t count;
+    if (read(watcher->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -1;
+    while (1) {
+        int overflow = 0;
+        mutex_lock(&watcher->mutex);
+        if (watcher->count > 0) {
+            watcher->sending = watcher->queue[watcher->head];
+            watcher->head = (watcher->head + 1) % WATCHER_QUEUE;
+            watcher->count--;
+        } else {
+            // Lost notifications are reported after those that made it.
+            overflow = watcher->overflow;
+            watcher->overflow = 0;
+        }
+        mutex_unlock(&watcher->mutex);
+        if (watcher->sending) {
+            int err = fprintf(watcher->out, "n %c %s\n", watcher->sending->op, watcher->sending->name);
+            event_release(watcher->sending);
+            watcher->sending = NULL;
+            if (err < 0)
+                return -1;
+        } else {
+            if (overflow && fprintf(watcher->out, "n overflow\n") < 0)
+                return -1;
+            return fflush(watcher->out) == EOF ? -1 : 0;
+        }
+    }
+}
+
+void pubsub_serve(FILE *cxstr, char *command) {
+    watcher_t *watcher = calloc(1, sizeof(watcher_t));
+    if (watcher == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (pthread_mutex_init(&watcher->mutex, 0)) {
+        perror("could not initialize mutex");
+        exit(1);
+    }
+    if ((watcher->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    // stdio cannot write to a stream that still holds unread input, as
+    // cxstr may, so everything sent goes through a stream of its own.
+    int fd = fileno(cxstr);
+    int outfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (outfd < 0 || (watcher->out = fdopen(outfd, "w")) == NULL) {
+        perror("fdopen");
+        exit(1);
+    }
+    mutex_lock(&table.mutex);
+    watcher->next = table.watchers;
+    table.watchers = watcher;
+    __atomic_fetch_add(&num_watchers, 1, __ATOMIC_RELAXED);
+    mutex_unlock(&table.mutex);
+
+    // Commands are still read through cxstr, which may hold some the client
+    // sent along with the first. Once stdio has handed over all it has, one
+    // poll() covers the socket and the notifications.
+    char line[MAX_KEYLEN + BUFLEN];
+    size_t used = 0;
+    pthread_cleanup_push(watcher_destroy, watcher);
+    int done = watcher_command(watcher, command) < 0;
+    while (!done && watcher_read(watcher, cxstr, line, sizeof(line), &used) == 0) {
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {watcher->efd, POLLIN, 0}};
+        while (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                done = 1;
+                break;
+            }
+        }
+        if (!done && fds[1].revents && watcher_flush(watcher) < 0)
+            done = 1;
+    }
+    pthread_cleanup_pop(1);
+}
+
+void pubsub_stats(char *buf, int len) {
+    snprintf(buf, len, "watchers=%d watches=%d notifications=%lu notify_drops=%lu ",
+             __atomic_load_n(&num_watchers, __ATOMIC_RELAXED),
+             __atomic_load_n(&watches, __ATOMIC_RELAXED),
+             __atomic_load_n(&notifications, __ATOMIC_RELAXED),
+             __atomic_load_n(&drops, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,31 @@
+#ifndef PUBSUB_H_
+#define PUBSUB_H_
+
+#include <stdio.h>
+
+/**
+  * pubsub_init() starts the thread that hands key changes to watching connections, and
+  * chains itself onto db_change_hook. While nobody watches, a change costs the writer one
+  * atomic load; otherwise it pushes one small event, taken from a pool the thread keeps,
+  * onto a list with a compare-and-swap, taking no lock and rarely allocating. Allocating
+  * events, matching them and fanning them out to watchers happen on that thread.
+  */
+void pubsub_init(void);
+
+/**
+  * pubsub_serve() takes over a client connection that sent "watch <pattern>", given as
+  * command. A pattern is a key, or a prefix of keys followed by '*'. The connection may go
+  * on to send more "watch <pattern>" and "unwatch <pattern>" commands, each answered with
+  * one line, and is sent "n a <key>" or "n d <key>" whenever a watched key is added or
+  * removed. A watcher that falls too far behind loses notifications and is sent "n overflow"
+  * instead, and should then query the keys it caches again. Returns once the connection
+  * closes.
+  */
+void pubsub_serve(FILE *cxstr, char *command);
+
+/**
+  * pubsub_stats() writes the watch counters as space-separated key=value pairs into buf.
+  */
+void pubsub_stats(char *buf, int len);
+
+#endif  // PUBSUB_H_
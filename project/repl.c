@@ -0,0 +1,400 @@
+#include "./repl.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+
+/* Primary/replica replication over a streaming change log */
+
+// Changes kept for replicas; one further behind than this is dropped.
+#define REPL_LOG_SIZE 65536
+
+// How long a replica stream may stay idle before a heartbeat is sent.
+#define REPL_HEARTBEAT_SEC 1
+
+// Changes taken from the log under its mutex before they are sent.
+#define REPL_BATCH 256
+
+typedef struct repl_entry {
+    unsigned long seq;
+    char op;
+    char *name;
+    value_t *value;  // A reference shared with the database, not a copy
+} repl_entry_t;
+
+/*
+ * A replica attached to this server, i.e. one repl_serve() call.
+ */
+typedef struct repl_follower {
+    unsigned long cursor;  // Next sequence number to send
+    struct repl_follower *next;
+} repl_follower_t;
+
+/*
+ * The change log: a ring holding the last REPL_LOG_SIZE changes, those
+ * with sequence numbers (last_seq - REPL_LOG_SIZE, last_seq].
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;  // Broadcast when a change is appended
+    unsigned long last_seq;
+    int replicas;  // Also read without the mutex by repl_append()
+    repl_follower_t *followers;
+    repl_entry_t entries[REPL_LOG_SIZE];
+} repl_log = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/*
+ * State of this server as a replica.
+ */
+static struct {
+    FILE *cxstr;  // Connection to the primary, NULL once disconnected
+    pthread_t thread;
+    int active;  // Set by repl_start_replica(), cleared by repl_promote()
+    int streaming;  // Snapshot loaded, applying changes
+    unsigned long applied;  // Last primary sequence number applied
+    unsigned long primary_seq;  // Newest primary sequence number seen
+    time_t last_contact;
+    char *host;
+    char *port;
+} replica;
+
+static void repl_lock(void) {
+    if (pthread_mutex_lock(&repl_log.mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+}
+
+static void repl_unlock(void) {
+    if (pthread_mutex_unlock(&repl_log.mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+/* The db_change_hook. Runs with the changed node write-locked, so it only
+ * ever takes the log mutex, and allocates before taking it. */
+static void repl_append(char op, const char *name, value_t *value) {
+    if (!__atomic_load_n(&repl_log.replicas, __ATOMIC_SEQ_CST)) {
+        // The commit took its timestamp before this load, and a replica
+        // counts itself before its snapshot reads the clock, all of them
+        // sequentially consistent. So a replica this load misses takes a
+        // snapshot that covers the timestamp, and db_dump() waits for the
+        // change's version to be stamped: the change is in the snapshot.
+        return;
+    }
+    char *name_copy = strdup(name);
+    if (!name_copy) {
+        perror("strdup");
+        exit(1);
+    }
+    value_t *value_copy = value ? value_ref(value) : NULL;
+
+    repl_lock();
+    unsigned long seq = ++repl_log.last_seq;
+    repl_entry_t *entry = &repl_log.entries[seq % REPL_LOG_SIZE];
+    char *old_name = entry->name;
+    value_t *old_value = entry->value;
+    entry->seq = seq;
+    entry->op = op;
+    entry->name = name_copy;
+    entry->value = value_copy;
+    if (pthread_cond_broadcast(&repl_log.cond)) {
+        perror("pthread_cond_broadcast failure: \n");
+        exit(1);
+    }
+    repl_unlock();
+
+    free(old_name);
+    value_release(old_value);
+}
+
+void repl_init(void) {
+    db_change_hook = &repl_append;
+}
+
+/* Copies up to max changes starting at follower->cursor into batch,
+ * sharing their values. Called with the log mutex held; the changes are
+ * formatted, and compressed values inflated, once it is released.
+ * Returns the number of changes copied. */
+static int repl_gather(repl_follower_t *follower, repl_entry_t *batch, int max) {
+    int n = 0;
+    while (follower->cursor <= repl_log.last_seq && n < max) {
+        repl_entry_t *entry = &repl_log.entries[follower->cursor % REPL_LOG_SIZE];
+        batch[n].seq = entry->seq;
+        batch[n].op = entry->op;
+        if ((batch[n].name = strdup(entry->name)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        batch[n].value = entry->value ? value_ref(entry->value) : NULL;
+        n++;
+        follower->cursor++;
+    }
+    return n;
+}
+
+/* Writes one change gathered by repl_gather() to the replica and frees it.
+ * Returns 0 on success, or -1 on a write error. */
+static int repl_send(FILE *cxstr, repl_entry_t *entry, int ret) {
+    if (ret == 0 && entry->op == 'a') {
+        if (fprintf(cxstr, "%lu a %s ", entry->seq, entry->name) < 0 ||
+            value_write(entry->value, cxstr) < 0 || fputc('\n', cxstr) == EOF) {
+            ret = -1;
+        }
+    } else if (ret == 0 && fprintf(cxstr, "%lu d %s\n", entry->seq, entry->name) < 0) {
+        ret = -1;
+    }
+    free(entry->name);
+    value_release(entry->value);
+    return ret;
+}
+
+void repl_serve(FILE *cxstr) {
+    repl_follower_t follower;
+    repl_entry_t *batch;
+    if ((batch = malloc(REPL_BATCH * sizeof(repl_entry_t))) == NULL) {
+        perror("malloc failed: \n");
+        exit(1);
+    }
+
+    // Registering before the snapshot starts means every change is either
+    // in the snapshot or in the stream, possibly both. Applying a change
+    // twice is harmless: a repeated add of a present key fails, as does a
+    // repeated remove of a missing one, and the replica ends up in the
+    // state of the last change to each key either way.
+    repl_lock();
+    follower.cursor = repl_log.last_seq + 1;
+    follower.next = repl_log.followers;
+    repl_log.followers = &follower;
+    // Sequentially consistent, against the load in repl_append()
+    __atomic_fetch_add(&repl_log.replicas, 1, __ATOMIC_SEQ_CST);
+    repl_unlock();
+    fprintf(stderr, "replica attached at %lu\n", follower.cursor - 1);
+
+    if (db_dump(cxstr) < 0 || fprintf(cxstr, "snapshot %lu\n", follower.cursor - 1) < 0 ||
+        fflush(cxstr) == EOF) {
+        goto detach;
+    }
+
+    while (1) {
+        int behind = 0;
+        int used = 0;
+        unsigned long last_seq;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REPL_HEARTBEAT_SEC;
+
+        repl_lock();
+        while (follower.cursor > repl_log.last_seq) {
+            int err = pthread_cond_timedwait(&repl_log.cond, &repl_log.mutex, &deadline);
+            if (err == ETIMEDOUT) {
+                break;
+            } else if (err) {
+                handle_error_en(err, "pthread_cond_timedwait");
+            }
+        }
+        if (repl_log.last_seq - follower.cursor + 1 > REPL_LOG_SIZE) {
+            behind = 1;
+        } else {
+            used = repl_gather(&follower, batch, REPL_BATCH);
+        }
+        last_seq = repl_log.last_seq;
+        repl_unlock();
+
+        if (behind) {
+            fprintf(stderr, "replica fell more than %d changes behind\n", REPL_LOG_SIZE);
+            break;
+        }
+        if (used == 0 && fprintf(cxstr, "%lu h\n", last_seq) < 0) {
+            break;
+        }
+        int err = 0;
+        for (int i = 0; i < used; i++) {
+            err = repl_send(cxstr, &batch[i], err);
+        }
+        if (err < 0) {
+            break;
+        }
+        // Flush once caught up rather than after every change.
+        if (follower.cursor > last_seq && fflush(cxstr) == EOF) {
+            break;
+        }
+        if (comm_peer_gone(cxstr)) {
+            break;
+        }
+    }
+
+detach:
+    repl_lock();
+    for (repl_follower_t **pp = &repl_log.followers; *pp; pp = &(*pp)->next) {
+        if (*pp == &follower) {
+            *pp = follower.next;
+            break;
+        }
+    }
+    __atomic_fetch_sub(&repl_log.replicas, 1, __ATOMIC_RELEASE);
+    repl_unlock();
+    free(batch);
+    fprintf(stderr, "replica detached\n");
+}
+
+/* Splits the next space-delimited word off *cursor, terminating it in
+ * place. Returns the word, or NULL if there are no more. */
+static char *repl_word(char **cursor) {
+    char *word;
+    while ((word = strsep(cursor, " \n")) != NULL && *word == '\0')
+        ;
+    return word;
+}
+
+/* Applies one line received from the primary. Keys and values are split
+ * off the line in place, as interpret_command() does. */
+static void repl_apply(char *line) {
+    char *cursor;
+    char *name;
+    char *value;
+    unsigned long seq;
+    char op;
+    int end = 0;
+
+    if (line[0] == 'a') {
+        // Snapshot entry
+        cursor = line + 1;
+        if ((name = repl_word(&cursor)) && (value = repl_word(&cursor))) {
+            db_add(name, value);
+        }
+        return;
+    }
+    if (sscanf(line, "snapshot %lu", &seq) == 1) {
+        __atomic_store_n(&replica.applied, seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&replica.primary_seq, seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&replica.streaming, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "replica loaded snapshot at %lu\n", seq);
+        return;
+    }
+    if (sscanf(line, "%lu %c%n", &seq, &op, &end) != 2) {
+        fprintf(stderr, "bad replication line: %s", line);
+        return;
+    }
+    switch (op) {
+    case 'a':
+        cursor = line + end;
+        if ((name = repl_word(&cursor)) && (value = repl_word(&cursor))) {
+            db_add(name, value);
+        }
+        break;
+    case 'd':
+        cursor = line + end;
+        if ((name = repl_word(&cursor))) {
+            db_remove(name);
+        }
+        break;
+    case 'h':
+        // Heartbeats carry the primary's newest sequence number.
+        __atomic_store_n(&replica.primary_seq, seq, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(&replica.applied, seq, __ATOMIC_RELAXED);
+    if (seq > replica.primary_seq) {
+        __atomic_store_n(&replica.primary_seq, seq, __ATOMIC_RELAXED);
+    }
+}
+
+static void *replica_main(void *arg) {
+    FILE *cxstr = comm_connect(replica.host, replica.port);
+    if (cxstr == NULL) {
+        fprintf(stderr, "replica could not reach primary\n");
+        return NULL;
+    }
+    repl_lock();
+    replica.cxstr = cxstr;
+    repl_unlock();
+
+    if (fputs("replicate\n", cxstr) == EOF || fflush(cxstr) == EOF) {
+        perror("fputs");
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, cxstr) > 0) {
+        __atomic_store_n(&replica.last_contact, time(NULL), __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&replica.active, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        repl_apply(line);
+    }
+    free(line);
+    fprintf(stderr, "replica disconnected from primary\n");
+
+    repl_lock();
+    replica.cxstr = NULL;
+    repl_unlock();
+    comm_shutdown(cxstr);
+    return NULL;
+}
+
+void repl_start_replica(const char *host, const char *port) {
+    if (!(replica.host = strdup(host)) || !(replica.port = strdup(port))) {
+        perror("strdup");
+        exit(1);
+    }
+    db_read_only = 1;
+    replica.active = 1;
+    replica.last_contact = time(NULL);
+    int err;
+    if ((err = pthread_create(&replica.thread, 0, replica_main, NULL)))
+        handle_error_en(err, "pthread_create");
+    if ((err = pthread_detach(replica.thread)))
+        handle_error_en(err, "pthread_detach");
+}
+
+int repl_promote(void) {
+    if (!__atomic_load_n(&replica.active, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    __atomic_store_n(&replica.active, 0, __ATOMIC_RELEASE);
+    repl_lock();
+    // Wakes the replica thread out of fgets; it stops applying changes.
+    if (replica.cxstr) {
+        comm_drain(replica.cxstr);
+    }
+    repl_unlock();
+    db_read_only = 0;
+    return 0;
+}
+
+void repl_stats(char *buf, int len) {
+    repl_lock();
+    unsigned long last_seq = repl_log.last_seq;
+    unsigned long max_lag = 0;
+    for (repl_follower_t *f = repl_log.followers; f; f = f->next) {
+        if (last_seq + 1 - f->cursor > max_lag) {
+            max_lag = last_seq + 1 - f->cursor;
+        }
+    }
+    int connected = replica.cxstr != NULL;
+    repl_unlock();
+
+    int n = snprintf(buf, len, "replicas=%d log_seq=%lu replica_lag=%lu",
+                     __atomic_load_n(&repl_log.replicas, __ATOMIC_RELAXED),
+                     last_seq, max_lag);
+    if (n >= len || !__atomic_load_n(&replica.active, __ATOMIC_RELAXED)) {
+        return;
+    }
+    unsigned long applied = __atomic_load_n(&replica.applied, __ATOMIC_RELAXED);
+    unsigned long primary_seq = __atomic_load_n(&replica.primary_seq, __ATOMIC_RELAXED);
+    snprintf(buf + n, len - n,
+             " primary=%s#%s state=%s applied=%lu lag=%lu last_contact=%lds",
+             replica.host, replica.port,
+             !connected ? "disconnected"
+                 : __atomic_load_n(&replica.streaming, __ATOMIC_RELAXED) ? "streaming"
+                 : "syncing",
+             applied, primary_seq > applied ? primary_seq - applied : 0,
+             (long)(time(NULL) - __atomic_load_n(&replica.last_contact, __ATOMIC_RELAXED)));
+}
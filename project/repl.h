@@ -0,0 +1,40 @@
+#ifndef REPL_H_
+#define REPL_H_
+
+#include <stdio.h>
+
+/**
+  * repl_init() starts recording database changes for replicas. Changes are only kept
+  * while at least one replica is attached, so an unreplicated server pays one atomic
+  * load per change.
+  */
+void repl_init(void);
+
+/**
+  * repl_serve() takes over a client connection that asked to "replicate". It sends a
+  * snapshot of the database followed by "snapshot <seq>", and then every later change
+  * as "<seq> a <key> <value>" or "<seq> d <key>", with "<seq> h" heartbeats carrying
+  * the newest sequence number while idle. Returns once the replica goes away or falls
+  * further behind than the change log holds.
+  */
+void repl_serve(FILE *cxstr);
+
+/**
+  * repl_start_replica() makes this server a read-only replica of the server at host:port.
+  * A thread connects to it, loads its snapshot and applies its changes in order.
+  */
+void repl_start_replica(const char *host, const char *port);
+
+/**
+  * repl_promote() stops following the primary and makes the database writable again.
+  * Returns 0 on success, or -1 if this server is not a replica.
+  */
+int repl_promote(void);
+
+/**
+  * repl_stats() writes the replication state of this server, primary side and replica
+  * side, as space-separated key=value pairs into buf.
+  */
+void repl_stats(char *buf, int len);
+
+#endif  // REPL_H_
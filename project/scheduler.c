@@ -0,0 +1,566 @@
+#include "./scheduler.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+
+/* Command scheduling: priority classes and the file import worker */
+
+// How many times a bulk command yields to interactive commands in flight
+// before it goes ahead anyway, so that bulk work is slowed, never starved.
+#define SCHED_BULK_YIELDS 16
+
+// Nice value of the import worker thread.
+#define SCHED_IMPORT_NICE 10
+
+// How many imports are remembered, finished ones included, for "j".
+#define SCHED_IMPORTS_KEPT 64
+
+// Lines and bytes an import hands to one of its workers at a time.
+#define SCHED_CHUNK_LINES 256
+#define SCHED_CHUNK_BYTES (64 << 10)
+
+// Chunks that may wait for one worker before the reader waits for it.
+#define SCHED_CHUNKS_QUEUED 4
+
+// States of an import
+#define IMPORT_QUEUED 0
+#define IMPORT_RUNNING 1
+#define IMPORT_DONE 2
+#define IMPORT_ABORTED 3
+#define IMPORT_BAD_FILE 4
+
+/*
+ * A file import. The reader thread takes imports from the queue one at a
+ * time and deals the file's lines out to the workers in chunks, every line
+ * to the worker its key hashes to, so that the commands on any one key run
+ * in the order of the file. The import is finished once the reader has
+ * reached the end of the file and the workers have run every chunk.
+ */
+typedef struct import_job {
+    unsigned long id;
+    char *filename;
+    keyspace_t *space;  // Its commands run in
+    int state;
+    int reading;  // The reader has not reached the end of the file yet
+    int chunks_out;  // Chunks handed to workers and not yet run
+    int aborted;  // Lines were skipped because of sched_stop()
+    long size;  // Of the file, in bytes
+    // Updated atomically while the import runs
+    unsigned long offset;  // Bytes read so far
+    unsigned long lines;
+    unsigned long added;
+    unsigned long removed;
+    unsigned long queries;
+    unsigned long failed;
+    struct timespec start;
+    struct timespec end;
+    struct import_job *next;  // In the queue
+    struct import_job *older;  // In the list of imports, newest first
+} import_job_t;
+
+/* Lines of one import for one worker, each terminated by a '\0'. */
+typedef struct import_chunk {
+    import_job_t *job;
+    int lines;
+    size_t used;
+    size_t cap;
+    char *data;
+    struct import_chunk *next;
+} import_chunk_t;
+
+typedef struct import_worker {
+    pthread_t thread;
+    pthread_cond_t cond;  // Signalled when a chunk is queued for the worker
+    import_chunk_t *head;
+    import_chunk_t *tail;
+    int queued;
+    import_chunk_t *fill;  // The chunk the reader is filling, its own
+} import_worker_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_cond;  // Signalled when a bulk slot frees up
+    pthread_cond_t job_cond;  // Signalled when an import is queued
+    pthread_cond_t done_cond;  // Broadcast when an import finishes
+    pthread_cond_t room_cond;  // Broadcast when a worker takes a chunk
+    int interactive;  // Interactive commands in flight, updated atomically
+    int bulk_running;
+    int bulk_slots;
+    int queue_depth;
+    int queued;
+    int stopping;
+    int active;  // Imports queued or running
+    unsigned long last_id;
+    import_job_t *queue_head;
+    import_job_t *queue_tail;
+    import_job_t *jobs;  // Every import kept, newest first
+    pthread_t reader;
+    import_worker_t *workers;
+    int num_workers;
+    // Counters for sched_stats()
+    unsigned long bulk_yields;
+    unsigned long imports;
+    unsigned long imported_lines;
+    unsigned long rejected;
+} sched = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void sched_lock(void) {
+    if (pthread_mutex_lock(&sched.mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+}
+
+static void sched_unlock(void) {
+    if (pthread_mutex_unlock(&sched.mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+void sched_enter(int sched_class) {
+    if (sched_class == SCHED_INTERACTIVE) {
+        __atomic_fetch_add(&sched.interactive, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int yields = 0;
+    while (yields < SCHED_BULK_YIELDS &&
+           __atomic_load_n(&sched.interactive, __ATOMIC_RELAXED) > 0) {
+        sched_yield();
+        yields++;
+    }
+    sched_lock();
+    sched.bulk_yields += yields;
+    while (sched.bulk_running >= sched.bulk_slots) {
+        if (pthread_cond_wait(&sched.slot_cond, &sched.mutex)) {
+            perror("pthread_cond_wait failure: \n");
+            exit(1);
+        }
+    }
+    sched.bulk_running++;
+    sched_unlock();
+}
+
+void sched_exit(int sched_class) {
+    if (sched_class == SCHED_INTERACTIVE) {
+        __atomic_fetch_sub(&sched.interactive, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    sched_lock();
+    sched.bulk_running--;
+    if (pthread_cond_signal(&sched.slot_cond)) {
+        perror("pthread_cond_signal failure: \n");
+        exit(1);
+    }
+    sched_unlock();
+}
+
+
+static void sched_wait_on(pthread_cond_t *cond) {
+    if (pthread_cond_wait(cond, &sched.mutex)) {
+        perror("pthread_cond_wait failure: \n");
+        exit(1);
+    }
+}
+
+static void sched_broadcast(pthread_cond_t *cond) {
+    if (pthread_cond_broadcast(cond)) {
+        perror("pthread_cond_broadcast failure: \n");
+        exit(1);
+    }
+}
+
+/* Lowers the calling thread's priority, so that the kernel favours the
+ * client threads over imports whenever CPUs are contended. */
+static void import_nice(void) {
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), SCHED_IMPORT_NICE) < 0) {
+        perror("setpriority");
+    }
+}
+
+/* Marks job finished. Called with sched.mutex held. */
+static void import_finish(import_job_t *job, int state) {
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    if (job->state == IMPORT_QUEUED)
+        job->start = job->end;
+    job->state = state;
+    sched.active--;
+    sched.imports++;
+    sched.imported_lines += job->lines;
+    sched_broadcast(&sched.done_cond);
+}
+
+/* Hands the chunk worker w is being filled with to it. Called with
+ * sched.mutex held. */
+static void import_push(import_worker_t *w) {
+    import_chunk_t *chunk = w->fill;
+    w->fill = NULL;
+    while (w->queued >= SCHED_CHUNKS_QUEUED)
+        sched_wait_on(&sched.room_cond);
+    chunk->job->chunks_out++;
+    if (w->tail) {
+        w->tail->next = chunk;
+    } else {
+        w->head = chunk;
+    }
+    w->tail = chunk;
+    w->queued++;
+    if (pthread_cond_signal(&w->cond)) {
+        perror("pthread_cond_signal failure: \n");
+        exit(1);
+    }
+}
+
+/* Appends line to the chunk for the worker that runs the line's key.
+ * Returns that worker once its chunk is full, NULL otherwise. */
+static import_worker_t *import_deal(import_job_t *job, char *line, size_t len) {
+    // The key is the command's first word, as parse_command() splits it.
+    char *key = line + 1;
+    while (*key == ' ' || *key == '\t')
+        key++;
+    unsigned long hash = 2166136261UL;
+    for (char *c = key; *c && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n'; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619UL;
+    import_worker_t *w = &sched.workers[hash % sched.num_workers];
+    import_chunk_t *chunk = w->fill;
+    if (chunk == NULL) {
+        if ((chunk = calloc(1, sizeof(import_chunk_t))) == NULL) {
+            perror("malloc failed: \n");
+            exit(1);
+        }
+        chunk->job = job;
+        w->fill = chunk;
+    }
+    if (chunk->used + len + 1 > chunk->cap) {
+        size_t cap = chunk->cap ? chunk->cap : SCHED_CHUNK_BYTES;
+        while (cap < chunk->used + len + 1)
+            cap *= 2;
+        if ((chunk->data = realloc(chunk->data, cap)) == NULL) {
+            perror("malloc failed: \n");
+            exit(1);
+        }
+        chunk->cap = cap;
+    }
+    memcpy(chunk->data + chunk->used, line, len + 1);
+    chunk->used += len + 1;
+    chunk->lines++;
+    return chunk->lines >= SCHED_CHUNK_LINES || chunk->used >= SCHED_CHUNK_BYTES ? w : NULL;
+}
+
+/* Reads job's file and deals its lines out to the workers. */
+static void import_read(import_job_t *job, FILE *finput) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, finput)) > 0) {
+        __atomic_store_n(&job->offset, job->offset + len, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&sched.stopping, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&job->aborted, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (line[strspn(line, " \t\r\n")] == '\0')
+            continue;  // Blank
+        import_worker_t *full = import_deal(job, line, len);
+        if (full) {
+            sched_lock();
+            import_push(full);
+            sched_unlock();
+        }
+    }
+    free(line);
+    sched_lock();
+    for (int i = 0; i < sched.num_workers; i++) {
+        if (sched.workers[i].fill)
+            import_push(&sched.workers[i]);
+    }
+    job->reading = 0;
+    if (job->chunks_out == 0)
+        import_finish(job, __atomic_load_n(&job->aborted, __ATOMIC_RELAXED) ? IMPORT_ABORTED
+                                                                            : IMPORT_DONE);
+    sched_unlock();
+}
+
+static void *import_reader(void *arg) {
+    import_nice();
+    sched_lock();
+    while (1) {
+        while (!sched.queue_head)
+            sched_wait_on(&sched.job_cond);
+        import_job_t *job = sched.queue_head;
+        if (!(sched.queue_head = job->next)) {
+            sched.queue_tail = NULL;
+        }
+        sched.queued--;
+        FILE *finput = fopen(job->filename, "r");
+        if (!finput) {
+            import_finish(job, IMPORT_BAD_FILE);
+            continue;
+        }
+        struct stat st;
+        job->size = fstat(fileno(finput), &st) == 0 ? st.st_size : 0;
+        job->state = IMPORT_RUNNING;
+        job->reading = 1;
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+        sched_unlock();
+
+        // The next import may start as soon as this one is read: its
+        // commands on any key still queue up behind this one's.
+        import_read(job, finput);
+        fclose(finput);
+
+        sched_lock();
+    }
+    return NULL;
+}
+
+/* Runs the lines of chunk, each as a bulk command, and counts the results. */
+static void import_run(import_chunk_t *chunk) {
+    import_job_t *job = chunk->job;
+    char response[BUFLEN];
+    unsigned long added = 0, removed = 0, queries = 0, failed = 0;
+    int lines = 0;
+    char *line = chunk->data;
+    db_space_use(job->space);
+    for (; lines < chunk->lines; lines++) {
+        if (__atomic_load_n(&sched.stopping, __ATOMIC_RELAXED))
+            break;
+        char *next = line + strlen(line) + 1;
+        char op = line[0];
+        value_t *value = NULL;
+        db_space_admit();
+        sched_enter(SCHED_BULK);
+        interpret_command(line, response, BUFLEN, &value);
+        sched_exit(SCHED_BULK);
+        if (value) {
+            value_release(value);
+            queries++;
+        } else if (op == 'a' && strcmp(response, "added") == 0) {
+            added++;
+        } else if (op == 'd' && strcmp(response, "removed") == 0) {
+            removed++;
+        } else if ((op == 'q' || op == 'v') && strcmp(response, "not found") == 0) {
+            queries++;
+        } else if (!(op == 'f' && strcmp(response, "file processed") == 0)) {
+            failed++;
+        }
+        line = next;
+    }
+    __atomic_fetch_add(&job->lines, lines, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->added, added, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->removed, removed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->queries, queries, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->failed, failed, __ATOMIC_RELAXED);
+    if (lines < chunk->lines)
+        __atomic_store_n(&job->aborted, 1, __ATOMIC_RELAXED);
+}
+
+static void *import_worker(void *arg) {
+    import_worker_t *w = arg;
+    import_nice();
+    sched_lock();
+    while (1) {
+        while (!w->head)
+            sched_wait_on(&w->cond);
+        import_chunk_t *chunk = w->head;
+        if (!(w->head = chunk->next)) {
+            w->tail = NULL;
+        }
+        w->queued--;
+        sched_broadcast(&sched.room_cond);
+        sched_unlock();
+
+        import_run(chunk);
+
+        sched_lock();
+        import_job_t *job = chunk->job;
+        if (--job->chunks_out == 0 && !job->reading)
+            import_finish(job, __atomic_load_n(&job->aborted, __ATOMIC_RELAXED) ? IMPORT_ABORTED
+                                                                                : IMPORT_DONE);
+        free(chunk->data);
+        free(chunk);
+    }
+    return NULL;
+}
+
+void sched_init(int bulk_slots, int queue_depth, int import_workers) {
+    sched.bulk_slots = bulk_slots > 0 ? bulk_slots : 1;
+    sched.queue_depth = queue_depth > 0 ? queue_depth : 1;
+    sched.num_workers = import_workers > 0 ? import_workers : sched.bulk_slots;
+    if ((sched.workers = calloc(sched.num_workers, sizeof(import_worker_t))) == NULL) {
+        perror("malloc failed: \n");
+        exit(1);
+    }
+    int err;
+    for (int i = 0; i < sched.num_workers; i++) {
+        if (pthread_cond_init(&sched.workers[i].cond, 0)) {
+            perror("could not initialize condition");
+            exit(1);
+        }
+        if ((err = pthread_create(&sched.workers[i].thread, 0, import_worker, &sched.workers[i])))
+            handle_error_en(err, "pthread_create");
+        if ((err = pthread_detach(sched.workers[i].thread)))
+            handle_error_en(err, "pthread_detach");
+    }
+    if ((err = pthread_create(&sched.reader, 0, import_reader, NULL)))
+        handle_error_en(err, "pthread_create");
+    if ((err = pthread_detach(sched.reader)))
+        handle_error_en(err, "pthread_detach");
+}
+
+/* Frees the finished imports beyond the SCHED_IMPORTS_KEPT newest. Called
+ * with sched.mutex held. */
+static void import_prune(void) {
+    int kept = 0;
+    for (import_job_t **link = &sched.jobs; *link;) {
+        import_job_t *job = *link;
+        if (job->state >= IMPORT_DONE && ++kept > SCHED_IMPORTS_KEPT) {
+            *link = job->older;
+            free(job->filename);
+            free(job);
+        } else {
+            link = &job->older;
+        }
+    }
+}
+
+void sched_import(keyspace_t *space, char *filename, char *response, int len) {
+    sched_lock();
+    if (sched.stopping || sched.queued >= sched.queue_depth) {
+        sched.rejected++;
+        sched_unlock();
+        snprintf(response, len, "import queue full");
+        return;
+    }
+    import_job_t *job = calloc(1, sizeof(import_job_t));
+    if (job == NULL || (job->filename = strdup(filename)) == NULL) {
+        sched_unlock();
+        free(job);
+        snprintf(response, len, "out of memory");
+        return;
+    }
+    job->id = ++sched.last_id;
+    job->space = space;
+    job->state = IMPORT_QUEUED;
+    job->older = sched.jobs;
+    sched.jobs = job;
+    import_prune();
+    if (sched.queue_tail) {
+        sched.queue_tail->next = job;
+    } else {
+        sched.queue_head = job;
+    }
+    sched.queue_tail = job;
+    sched.queued++;
+    sched.active++;
+    if (pthread_cond_signal(&sched.job_cond)) {
+        perror("pthread_cond_signal failure: \n");
+        exit(1);
+    }
+    sched_unlock();
+    snprintf(response, len, "import %lu queued", job->id);
+}
+
+static import_job_t *import_find(unsigned long id) {
+    for (import_job_t *job = sched.jobs; job; job = job->older) {
+        if (job->id == id)
+            return job;
+    }
+    return NULL;
+}
+
+static double seconds_between(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void sched_import_status(unsigned long id, int wait, char *response, int len) {
+    // Nothing on this stack refers to the import, but a thread cancelled
+    // inside pthread_cond_wait() would hold sched.mutex. sched_stop() is
+    // what bounds the wait at shutdown.
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    sched_lock();
+    import_job_t *job;
+    // Looked up again after every wait, as finished imports are freed.
+    while ((job = import_find(id)) && wait && job->state < IMPORT_DONE)
+        sched_wait_on(&sched.done_cond);
+    if (job == NULL) {
+        snprintf(response, len, "no such import");
+    } else if (job->state == IMPORT_QUEUED) {
+        snprintf(response, len, "import %lu queued", id);
+    } else if (job->state == IMPORT_BAD_FILE) {
+        snprintf(response, len, "import %lu: bad file name", id);
+    } else {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int running = job->state == IMPORT_RUNNING;
+        double elapsed = seconds_between(&job->start, running ? &now : &job->end);
+        unsigned long lines = __atomic_load_n(&job->lines, __ATOMIC_RELAXED);
+        int n = snprintf(response, len, "import %lu ", id);
+        if (running) {
+            unsigned long offset = __atomic_load_n(&job->offset, __ATOMIC_RELAXED);
+            n += snprintf(response + n, len - n, "running, %d%% read: ",
+                          job->size > 0 ? (int)(offset * 100 / job->size) : 100);
+        } else {
+            n += snprintf(response + n, len - n, "%s: ",
+                          job->state == IMPORT_DONE ? "done" : "aborted");
+        }
+        snprintf(response + n, len - n,
+                 "lines=%lu added=%lu removed=%lu queries=%lu failed=%lu in %.3fs, %.0f ops/sec",
+                 lines, __atomic_load_n(&job->added, __ATOMIC_RELAXED),
+                 __atomic_load_n(&job->removed, __ATOMIC_RELAXED),
+                 __atomic_load_n(&job->queries, __ATOMIC_RELAXED),
+                 __atomic_load_n(&job->failed, __ATOMIC_RELAXED), elapsed,
+                 elapsed > 0 ? lines / elapsed : 0);
+    }
+    sched_unlock();
+    pthread_setcancelstate(oldstate, 0);
+}
+
+int sched_wait(const struct timespec *deadline) {
+    int err = 0;
+    sched_lock();
+    while (sched.active > 0 && err != ETIMEDOUT) {
+        if (!deadline) {
+            sched_wait_on(&sched.done_cond);
+        } else if ((err = pthread_cond_timedwait(&sched.done_cond, &sched.mutex, deadline)) &&
+                   err != ETIMEDOUT) {
+            perror("pthread_cond_timedwait failure: \n");
+            exit(1);
+        }
+    }
+    sched_unlock();
+    return err;
+}
+
+void sched_stop(void) {
+    sched_lock();
+    __atomic_store_n(&sched.stopping, 1, __ATOMIC_RELAXED);
+    // Queued imports are finished as aborted right away; the running ones
+    // skip the rest of their lines.
+    for (import_job_t *job = sched.queue_head; job; job = job->next) {
+        import_finish(job, IMPORT_ABORTED);
+    }
+    sched.queue_head = sched.queue_tail = NULL;
+    sched.queued = 0;
+    sched_unlock();
+}
+
+void sched_stats(char *buf, int len) {
+    sched_lock();
+    snprintf(buf, len, "imports=%lu imported_lines=%lu import_active=%d import_queue=%d "
+             "import_rejects=%lu import_workers=%d bulk_yields=%lu",
+             sched.imports, sched.imported_lines, sched.active, sched.queued, sched.rejected,
+             sched.num_workers, sched.bulk_yields);
+    sched_unlock();
+}
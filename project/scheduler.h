@@ -0,0 +1,59 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <time.h>
+#include "./db.h"
+
+// Priority classes of client connections
+#define SCHED_INTERACTIVE 0  // Point operations whose latency matters
+#define SCHED_BULK 1  // Background traffic that yields to interactive work
+
+/**
+  * sched_init() starts the low-priority import threads: a reader and import_workers workers
+  * (as many as bulk_slots if 0). At most bulk_slots bulk commands run in the database at
+  * once, and at most queue_depth file imports wait for the reader.
+  */
+void sched_init(int bulk_slots, int queue_depth, int import_workers);
+
+/**
+  * sched_enter() and sched_exit() bracket every client command. An interactive command
+  * only announces itself; a bulk command first gives way to interactive commands in
+  * flight and then waits for one of the bulk slots.
+  */
+void sched_enter(int sched_class);
+void sched_exit(int sched_class);
+
+/**
+  * sched_import() queues the "f" command's file for import into space and returns at once,
+  * writing the response for the client, with the import's number, into response. The reader
+  * deals the file's lines out to the workers by key, so that commands on the same key run in
+  * the order of the file while those on different keys run in parallel, each as a bulk
+  * command admitted by the keyspace's rate limit.
+  */
+void sched_import(keyspace_t *space, char *filename, char *response, int len);
+
+/**
+  * sched_import_status() writes the progress of import id into response, or once it is over
+  * its summary: the lines run, keys added and removed, queries, failed commands, the time
+  * taken and lines per second. With wait set, it first waits for the import to be over.
+  */
+void sched_import_status(unsigned long id, int wait, char *response, int len);
+
+/**
+  * sched_wait() waits until no import is queued or running, or until deadline if it is not
+  * NULL. Returns 0, or ETIMEDOUT if the deadline passed first.
+  */
+int sched_wait(const struct timespec *deadline);
+
+/**
+  * sched_stop() aborts the running imports and any queued ones, and refuses new ones.
+  * Called at shutdown; the imports are over once sched_wait() returns.
+  */
+void sched_stop(void);
+
+/**
+  * sched_stats() writes scheduler counters as space-separated key=value pairs into buf.
+  */
+void sched_stats(char *buf, int len);
+
+#endif  // SCHEDULER_H_
@@ -11,13 +11,35 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include "./bloom.h"
 #include "./comm.h"
 #include "./db.h"
+#include "./numa.h"
+#include "./pubsub.h"
+#include "./repl.h"
+#include "./scheduler.h"
+#include "./shm.h"
+#include "./trace.h"
 
 // Global variable to keep track of whether the server is still accepting clients.
-// Server should stop receiving clients in case of EOF, so this variable is set to
-// 1 in main after the while loop.
+// Server should stop receiving clients once it starts draining, so main sets this
+// variable to 1, under thread_list_mutex, when a shutdown is requested.
 int accepting;
+
+// Room for the single line that answers the admin "t" command.
+#define STATSLEN 2048
+
+// Commands between two looks at which NUMA node a client's keys live on.
+#define NUMA_FOLLOW_EVERY 1024
+
+// Server options, set from the command line in main.
+static int drain_seconds = 5;  // How long draining clients may take
+static int fast_exit;  // Skip freeing the database at exit
+static char *persist_file;  // Snapshot loaded at startup and written at exit
+static int numa_placement;  // Split the database over the NUMA nodes
+static int numa_shards;  // Into this many trees, 0 for one per node
+static char *space_args[DB_MAX_SPACES];  // "-k" options, made into keyspaces in main
+static int num_space_args;
 /* 
  * Use the variables in this struct to synchronize your main thread with client
  * threads. Note that all client threads must have terminated before you clean
@@ -27,6 +49,9 @@ typedef struct server_control {
     pthread_mutex_t server_mutex;
     pthread_cond_t server_cond;
     int num_client_threads;
+    int stopping;  // Set by the admin channel to make main shut down
+    unsigned long num_connections;  // Clients accepted since startup
+    unsigned long retired_commands;  // Commands served by exited clients
 } server_control_t;
 
 /*
@@ -46,6 +71,14 @@ typedef struct client_control {
 typedef struct client {
     pthread_t thread;
     FILE *cxstr;  // File stream for input and output
+    shm_region_t *shm;  // Shared-memory rings replacing cxstr, if attached
+    int sched_class;  // SCHED_INTERACTIVE or SCHED_BULK, set by the "c" command
+    char *command;  // The current command line, grown to fit
+    size_t command_cap;
+    value_t *value;  // Found by a query and not yet sent
+    int compressed_ok;  // Takes compressed values, set by the "z" command
+    txn_t *txn;  // The open transaction, from "begin" to "commit" or "abort"
+    unsigned long commands;  // Commands served, read by the admin thread
     // For client list
     struct client *prev;
     struct client *next;
@@ -53,7 +86,7 @@ typedef struct client {
 
 /*
  * The encapsulation of a thread that handles signals sent to the server.
- * When SIGINT is sent to the server all client threads should be destroyed.
+ * When SIGINT or SIGTERM is sent to the server it drains its clients and exits.
  */
 typedef struct sig_handler {
     sigset_t set;
@@ -64,32 +97,75 @@ typedef struct sig_handler {
 client_t *thread_list_head;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 server_control_t server_control = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+client_control_t client_control = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
 
 void *run_client(void *arg);
 void *monitor_signal(void *arg);
 void thread_cleanup(void *arg);
 
 /*
- * Called by client threads to wait until progress is permitted.
+ * Cleanup routine that releases the go mutex if a client thread is
+ * cancelled while waiting on the go condition.
+ */
+static void client_control_unlock(void *arg) {
+    pthread_mutex_unlock(&client_control.go_mutex);
+}
+
+/*
+ * Called by client threads to wait until progress is permitted. This runs
+ * once per command, so the common case is a single atomic load of the
+ * stopped flag; the mutex and condition are only touched while the admin
+ * channel holds clients stopped.
  */
 void client_control_wait() {
-    // TODO: Block the calling thread until the main thread calls
-    // client_control_release(). See the client_control_t struct.
+    if (!__atomic_load_n(&client_control.stopped, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (pthread_mutex_lock(&client_control.go_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    pthread_cleanup_push(&client_control_unlock, 0);
+    while (client_control.stopped){
+        if (pthread_cond_wait(&client_control.go, &client_control.go_mutex)){
+            perror("pthread_cond_wait failure: \n");
+            exit(1);
+        }
+    }
+    pthread_cleanup_pop(1);
 }
 
 /*
- * Called by main thread to stop client threads
+ * Called by the admin thread to stop client threads
  */
 void client_control_stop() {
-    // TODO: Ensure that the next time client threads call client_control_wait()
-    // at the top of the event loop in run_client, they will block.
+    if (pthread_mutex_lock(&client_control.go_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    __atomic_store_n(&client_control.stopped, 1, __ATOMIC_RELEASE);
+    if (pthread_mutex_unlock(&client_control.go_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
 }
 /*
- * Called by main thread to resume client threads
+ * Called by the admin thread to resume client threads
  */
 void client_control_release() {
-    // TODO: Allow clients that are blocked within client_control_wait()
-    // to continue. See the client_control_t struct.
+    if (pthread_mutex_lock(&client_control.go_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    __atomic_store_n(&client_control.stopped, 0, __ATOMIC_RELEASE);
+    if (pthread_cond_broadcast(&client_control.go)){
+        perror("pthread_cond_broadcast failure: \n");
+        exit(1);
+    }
+    if (pthread_mutex_unlock(&client_control.go_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
 }
 /*
  * Called by listener (in comm.c) to create a new client thread
@@ -103,6 +179,27 @@ void client_constructor(FILE *cxstr) {
     }
     // Client socket.
     client->cxstr = cxstr;
+    client->shm = NULL;
+    client->sched_class = SCHED_INTERACTIVE;
+    client->command = NULL;
+    client->command_cap = 0;
+    client->value = NULL;
+    client->compressed_ok = 0;
+    client->txn = NULL;
+    client->commands = 0;
+    // The thread is counted here, in the listener, rather than in run_client,
+    // so that once the listener has stopped main can rely on the count to
+    // cover every client thread that will ever touch the database.
+    if (pthread_mutex_lock(&server_control.server_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    server_control.num_client_threads++;
+    server_control.num_connections++;
+    if (pthread_mutex_unlock(&server_control.server_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
     int err;
     // Creates thread;
     if ((err = pthread_create(&client->thread, 0, run_client, client))){
@@ -117,9 +214,225 @@ void client_constructor(FILE *cxstr) {
  * space allocated for a variable pointing to the client.
  */
 void client_destructor(client_t *client) {    
+    if (client->shm){
+        shm_close(client->shm);
+    }
     comm_shutdown(client->cxstr);
+    value_release(client->value);
+    txn_abort(client->txn);
+    free(client->command);
     free(client);
 }
+/*
+ * Sends len bytes of out as one response over whichever transport the
+ * client is using.
+ */
+static int client_send(client_t *client, const char *out, size_t len) {
+    if (client->shm){
+        return shm_send(&client->shm->resp, out, len, fileno(client->cxstr));
+    }
+    return comm_send(client->cxstr, out, len);
+}
+
+/*
+ * Sends the previous response and reads the next command into
+ * client->command over whichever transport the client is using. A value
+ * found by the previous query is sent from where it is stored and
+ * released as soon as it is out, before waiting for the next command.
+ * A compressed value goes out as it is to a client that said it takes
+ * them, as a "z <length> <compressed length>" line followed by the
+ * compressed bytes, and is inflated here for any other client.
+ */
+static int client_serve(client_t *client, char *response) {
+    const char *out = response;
+    size_t len = strlen(response);
+    int sock = fileno(client->cxstr);
+    int ret = 0;
+    trace_begin(TRACE_SEND);
+    if (client->value && client->value->compressed && !client->compressed_ok){
+        value_t *plain = value_inflate(client->value);
+        value_release(client->value);
+        client->value = plain;
+        if (!plain){
+            snprintf(response, BUFLEN, "out of memory");
+            len = strlen(response);
+        }
+    }
+    if (client->value && client->value->compressed){
+        char frame[64];
+        int n = snprintf(frame, sizeof(frame), "z %zu %zu", client->value->raw_len,
+                         client->value->len);
+        ret = client_send(client, frame, n);
+        value_sent_compressed(client->value);
+    }
+    if (client->value){
+        out = client->value->data;
+        len = client->value->len;
+    }
+    if (ret == 0 && len > 0){
+        ret = client_send(client, out, len);
+    }
+    value_release(client->value);
+    client->value = NULL;
+    trace_end(TRACE_SEND);
+    trace_command();
+    if (ret == 0){
+        trace_begin(TRACE_READ);
+        ret = client->shm ? (int)shm_recv(&client->shm->req, &client->command,
+                                          &client->command_cap, COMM_MAXLINE, sock)
+                          : comm_read_line(client->cxstr, &client->command,
+                                           &client->command_cap);
+        trace_end(TRACE_READ);
+    }
+    if (ret < 0){
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Moves a client connected over the Unix domain socket onto a pair of
+ * shared-memory rings. The socket stays open only so that each side can
+ * tell when the other goes away.
+ */
+static void client_attach_shm(client_t *client, char *response) {
+    if (client->shm || !comm_is_local(client->cxstr)){
+        snprintf(response, BUFLEN, "shared memory unavailable");
+        return;
+    }
+    if ((client->shm = shm_offer(fileno(client->cxstr))) == NULL){
+        snprintf(response, BUFLEN, "shared memory unavailable");
+        return;
+    }
+    // shm_offer() already answered on the socket.
+    response[0] = '\0';
+}
+
+/* Whether command, split into cmd, is named word rather than a letter. */
+static int is_word(const char *command, const command_t *cmd, const char *word) {
+    return cmd->word_len == strlen(word) && memcmp(command, word, cmd->word_len) == 0;
+}
+
+/*
+ * Handles the commands that concern the connection or the scheduler rather
+ * than the database itself:
+ *   shm          move a local connection onto shared memory
+ *   c <i|b>      make this connection interactive or bulk
+ *   z <on|off>   take compressed values as they are stored, or not
+ *   k [name]     show the connection's keyspace, or switch to another
+ *   f <file>     queue a file for import by the low-priority import workers
+ *   j <n> [wait] show the progress or summary of import n, waiting for it to end
+ *   begin        start a transaction; q, a and d are part of it until
+ *   commit       it is applied all at once, or
+ *   abort        dropped
+ * cmd is command as parse_command() split it. Returns 1 if command was one
+ * of them, 0 if it is for interpret_parsed().
+ */
+static int server_command(client_t *client, char *command, const command_t *cmd,
+                          char *response) {
+    keyspace_t *space;
+    char *arg = cmd->argc > 0 ? cmd->argv[0].data : NULL;
+    if (is_word(command, cmd, "shm")){
+        client_attach_shm(client, response);
+        return 1;
+    }
+    if (is_word(command, cmd, "begin")){
+        if (client->txn){
+            snprintf(response, BUFLEN, "already in a transaction");
+        } else if ((client->txn = txn_begin()) == NULL){
+            snprintf(response, BUFLEN, "out of memory");
+        } else {
+            snprintf(response, BUFLEN, "transaction started");
+        }
+        return 1;
+    }
+    if (is_word(command, cmd, "commit")){
+        if (!client->txn){
+            snprintf(response, BUFLEN, "no transaction");
+            return 1;
+        }
+        trace_begin(TRACE_SCHED);
+        db_space_admit();
+        sched_enter(client->sched_class);
+        trace_end(TRACE_SCHED);
+        // txn_commit() frees the transaction and is no cancellation point.
+        txn_t *txn = client->txn;
+        client->txn = NULL;
+        trace_begin(TRACE_COMMIT);
+        int ret = txn_commit(txn);
+        trace_end(TRACE_COMMIT);
+        sched_exit(client->sched_class);
+        snprintf(response, BUFLEN, ret > 0 ? "committed" : ret == 0 ? "conflict, aborted"
+                                   : ret == -3 ? "keyspace over quota" : "out of memory");
+        return 1;
+    }
+    if (is_word(command, cmd, "abort")){
+        snprintf(response, BUFLEN, client->txn ? "aborted" : "no transaction");
+        txn_abort(client->txn);
+        client->txn = NULL;
+        return 1;
+    }
+    switch (cmd->op){
+    case 'c':
+        if (!arg || (arg[0] != 'i' && arg[0] != 'b')){
+            snprintf(response, BUFLEN, "ill-formed command");
+        } else if (arg[0] == 'b'){
+            client->sched_class = SCHED_BULK;
+            snprintf(response, BUFLEN, "class bulk");
+        } else {
+            client->sched_class = SCHED_INTERACTIVE;
+            snprintf(response, BUFLEN, "class interactive");
+        }
+        return 1;
+    case 'z':
+        if (!arg || (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)){
+            snprintf(response, BUFLEN, "ill-formed command");
+        } else {
+            client->compressed_ok = strcmp(arg, "on") == 0;
+            snprintf(response, BUFLEN, client->compressed_ok ? "compression on"
+                                                             : "compression off");
+        }
+        return 1;
+    case 'k':
+        // The keyspace is the thread's, and the thread is the connection's.
+        if (!arg){
+            snprintf(response, BUFLEN, "keyspace %s", db_space_name(db_space_current()));
+        } else if (client->txn){
+            snprintf(response, BUFLEN, "not allowed in a transaction");
+        } else if ((space = db_space(arg)) == NULL){
+            snprintf(response, BUFLEN, "no such keyspace");
+        } else {
+            db_space_use(space);
+            snprintf(response, BUFLEN, "keyspace %s", db_space_name(space));
+        }
+        return 1;
+    case 'f':
+        if (db_read_only){
+            snprintf(response, BUFLEN, "read-only replica");
+        } else if (client->txn){
+            snprintf(response, BUFLEN, "not allowed in a transaction");
+        } else if (!arg){
+            snprintf(response, BUFLEN, "ill-formed command");
+        } else {
+            sched_import(db_space_current(), arg, response, BUFLEN);
+        }
+        return 1;
+    case 'j': {
+        char *end;
+        unsigned long id = arg ? strtoul(arg, &end, 10) : 0;
+        int wait = cmd->argc > 1 && strcmp(cmd->argv[1].data, "wait") == 0;
+        if (!arg || *end != '\0' || end == arg || (cmd->argc > 1 && !wait)){
+            snprintf(response, BUFLEN, "ill-formed command");
+        } else {
+            sched_import_status(id, wait, response, BUFLEN);
+        }
+        return 1;
+    }
+    }
+    return 0;
+}
+
 /*
  * Client threads created are to run this function. In it,
  * the client list is modified to take in the new client, the signal
@@ -128,11 +441,6 @@ void client_destructor(client_t *client) {
  */
 void *run_client(void *arg) {
     client_t* client = (client_t*) arg;
-    if (accepting){
-        // Server has stopped accepting clients, indicating EOF.
-        client_destructor(client);
-        return (void*) -1;
-    }
     if (pthread_mutex_lock(&thread_list_mutex)){
         perror("mutex could not be locked: \n");
         exit(1);
@@ -146,25 +454,58 @@ void *run_client(void *arg) {
     client->prev = NULL;
     thread_list_head = client;
     pthread_cleanup_push(&thread_cleanup, client);
+    // Checked under thread_list_mutex: either drain_all() finds this client
+    // in the list, or the client sees that the server is draining.
+    int draining = accepting;
     if (pthread_mutex_unlock(&thread_list_mutex)){
         perror("mutex could not be locked: \n");
         exit(1);
     }
-    if (pthread_mutex_lock(&server_control.server_mutex)){
-        perror("mutex could not be locked: \n");
-        exit(1);
-    }    
-    server_control.num_client_threads++;
-    if (pthread_mutex_unlock(&server_control.server_mutex)){
-        perror("mutex could not be locked: \n");
-        exit(1);
-    }
     char response[BUFLEN];
-    char command[BUFLEN];
     memset(&response, 0, BUFLEN);
-    memset(&command, 0, BUFLEN);
-    while(comm_serve(client->cxstr, response, command) == 0){
-        interpret_command(command, response, BUFLEN);
+    while(!draining && client_serve(client, response) == 0){
+        char *command = client->command;
+        int stream = strcmp(command, "replicate\n") == 0 || strncmp(command, "watch ", 6) == 0;
+        if (stream && db_space_current() != db_space("default")){
+            // Changes are published for the default keyspace alone; a
+            // stream from another would carry some other tenant's keys.
+            snprintf(response, BUFLEN, "only in the default keyspace");
+            continue;
+        }
+        if (strcmp(command, "replicate\n") == 0 && !client->shm){
+            // The connection belongs to the replica stream from now on.
+            repl_serve(client->cxstr);
+            break;
+        }
+        if (strncmp(command, "watch ", 6) == 0 && !client->shm){
+            // So does a watching connection.
+            pubsub_serve(client->cxstr, command);
+            break;
+        }
+        client_control_wait();
+        // The command is split once; the database takes the words as they are.
+        command_t cmd;
+        trace_begin(TRACE_PARSE);
+        int parsed = parse_command(command, &cmd);
+        trace_end(TRACE_PARSE);
+        if (parsed < 0){
+            snprintf(response, BUFLEN, "ill-formed command");
+        } else if (!server_command(client, command, &cmd, response)){
+            trace_begin(TRACE_SCHED);
+            // A keyspace over its rate limit waits before it takes a slot.
+            db_space_admit();
+            sched_enter(client->sched_class);
+            trace_end(TRACE_SCHED);
+            trace_begin(TRACE_INTERPRET);
+            interpret_parsed(client->txn, &cmd, response, BUFLEN, &client->value);
+            trace_end(TRACE_INTERPRET);
+            sched_exit(client->sched_class);
+        }
+        __atomic_store_n(&client->commands, client->commands + 1, __ATOMIC_RELAXED);
+        // A client thread moves to the node that holds most of the keys it uses.
+        if (numa_placement && client->commands % NUMA_FOLLOW_EVERY == 0){
+            numa_follow();
+        }
     }
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
     pthread_cleanup_pop(1);
@@ -193,10 +534,62 @@ void delete_all() {
     }   
 }
 
+/*
+ * Stops accepting clients and closes the receive side of every client
+ * connection in one pass. A client that is idle in comm_serve sees end of
+ * file right away; a client in the middle of a command finishes it, sends
+ * the response and then sees end of file. Either way the thread exits
+ * through its normal path instead of being cancelled.
+ */
+void drain_all() {
+    if (pthread_mutex_lock(&thread_list_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    accepting = 1;
+    for (client_t* curr = thread_list_head; curr; curr = curr->next){
+        comm_drain(curr->cxstr);
+    }
+    if (pthread_mutex_unlock(&thread_list_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+/*
+ * Waits until every client thread has exited, giving up when the
+ * deadline passes if one is given.
+ * Returns 0 once all client threads are gone, ETIMEDOUT otherwise.
+ */
+int wait_for_clients(const struct timespec *deadline) {
+    int err = 0;
+    if (pthread_mutex_lock(&server_control.server_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    while (server_control.num_client_threads && err != ETIMEDOUT){
+        if (deadline){
+            err = pthread_cond_timedwait(&server_control.server_cond,
+                                         &server_control.server_mutex, deadline);
+        } else {
+            err = pthread_cond_wait(&server_control.server_cond, &server_control.server_mutex);
+        }
+        if (err && err != ETIMEDOUT){
+            handle_error_en(err, "pthread_cond_wait");
+        }
+    }
+    if (pthread_mutex_unlock(&server_control.server_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    return err;
+}
+
 /*
  * Cleanup routine for client threads, called on cancels and exit.
  */
 void thread_cleanup(void *arg) {
+    trace_thread_exit();
     // Removes client from the list. Since list is
     // modified in it, this function must be thread-safe.
     if (pthread_mutex_lock(&thread_list_mutex)){
@@ -207,7 +600,7 @@ void thread_cleanup(void *arg) {
     client_t* next = client->next;
     client_t* prev = client->prev;
     if (client == thread_list_head){
-        thread_list_head = NULL;
+        thread_list_head = next;
     }                     
     if (next){
         next->prev = prev;  
@@ -219,6 +612,7 @@ void thread_cleanup(void *arg) {
         perror("mutex could not be unlocked: \n");
         exit(1);
     }
+    unsigned long commands = client->commands;
     // Necessary to shut down client's connection to the server
     // and free up the space allocated for it.
     client_destructor(client);
@@ -226,11 +620,12 @@ void thread_cleanup(void *arg) {
         perror("mutex could not be locked: \n");
         exit(1);
     }
+    server_control.retired_commands += commands;
     // Decrementing global that keeps track of the number of
     // active clients connected to the server.
     server_control.num_client_threads--;
     if (!server_control.num_client_threads){
-        if (pthread_cond_signal(&server_control.server_cond)){
+        if (pthread_cond_broadcast(&server_control.server_cond)){
             perror("pthread_cond_broadcast failure: \n");
             exit(1);
         }
@@ -241,78 +636,456 @@ void thread_cleanup(void *arg) {
     }
 }
 /*
-// Code executed by the signal handler thread. For the purpose of this
-// assignment, there are two reasonable ways to implement this.
-// The one you choose will depend on logic in sig_handler_constructor.
-// 'man 7 signal' and 'man sigwait' are both helpful for making this
-// decision. One way or another, all of the server's client threads
-// should terminate on SIGINT. The server (this includes the listener
-// thread) should not, however, terminate on SIGINT!
+ * Writes a one-line summary of server and database state into buf.
+ */
+void server_stats(char *buf, int len) {
+    if (pthread_mutex_lock(&thread_list_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    unsigned long live_commands = 0;
+    for (client_t *curr = thread_list_head; curr; curr = curr->next){
+        live_commands += __atomic_load_n(&curr->commands, __ATOMIC_RELAXED);
+    }
+    if (pthread_mutex_lock(&server_control.server_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    int n = snprintf(buf, len, "clients=%d connections=%lu commands=%lu stopped=%d",
+                     server_control.num_client_threads, server_control.num_connections,
+                     server_control.retired_commands + live_commands,
+                     __atomic_load_n(&client_control.stopped, __ATOMIC_RELAXED));
+    if (pthread_mutex_unlock(&server_control.server_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    if (pthread_mutex_unlock(&thread_list_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    if (n < len - 1){
+        buf[n++] = ' ';
+        db_stats(buf + n, len - n);
+        n += strlen(buf + n);
+    }
+    if (n < len - 1){
+        buf[n++] = ' ';
+        sched_stats(buf + n, len - n);
+        n += strlen(buf + n);
+    }
+    if (n < len - 1){
+        buf[n++] = ' ';
+        pubsub_stats(buf + n, len - n);
+        n += strlen(buf + n);
+    }
+    if (n < len - 1){
+        buf[n++] = ' ';
+        repl_stats(buf + n, len - n);
+        n += strlen(buf + n);
+    }
+    if (n < len - 1 && trace_every > 0){
+        buf[n++] = ' ';
+        trace_stats(buf + n, len - n);
+    }
+}
+
+/*
+ * Asks the main thread to shut the server down.
+ */
+void server_request_stop() {
+    if (pthread_mutex_lock(&server_control.server_mutex)){
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    server_control.stopping = 1;
+    if (pthread_cond_broadcast(&server_control.server_cond)){
+        perror("pthread_cond_broadcast failure: \n");
+        exit(1);
+    }
+    if (pthread_mutex_unlock(&server_control.server_mutex)){
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+/*
+ * Reads a keyspace's quota or rate limit from text into *limit. Returns 0,
+ * or -1 unless text is a whole number of at least 0, which stands for no
+ * limit.
+ */
+static int parse_limit(const char *text, long *limit) {
+    char *end;
+    errno = 0;
+    *limit = strtol(text, &end, 10);
+    return end == text || *end != '\0' || errno || *limit < 0 ? -1 : 0;
+}
+
+/*
+ * Cleanup routine that frees the admin command buffer if the admin thread
+ * is cancelled while waiting for a command.
+ */
+static void admin_free_command(void *arg) {
+    free(*(char **)arg);
+}
+
+/*
+ * Serves one connection on the admin socket. Runs in the admin listener
+ * thread, so admin sessions never compete with client threads for the
+ * thread list or the database locks beyond what each command needs.
+ * Every command is answered with a single line:
+ *   p [file]  print the database to the server's stdout or to file
+ *   s         stop client threads before their next command
+ *   g         let stopped client threads go
+ *   w <file>  write a snapshot that "f <file>" can load back
+ *   t         report server statistics
+ *   l <file> [folded]
+ *             write the latency trace of sampled commands to file, as a
+ *             Chrome trace or as folded stacks for flame graphs
+ *   k [name [quota ops]]
+ *             list the keyspaces, report one's counters, or make one (or
+ *             change its limits) with quota bytes and ops commands a second
+ *   m         promote a replica: stop following the primary, accept writes
+ *   x         drain connections and shut the server down
+ */
+void admin_serve(FILE *cxstr) {
+    char response[STATSLEN];
+    char *command = NULL;
+    size_t command_cap = 0;
+    memset(&response, 0, STATSLEN);
+    pthread_cleanup_push(admin_free_command, &command);
+    while (comm_serve(cxstr, response, strlen(response), &command, &command_cap) == 0){
+        // Main cancels this thread on shutdown; a command must not be cut
+        // off while it holds database locks.
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+        char *arg = strtok(&command[1], " \t\n");
+        switch (command[0]){
+        case 'p':
+            if (db_print(arg) < 0){
+                snprintf(response, BUFLEN, "bad file name");
+            } else {
+                snprintf(response, BUFLEN, "printed");
+            }
+            break;
+        case 's':
+            client_control_stop();
+            snprintf(response, BUFLEN, "clients stopped");
+            break;
+        case 'g':
+            client_control_release();
+            snprintf(response, BUFLEN, "clients released");
+            break;
+        case 'w':
+            if (db_snapshot(arg) < 0){
+                snprintf(response, BUFLEN, "snapshot failed");
+            } else {
+                snprintf(response, BUFLEN, "snapshot written");
+            }
+            break;
+        case 't':
+            server_stats(response, STATSLEN);
+            break;
+        case 'l': {
+            char *format = strtok(NULL, " \t\n");
+            FILE *out;
+            long spans;
+            if (trace_every <= 0){
+                snprintf(response, BUFLEN, "tracing off");
+            } else if (!arg || (format && strcmp(format, "folded"))){
+                snprintf(response, BUFLEN, "ill-formed command");
+            } else if ((out = fopen(arg, "w")) == NULL){
+                snprintf(response, BUFLEN, "bad file name");
+            } else {
+                spans = trace_write(out, format != NULL);
+                if (fclose(out) || spans < 0){
+                    snprintf(response, BUFLEN, "trace failed");
+                } else {
+                    snprintf(response, BUFLEN, "trace written: %ld stages", spans);
+                }
+            }
+            break;
+        }
+        case 'k': {
+            char *quota = strtok(NULL, " \t\n");
+            char *ops = strtok(NULL, " \t\n");
+            long quota_bytes, ops_second;
+            keyspace_t *space;
+            if (!arg){
+                db_space_list(response, STATSLEN);
+            } else if (!quota){
+                if ((space = db_space(arg)) == NULL){
+                    snprintf(response, BUFLEN, "no such keyspace");
+                } else {
+                    db_space_stats(space, response, STATSLEN);
+                }
+            } else if (!ops || parse_limit(quota, &quota_bytes) < 0 ||
+                       parse_limit(ops, &ops_second) < 0){
+                snprintf(response, BUFLEN, "ill-formed command");
+            } else if ((space = db_space_create(arg, quota_bytes, ops_second)) == NULL){
+                snprintf(response, BUFLEN, "keyspace not made");
+            } else {
+                snprintf(response, BUFLEN, "keyspace %s", db_space_name(space));
+            }
+            break;
+        }
+        case 'm':
+            if (repl_promote() < 0){
+                snprintf(response, BUFLEN, "not a replica");
+            } else {
+                snprintf(response, BUFLEN, "promoted");
+            }
+            break;
+        case 'x':
+            server_request_stop();
+            snprintf(response, BUFLEN, "draining");
+            break;
+        default:
+            snprintf(response, BUFLEN, "ill-formed command");
+            break;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+    }
+    pthread_cleanup_pop(1);
+}
+
+/*
+ * Prints a usage tip.
+ */
+void usage_error(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-a <admin socket>] [-b <backlog>] [-B <rebalance percent>] [-d <drain seconds>] "
+            "[-e <expected keys>] [-F] [-i] "
+            "[-j <import workers>] [-k <keyspace>[:<quota bytes>[:<ops per second>]]] "
+            "[-l <listeners>] [-n <shards>] [-q <import queue>] [-r <primary host>:<port>] "
+            "[-s <snapshot file>] [-T <trace one in>] [-u <unix socket>] [-w <bulk slots>] "
+            "[-z <compress from bytes>] <port number>\n",
+            cmd);
+}
+
+/*
+ * Code executed by the signal handler thread. SIGINT and SIGTERM are
+ * blocked in every other thread, so this is the only thread that ever
+ * receives them; either one starts the same drain as the admin "x" command.
+ */
 void *monitor_signal(void *arg) {
-    // TODO: Wait for a SIGINT to be sent to the server process and cancel
-    // all client threads when one arrives.
+    sig_handler_t *sighandler = (sig_handler_t *) arg;
+    int sig;
+    while (1){
+        int err;
+        if ((err = sigwait(&sighandler->set, &sig))){
+            handle_error_en(err, "sigwait");
+        }
+        fprintf(stderr, "received signal %d, draining\n", sig);
+        server_request_stop();
+    }
     return NULL;
 }
 
+/*
+ * Creates the thread that handles SIGINT and SIGTERM. Must be called before
+ * any other thread is created so that they all inherit the blocked mask.
+ */
 sig_handler_t *sig_handler_constructor() {
-    // TODO: Create a thread to handle SIGINT. The thread that this function
-    // creates should be the ONLY thread that ever responds to SIGINT.
-    return NULL;
+    sig_handler_t *sighandler;
+    if ((sighandler = (sig_handler_t *) malloc(sizeof(sig_handler_t))) == NULL){
+        perror("malloc failed: \n");
+        exit(1);
+    }
+    sigemptyset(&sighandler->set);
+    sigaddset(&sighandler->set, SIGINT);
+    sigaddset(&sighandler->set, SIGTERM);
+    int err;
+    if ((err = pthread_sigmask(SIG_BLOCK, &sighandler->set, 0))){
+        handle_error_en(err, "pthread_sigmask");
+    }
+    if ((err = pthread_create(&sighandler->thread, 0, monitor_signal, sighandler))){
+        handle_error_en(err, "pthread_create");
+    }
+    return sighandler;
 }
 
+/*
+ * Cancels and joins the signal handler's thread and frees it.
+ */
 void sig_handler_destructor(sig_handler_t *sighandler) {
-    // TODO: Free any resources allocated in sig_handler_constructor.
-    // Cancel and join with the signal handler's thread. 
+    int err;
+    if ((err = pthread_cancel(sighandler->thread))){
+        handle_error_en(err, "pthread_cancel");
+    }
+    if ((err = pthread_join(sighandler->thread, 0))){
+        handle_error_en(err, "pthread_join");
+    }
+    free(sighandler);
 }
 
+/*
  * Main of program.
  */
 int main(int argc, char *argv[]) {
-    // Must have exactly one argument. 
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
-        exit(1);
-    }
-    // Constructs listener thread which constructs clients.
-    pthread_t server_thread = start_listener(atoi(argv[1]), &client_constructor);
-    // Buffer to store command input to server.
-    char server_command[BUFLEN];
-    ssize_t read_count;
-    memset(server_command, 0, BUFLEN);
-    while ((read_count = read(STDIN_FILENO, server_command, BUFLEN)) > 0){
-        if (server_command[0] == 'p'){
-            char* file = strtok(&server_command[1], " \t\n");
-            db_print(file);
-        } else {
-            if (strtok(&server_command[1], " \t\n")){
-                continue;
+    char admin_path[BUFLEN];
+    const char *admin_arg = NULL;
+    char *primary = NULL;
+    int bulk_slots = 1;
+    int import_queue = 16;
+    int import_workers = 0;
+    int rebalance_percent = 0;
+    long expected_keys = 0;
+    int opt;
+    comm_config_t comm_config = {0, 1024, 1, NULL};
+    while ((opt = getopt(argc, argv, "a:b:B:d:e:Fij:k:l:n:q:r:s:T:u:w:z:")) != -1){
+        switch (opt){
+        case 'a':
+            admin_arg = optarg;
+            break;
+        case 'b':
+            comm_config.backlog = atoi(optarg);
+            break;
+        case 'B':
+            rebalance_percent = atoi(optarg);
+            break;
+        case 'l':
+            comm_config.listeners = atoi(optarg);
+            break;
+        case 'r':
+            primary = optarg;
+            break;
+        case 'q':
+            import_queue = atoi(optarg);
+            break;
+        case 'j':
+            import_workers = atoi(optarg);
+            break;
+        case 'k':
+            if (num_space_args == DB_MAX_SPACES){
+                usage_error(argv[0]);
+                exit(1);
             }
-        }       
-        memset(server_command, 0, BUFLEN);
-    }
-    if (read_count < 0){
-        perror("read failure: \n");
-        exit(1);
-    } 
-    if (!read_count){
-        // Thread reaches here upon receiving EOF, in which case it increments 
-        // global below to make sure no more clients can connect to the server.
-        accepting++;
-        if (fprintf(stdout, "exiting database\n") < 0){
-            perror("fprintf failure: \n");
+            space_args[num_space_args++] = optarg;
+            break;
+        case 'u':
+            comm_config.unix_path = optarg;
+            break;
+        case 'w':
+            bulk_slots = atoi(optarg);
+            break;
+        case 'd':
+            drain_seconds = atoi(optarg);
+            break;
+        case 'e':
+            expected_keys = atol(optarg);
+            break;
+        case 'F':
+            fast_exit = 1;
+            break;
+        case 'i':
+            index_enabled = 1;
+            break;
+        case 'n':
+            numa_shards = atoi(optarg);
+            numa_placement = 1;
+            break;
+        case 's':
+            persist_file = optarg;
+            break;
+        case 'T':
+            trace_every = atoi(optarg);
+            break;
+        case 'z':
+            value_compress_min = atol(optarg);
+            break;
+        default:
+            usage_error(argv[0]);
+            exit(1);
+        }
+    }
+    // Must have exactly one positional argument.
+    if (optind != argc - 1) {
+        usage_error(argv[0]);
+        exit(1);
+    }
+    comm_config.port = atoi(argv[optind]);
+    if (admin_arg){
+        snprintf(admin_path, BUFLEN, "%s", admin_arg);
+    } else {
+        snprintf(admin_path, BUFLEN, "mtdb.%d.admin", comm_config.port);
+    }
+    // A client or admin that disconnects before reading its response must
+    // not take the whole server down with it.
+    signal(SIGPIPE, SIG_IGN);
+    // Blocks SIGINT and SIGTERM before any other thread exists.
+    sig_handler_t *sighandler = sig_handler_constructor();
+    // Every server can feed replicas, including a replica itself.
+    repl_init();
+    pubsub_init();
+    if (numa_placement){
+        db_shard(numa_shards);
+    }
+    // The keyspaces "-k" made, by their bare names rather than their limits
+    keyspace_t *spaces[DB_MAX_SPACES];
+    for (int i = 0; i < num_space_args; i++){
+        char spec[128];
+        snprintf(spec, sizeof(spec), "%s", space_args[i]);
+        char *name = strtok(spec, ":");
+        char *quota = strtok(NULL, ":");
+        char *ops = strtok(NULL, ":");
+        long quota_bytes = 0, ops_second = 0;
+        if (!name || (quota && parse_limit(quota, &quota_bytes) < 0) ||
+            (ops && parse_limit(ops, &ops_second) < 0) ||
+            !(spaces[i] = db_space_create(name, quota_bytes, ops_second))){
+            fprintf(stderr, "bad keyspace %s\n", space_args[i]);
+            exit(1);
+        }
+    }
+    sched_init(bulk_slots, import_queue, import_workers);
+    db_rebalance(rebalance_percent);
+    // The filter must count every key, so it comes before any is loaded.
+    if (expected_keys > 0 && bloom_init(expected_keys) < 0){
+        perror("bloom_init");
+        exit(1);
+    }
+    db_gc_start();
+    if (primary){
+        char *sep = strrchr(primary, ':');
+        if (!sep){
+            usage_error(argv[0]);
             exit(1);
         }
+        *sep = '\0';
+        // A replica's contents come from its primary, not from a snapshot file.
+        persist_file = NULL;
+        repl_start_replica(primary, sep + 1);
     }
-    // Removes all active clients.
-    delete_all();
-    // Must make sure that we have actually removed all clients before we clean up 
-    // database to avoid memory issues. Puts listener thread to sleep till the number 
-    // of active clients is 0.
+    if (persist_file && access(persist_file, F_OK) == 0){
+        char command[BUFLEN];
+        char response[BUFLEN];
+        snprintf(command, BUFLEN, "f %s", persist_file);
+        interpret_command(command, response, BUFLEN, NULL);
+        fprintf(stderr, "loaded %ld keys from %s\n", db_size(), persist_file);
+    }
+    // Every other keyspace comes from a file of its own, next to it.
+    for (int i = 0; persist_file && i < num_space_args; i++){
+        char command[BUFLEN];
+        char response[BUFLEN];
+        keyspace_t *space = spaces[i];
+        long before = db_size();
+        snprintf(command, BUFLEN, "f %s.%s", persist_file, db_space_name(space));
+        // The default keyspace, if named, was loaded above.
+        if (space == db_space_current() || access(&command[2], F_OK) < 0){
+            continue;
+        }
+        db_space_use(space);
+        interpret_command(command, response, BUFLEN, NULL);
+        db_space_use(NULL);
+        fprintf(stderr, "loaded %ld keys from %s\n", db_size() - before, &command[2]);
+    }
+    // Constructs listener threads which construct clients.
+    start_listener(&comm_config, &client_constructor);
+    // The admin channel replaces the old console loop on stdin.
+    pthread_t admin_thread = start_admin_listener(admin_path, &admin_serve);
     if (pthread_mutex_lock(&server_control.server_mutex)){
         perror("mutex could not be locked: \n");
         exit(1);
     }
-    while(server_control.num_client_threads){
+    while (!server_control.stopping){
         if (pthread_cond_wait(&server_control.server_cond, &server_control.server_mutex)){
             perror("pthread_cond_wait failure: \n");
             exit(1);
@@ -322,12 +1095,54 @@ int main(int argc, char *argv[]) {
         perror("mutex could not be unlocked: \n");
         exit(1);
     }
-    // Cleans up database resources after every client has been removed as desired.
-    db_cleanup();
+    if (fprintf(stdout, "exiting database\n") < 0){
+        perror("fprintf failure: \n");
+        exit(1);
+    }
+    // Stops accepting first; once the listeners have exited, every client
+    // thread that will ever exist is already counted.
+    comm_stop_listener();
     int err;
-    if (err = pthread_cancel(server_thread)){
+    // Clients stopped by the admin channel must be let go so that they
+    // can finish their command and see the drain.
+    client_control_release();
+    drain_all();
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_seconds;
+    // Imports go on after the clients that queued them have left, and get
+    // until the same deadline to finish.
+    if (wait_for_clients(&deadline) == ETIMEDOUT || sched_wait(&deadline) == ETIMEDOUT){
+        // Whatever is still running after the deadline is cancelled, as
+        // every client used to be.
+        fprintf(stderr, "drain deadline passed, cancelling clients\n");
+        sched_stop();
+        delete_all();
+        wait_for_clients(NULL);
+    }
+    sched_stop();
+    sched_wait(NULL);
+    if ((err = pthread_cancel(admin_thread))){
         handle_error_en(err, "pthread_cancel");
-    }  
+    }
+    if ((err = pthread_join(admin_thread, 0))){
+        handle_error_en(err, "pthread_join");
+    }
+    unlink(admin_path);
+    sig_handler_destructor(sighandler);
+    if (persist_file && db_snapshot(persist_file) < 0){
+        fprintf(stderr, "could not write %s\n", persist_file);
+    }
+    if (fast_exit){
+        // Nothing but the database is left, and the process is about to
+        // give all of its memory back anyway.
+        exit(0);
+    }
+    // Cleans up database resources after every client has been removed as desired.
+    db_gc_stop();
+    db_cleanup();
+    bloom_cleanup();
+    trace_cleanup();
     if (pthread_mutex_destroy(&server_control.server_mutex)){
         perror("mutex could not be destroyed: \n");
         exit(1);
@@ -340,6 +1155,7 @@ int main(int argc, char *argv[]) {
         perror("condition could not be destroyed: \n");
         exit(1);
     }
-
-    pthread_exit(0);
+    // The import threads and the watch dispatcher wait for work for as long
+    // as the process lives, so returning ends them too.
+    return 0;
 }
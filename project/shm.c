@@ -0,0 +1,259 @@
+#include "./shm.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Shared-memory transport for clients on the same host as the server */
+
+// How many times a waiting side polls the ring before going to sleep.
+#define SHM_SPINS 4000
+
+// SHM_SPINS on multiprocessors; spinning on a single CPU only delays the peer.
+static int shm_spins = -1;
+
+// How long a sleeping side waits before checking that its peer is alive.
+#define SHM_CHECK_NSEC 50000000
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* The region is shared between processes, so these are not the
+ * FUTEX_PRIVATE_FLAG variants. */
+static void futex_wait(uint32_t *word, uint32_t seen) {
+    struct timespec timeout = {0, SHM_CHECK_NSEC};
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Returns 1 if the socket that pairs with a region shows that the peer
+ * closed it or shut it down. No data is ever sent on it once the region
+ * is in use, so readable means gone. */
+static int peer_gone(int sock) {
+    struct pollfd pfd = {sock, POLLIN | POLLRDHUP, 0};
+    if (poll(&pfd, 1, 0) < 0) {
+        return errno != EINTR;
+    }
+    return pfd.revents != 0;
+}
+
+/* Waits until *word no longer holds seen. Spins first, since a co-located
+ * peer usually answers within a few microseconds, then sleeps on the futex
+ * with *waiting raised so that the other side knows to wake us.
+ * Returns 0 once *word changed, -1 if the peer went away. */
+static int shm_wait(uint32_t *word, uint32_t seen, uint32_t *waiting, int sock) {
+    int spins = __atomic_load_n(&shm_spins, __ATOMIC_RELAXED);
+    if (spins < 0) {
+        spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPINS : 0;
+        __atomic_store_n(&shm_spins, spins, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < spins; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen) {
+            return 0;
+        }
+        cpu_relax();
+    }
+    while (1) {
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != seen) {
+            break;
+        }
+        futex_wait(word, seen);
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen) {
+            break;
+        }
+        if (peer_gone(sock)) {
+            __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Publishes a new value of *word and wakes the other side if it said it
+ * was going to sleep. Pairs with the store/load order in shm_wait. */
+static void shm_publish(uint32_t *word, uint32_t value, uint32_t *waiting) {
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(word);
+    }
+}
+
+int shm_send(shm_ring_t *ring, const char *msg, size_t len, int sock) {
+    do {
+        uint32_t head = ring->head;
+        uint32_t tail;
+        while (head - (tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == SHM_SLOTS) {
+            if (shm_wait(&ring->tail, tail, &ring->producer_waiting, sock) < 0) {
+                return -1;
+            }
+        }
+        size_t n = len > SHM_SLOTLEN ? SHM_SLOTLEN : len;
+        int i = head % SHM_SLOTS;
+        memcpy(ring->slot[i].data, msg, n);
+        ring->slot[i].len = n | (len > n ? SHM_MORE : 0);
+        shm_publish(&ring->head, head + 1, &ring->consumer_waiting);
+        msg += n;
+        len -= n;
+    } while (len > 0);
+    return 0;
+}
+
+long shm_recv(shm_ring_t *ring, char **buf, size_t *cap, size_t max, int sock) {
+    size_t len = 0;
+    int overlong = 0;
+    uint32_t more;
+    do {
+        uint32_t tail = ring->tail;
+        if (shm_wait(&ring->head, tail, &ring->consumer_waiting, sock) < 0) {
+            return -1;
+        }
+        int i = tail % SHM_SLOTS;
+        uint32_t n = ring->slot[i].len;
+        more = n & SHM_MORE;
+        n &= ~SHM_MORE;
+        if (n > SHM_SLOTLEN) {
+            n = SHM_SLOTLEN;  // Never trust lengths written by the other side
+        }
+        if (len + n > max) {
+            overlong = 1;
+        }
+        if (!overlong && len + n + 1 > *cap) {
+            size_t grown_cap = *cap ? *cap : SHM_SLOTLEN + 1;
+            while (grown_cap < len + n + 1) {
+                grown_cap *= 2;
+            }
+            char *grown;
+            if ((grown = realloc(*buf, grown_cap)) == NULL) {
+                return -1;
+            }
+            *buf = grown;
+            *cap = grown_cap;
+        }
+        if (!overlong) {
+            memcpy(*buf + len, ring->slot[i].data, n);
+            len += n;
+        }
+        shm_publish(&ring->tail, tail + 1, &ring->producer_waiting);
+    } while (more);
+    if (overlong) {
+        len = 0;
+    }
+    if (*cap == 0) {
+        if ((*buf = malloc(1)) == NULL) {
+            return -1;
+        }
+        *cap = 1;
+    }
+    (*buf)[len] = '\0';
+    return len;
+}
+
+shm_region_t *shm_offer(int sock) {
+    int fd;
+    if ((fd = memfd_create("mtdb-shm", MFD_CLOEXEC)) < 0) {
+        perror("memfd_create");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(shm_region_t)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    shm_region_t *region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+
+    // The descriptor travels as SCM_RIGHTS ancillary data on the line
+    // that answers the client's "shm" request.
+    char line[32];
+    int n = snprintf(line, sizeof(line), "shm %zu\n", sizeof(shm_region_t));
+    struct iovec iov = {line, n};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != n) {
+        perror("sendmsg");
+        munmap(region, sizeof(shm_region_t));
+        close(fd);
+        return NULL;
+    }
+    // The mapping keeps the memory alive; the client has its own descriptor.
+    close(fd);
+    return region;
+}
+
+shm_region_t *shm_accept(int sock) {
+    char line[32];
+    struct iovec iov = {line, sizeof(line) - 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    if ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+        perror("recvmsg");
+        return NULL;
+    }
+    line[n] = '\0';
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    size_t size;
+    if (sscanf(line, "shm %zu", &size) != 1 || size != sizeof(shm_region_t) ||
+        cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "server refused shared memory: %s", line);
+        return NULL;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    shm_region_t *region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return region;
+}
+
+void shm_close(shm_region_t *region) {
+    if (munmap(region, sizeof(shm_region_t)) < 0) perror("munmap");
+}
@@ -0,0 +1,76 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_SLOTS 16
+#define SHM_SLOTLEN 4096
+
+// Set in a slot's len when the message continues in the next slot.
+#define SHM_MORE 0x80000000u
+
+/*
+ * A single-producer single-consumer ring of fixed-size message slots.
+ * A message longer than a slot spans several, all but the last of them
+ * marked SHM_MORE.
+ * head and tail count messages ever produced and consumed; each sits on
+ * its own cache line and doubles as the futex word the other side sleeps on.
+ */
+typedef struct shm_ring {
+    uint32_t head;
+    uint32_t consumer_waiting;  // Consumer is (about to be) asleep on head
+    char pad1[56];
+    uint32_t tail;
+    uint32_t producer_waiting;  // Producer is (about to be) asleep on tail
+    char pad2[56];
+    struct {
+        uint32_t len;
+        char data[SHM_SLOTLEN];
+    } slot[SHM_SLOTS];
+} shm_ring_t;
+
+/*
+ * The shared region of one co-located client: requests flow from the
+ * client to the server on req, responses come back on resp.
+ */
+typedef struct shm_region {
+    shm_ring_t req;
+    shm_ring_t resp;
+} shm_region_t;
+
+/**
+  * shm_offer() creates a region in a memfd, maps it and passes the descriptor to the
+  * client over the Unix domain socket sock, along with a "shm <size>" line.
+  * Returns the mapped region, or NULL on failure.
+  */
+shm_region_t *shm_offer(int sock);
+
+/**
+  * shm_accept() receives the descriptor sent by shm_offer() on sock and maps the region.
+  * Returns the mapped region, or NULL on failure.
+  */
+shm_region_t *shm_accept(int sock);
+
+/**
+  * shm_close() unmaps a region returned by shm_offer() or shm_accept().
+  */
+void shm_close(shm_region_t *region);
+
+/**
+  * shm_send() copies len bytes of msg into as many slots of ring as it takes, waiting
+  * while the ring is full.
+  * Returns 0 on success, or -1 if the peer on sock went away while waiting.
+  */
+int shm_send(shm_ring_t *ring, const char *msg, size_t len, int sock);
+
+/**
+  * shm_recv() copies the next message of ring into *buf as a string, spinning briefly
+  * and then sleeping on a futex until one arrives. *buf is grown with realloc as needed
+  * and must be freed by the caller. A message longer than max bytes is consumed and
+  * comes back empty.
+  * Returns the message length, or -1 if the peer on sock went away while waiting.
+  */
+long shm_recv(shm_ring_t *ring, char **buf, size_t *cap, size_t max, int sock);
+
+#endif  // SHM_H_
@@ -0,0 +1,339 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "./trace.h"
+
+int trace_every;
+
+// Stages kept per ring, a power of two; older ones are overwritten.
+#define TRACE_RING 4096
+
+// Stages nested deeper than this are not recorded.
+#define TRACE_DEPTH 8
+
+// Distinct nestings of stages told apart in folded output
+#define TRACE_PATHS 256
+
+static const char *stage_names[TRACE_STAGES] = {
+    "command", "read", "sched", "interpret", "parse", "query",
+    "add", "remove", "commit", "lock_wait", "send",
+};
+
+/*
+ * A stage of a sampled command, as recorded once it ended. Its path holds
+ * the stages it is nested in and its own, outermost first, four bits each
+ * and numbered from 1.
+ */
+typedef struct trace_span {
+    uint64_t start;  // Time-stamp counter when the stage began
+    uint64_t ticks;  // And how long it took
+    uint32_t path;
+    uint32_t command;  // Sampled command of the thread it belongs to
+} trace_span_t;
+
+/*
+ * The ring of a client thread. Only the thread that holds it writes to it;
+ * trace_write() reads it without locks and drops what was overwritten while
+ * it read. A thread gives its ring back as it exits, and the next thread
+ * to trace takes it over, so the stages of gone connections are kept until
+ * they are overwritten.
+ */
+typedef struct trace_ring {
+    int id;
+    int in_use;
+    unsigned long head;  // Stages recorded so far
+    unsigned long sampled;  // Commands sampled so far
+    // The command under way, private to the thread
+    int sampling;
+    int countdown;  // Commands until the next sampled one
+    int depth;
+    trace_stage_t stack[TRACE_DEPTH];
+    uint64_t begun[TRACE_DEPTH];
+    // Stages recorded and their time, for trace_stats()
+    unsigned long count[TRACE_STAGES];
+    unsigned long ticks[TRACE_STAGES];
+    struct trace_ring *next;
+    trace_span_t spans[TRACE_RING];
+} trace_ring_t;
+
+static trace_ring_t *rings;
+static int num_rings;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t *my_ring;
+
+// Taken together when tracing starts, to turn ticks into nanoseconds.
+static uint64_t base_ticks;
+static double base_ns;
+
+static uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Nanoseconds per tick, as measured since tracing started. */
+static double ns_per_tick(void) {
+    uint64_t ticks = trace_clock() - base_ticks;
+    double ns = monotonic_ns() - base_ns;
+    return ticks > 0 ? ns / ticks : 1;
+}
+
+static void trace_init(void) {
+    base_ticks = trace_clock();
+    base_ns = monotonic_ns();
+}
+
+/* Returns the calling thread's ring, taking a free one or making one. */
+static trace_ring_t *ring_get(void) {
+    trace_ring_t *ring;
+    pthread_once(&trace_once, trace_init);
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &free, 1, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+    if (ring == NULL) {
+        if ((ring = calloc(1, sizeof(trace_ring_t))) == NULL)
+            return NULL;
+        ring->in_use = 1;
+        ring->id = __atomic_add_fetch(&num_rings, 1, __ATOMIC_RELAXED);
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+    ring->countdown = trace_every;
+    my_ring = ring;
+    return ring;
+}
+
+void trace_command(void) {
+    trace_ring_t *ring = my_ring;
+    if (trace_every <= 0)
+        return;
+    if (ring == NULL && (ring = ring_get()) == NULL)
+        return;
+    if (ring->sampling) {
+        while (ring->depth > 0)
+            trace_end(ring->depth <= TRACE_DEPTH ? ring->stack[ring->depth - 1] : TRACE_COMMAND);
+        ring->sampling = 0;
+    }
+    if (--ring->countdown > 0)
+        return;
+    ring->countdown = trace_every;
+    ring->sampling = 1;
+    __atomic_store_n(&ring->sampled, ring->sampled + 1, __ATOMIC_RELAXED);
+    trace_begin(TRACE_COMMAND);
+}
+
+void trace_thread_exit(void) {
+    trace_ring_t *ring = my_ring;
+    if (ring == NULL)
+        return;
+    ring->sampling = 0;
+    ring->depth = 0;
+    my_ring = NULL;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+int trace_sampling(void) {
+    return my_ring && my_ring->sampling;
+}
+
+void trace_begin(trace_stage_t stage) {
+    trace_ring_t *ring = my_ring;
+    if (ring == NULL || !ring->sampling)
+        return;
+    if (ring->depth < TRACE_DEPTH) {
+        ring->stack[ring->depth] = stage;
+        ring->begun[ring->depth] = trace_clock();
+    }
+    ring->depth++;
+}
+
+void trace_end(trace_stage_t stage) {
+    trace_ring_t *ring = my_ring;
+    if (ring == NULL || !ring->sampling || ring->depth == 0)
+        return;
+    int depth = --ring->depth;
+    if (depth >= TRACE_DEPTH)
+        return;
+    assert(ring->stack[depth] == stage);
+    uint64_t ticks = trace_clock() - ring->begun[depth];
+    uint32_t path = 0;
+    for (int i = 0; i <= depth; i++)
+        path = path << 4 | (ring->stack[i] + 1);
+    // The stage goes in before head moves past it; a reader that sees the
+    // new head sees the stage too.
+    trace_span_t *span = &ring->spans[ring->head & (TRACE_RING - 1)];
+    __atomic_store_n(&span->start, ring->begun[depth], __ATOMIC_RELAXED);
+    __atomic_store_n(&span->ticks, ticks, __ATOMIC_RELAXED);
+    __atomic_store_n(&span->path, path, __ATOMIC_RELAXED);
+    __atomic_store_n(&span->command, (uint32_t)ring->sampled, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->count[stage], ring->count[stage] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->ticks[stage], ring->ticks[stage] + ticks, __ATOMIC_RELAXED);
+}
+
+/* Copies the stages of ring that are not being overwritten into spans, which
+ * has room for TRACE_RING, oldest first. Returns how many there are. */
+static int ring_copy(trace_ring_t *ring, trace_span_t *spans) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long first = head > TRACE_RING ? head - TRACE_RING : 0;
+    for (unsigned long i = first; i < head; i++) {
+        trace_span_t *span = &ring->spans[i & (TRACE_RING - 1)];
+        trace_span_t *copy = &spans[i - first];
+        // Acquire keeps the second look at head below after these loads.
+        copy->start = __atomic_load_n(&span->start, __ATOMIC_ACQUIRE);
+        copy->ticks = __atomic_load_n(&span->ticks, __ATOMIC_ACQUIRE);
+        copy->path = __atomic_load_n(&span->path, __ATOMIC_ACQUIRE);
+        copy->command = __atomic_load_n(&span->command, __ATOMIC_ACQUIRE);
+    }
+    // The thread may have gone on recording meanwhile; what it recorded
+    // over, or may be recording over now, was torn and goes.
+    unsigned long now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+    unsigned long torn = now > TRACE_RING ? now - TRACE_RING : 0;
+    if (torn <= first)
+        return head - first;
+    if (torn >= head)
+        return 0;
+    memmove(spans, spans + (torn - first), (head - torn) * sizeof(trace_span_t));
+    return head - torn;
+}
+
+/* Writes the names of the stages in path to out, separated by sep. */
+static void write_path(FILE *out, uint32_t path, char sep) {
+    int shift = 28;
+    while (shift > 0 && (path >> shift) == 0)
+        shift -= 4;
+    for (; shift >= 0; shift -= 4) {
+        fprintf(out, "%s", stage_names[((path >> shift) & 15) - 1]);
+        if (shift > 0)
+            fputc(sep, out);
+    }
+}
+
+long trace_write(FILE *out, int folded) {
+    trace_span_t *spans = malloc(sizeof(trace_span_t) * TRACE_RING);
+    uint32_t paths[TRACE_PATHS];
+    double self_ns[TRACE_PATHS];
+    int num_paths = 0;
+    long written = 0;
+    trace_ring_t *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    if (spans == NULL)
+        return -1;
+    double scale = first ? ns_per_tick() : 1;
+    if (!folded)
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (trace_ring_t *ring = first; ring; ring = ring->next) {
+        int n = ring_copy(ring, spans);
+        if (!folded) {
+            fprintf(out,
+                    "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"name\":\"client thread %d\"}}",
+                    ring != first ? ",\n" : "", ring->id, ring->id);
+        }
+        for (int i = 0; i < n; i++) {
+            trace_span_t *span = &spans[i];
+            double ns = span->ticks * scale;
+            written++;
+            if (!folded) {
+                double ts = (int64_t)(span->start - base_ticks) * scale;
+                fprintf(out, ",\n{\"name\":\"");
+                write_path(out, span->path & 15, ';');
+                fprintf(out,
+                        "\",\"cat\":\"mtdb\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"command\":%u}}",
+                        ring->id, ts / 1000, ns / 1000, span->command);
+                continue;
+            }
+            // A stage's time is its own less that of the stages nested in it.
+            for (uint32_t path = span->path; path; path >>= 4) {
+                int p = 0;
+                while (p < num_paths && paths[p] != path)
+                    p++;
+                if (p == num_paths) {
+                    if (num_paths == TRACE_PATHS)
+                        break;
+                    paths[num_paths] = path;
+                    self_ns[num_paths++] = 0;
+                }
+                self_ns[p] += path == span->path ? ns : -ns;
+                if (path != span->path)
+                    break;
+            }
+        }
+    }
+    if (folded) {
+        for (int p = 0; p < num_paths; p++) {
+            // A command still under way has its nested stages recorded
+            // but not yet itself.
+            if (self_ns[p] < 1)
+                continue;
+            write_path(out, paths[p], ';');
+            fprintf(out, " %.0f\n", self_ns[p]);
+        }
+    } else {
+        fprintf(out, "\n]}\n");
+    }
+    free(spans);
+    return written;
+}
+
+void trace_stats(char *buf, int len) {
+    unsigned long sampled = 0, spans = 0, lost = 0;
+    unsigned long count[TRACE_STAGES] = {0};
+    unsigned long ticks[TRACE_STAGES] = {0};
+    trace_ring_t *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    // The clock was calibrated before the first ring was made.
+    double scale = first ? ns_per_tick() : 1;
+    for (trace_ring_t *ring = first; ring; ring = ring->next) {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        sampled += __atomic_load_n(&ring->sampled, __ATOMIC_RELAXED);
+        spans += head;
+        lost += head > TRACE_RING ? head - TRACE_RING : 0;
+        for (int s = 0; s < TRACE_STAGES; s++) {
+            count[s] += __atomic_load_n(&ring->count[s], __ATOMIC_RELAXED);
+            ticks[s] += __atomic_load_n(&ring->ticks[s], __ATOMIC_RELAXED);
+        }
+    }
+    int n = snprintf(buf, len, "trace_every=%d trace_sampled=%lu trace_spans=%lu "
+                     "trace_overwritten=%lu trace_rings=%d ", trace_every, sampled, spans, lost,
+                     __atomic_load_n(&num_rings, __ATOMIC_RELAXED));
+    // Average microseconds of every stage seen
+    for (int s = 0; s < TRACE_STAGES && n < len; s++) {
+        if (count[s] > 0) {
+            n += snprintf(buf + n, len - n, "trace_%s_us=%.2f ", stage_names[s],
+                          ticks[s] * scale / count[s] / 1000);
+        }
+    }
+}
+
+void trace_cleanup(void) {
+    trace_ring_t *ring = rings;
+    while (ring) {
+        trace_ring_t *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    rings = NULL;
+    num_rings = 0;
+}
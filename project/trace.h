@@ -0,0 +1,82 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+
+/*
+ * Latency tracing of client commands. One command in every trace_every a
+ * client thread reads is sampled: each stage it goes through is timed with
+ * the CPU's time-stamp counter and recorded, once it ends, into a ring of
+ * the thread's own that the thread alone writes and nothing locks. Other
+ * commands pay for a check of a thread-local flag at each stage. The admin
+ * channel writes the rings out as a Chrome trace or as folded stacks for
+ * flame graphs.
+ */
+
+// Stages of a command, nested as listed
+typedef enum trace_stage {
+    TRACE_COMMAND,  // From reading the command to sending its response
+    TRACE_READ,  // Waiting for and reading the command line
+    TRACE_SCHED,  // Waiting for the scheduler to let it into the database
+    TRACE_INTERPRET,  // interpret_command() or txn_interpret()
+    TRACE_PARSE,  // Splitting the line into its words, before TRACE_SCHED for clients
+    TRACE_QUERY,  // db_query() or txn_query()
+    TRACE_ADD,  // db_add() or txn_add()
+    TRACE_REMOVE,  // db_remove() or txn_remove()
+    TRACE_COMMIT,  // txn_commit()
+    TRACE_LOCK_WAIT,  // Blocked on a node's lock
+    TRACE_SEND,  // Writing and flushing the response
+    TRACE_STAGES
+} trace_stage_t;
+
+// Sample one command in this many, 0 for none. Set before clients connect.
+extern int trace_every;
+
+/**
+  * trace_command() ends the calling thread's sampled command, if any, and decides whether
+  * the command it reads next is sampled. Client threads call it before reading each command.
+  */
+void trace_command(void);
+
+/**
+  * trace_thread_exit() hands the calling thread's ring to the next thread that traces. Client
+  * threads call it as they exit.
+  */
+void trace_thread_exit(void);
+
+/**
+  * trace_begin() and trace_end() bracket a stage of the calling thread's command. They do
+  * nothing unless the command is sampled. Stages nest; each trace_end() closes the stage
+  * begun last, which must be stage.
+  */
+void trace_begin(trace_stage_t stage);
+void trace_end(trace_stage_t stage);
+
+/**
+  * trace_sampling() returns 1 if the calling thread's current command is sampled.
+  */
+int trace_sampling(void);
+
+/**
+  * trace_write() writes the stages recorded in every thread's ring to out. With folded set it
+  * writes one line per distinct nesting of stages, "command;interpret;query 1234", with the
+  * nanoseconds spent in the last of them and not in a stage nested in it, as flamegraph.pl
+  * reads them; otherwise a Chrome trace, a JSON object of complete events in microseconds,
+  * with one row per thread, that chrome://tracing and Perfetto open. Returns the number of
+  * stages written.
+  */
+long trace_write(FILE *out, int folded);
+
+/**
+  * trace_stats() writes the tracing counters and the average time of each stage of the
+  * sampled commands as space-separated key=value pairs into buf.
+  */
+void trace_stats(char *buf, int len);
+
+/**
+  * trace_cleanup() frees the rings. Every thread that traced must have called
+  * trace_thread_exit() by then.
+  */
+void trace_cleanup(void);
+
+#endif  // TRACE_H_
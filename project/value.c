@@ -0,0 +1,290 @@
+#include "./value.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "./lz.h"
+
+/* Reference-counted values, with the large ones kept apart in slabs */
+
+// Bytes mapped at a time for one large-value class.
+#define SLAB_BYTES (1 << 20)
+
+// Freed objects at least this big give their pages back to the kernel.
+#define SLAB_RELEASE_BYTES (64 << 10)
+
+#define MAX_CLASSES 48
+
+/*
+ * Large values are carved out of slabs of their own, one size class per
+ * step of a quarter, instead of coming from malloc. Keeping them out of
+ * the heap that holds tree nodes and keys means a few megabytes of blobs
+ * never end up interleaved with the nodes a search walks through.
+ */
+typedef struct free_obj {
+    struct free_obj *next;
+} free_obj_t;
+
+typedef struct slab_class {
+    pthread_mutex_t mutex;
+    size_t size;  // Bytes per object, header included
+    free_obj_t *free;
+    char *fresh;  // Unused tail of the newest slab
+    size_t fresh_left;
+} slab_class_t;
+
+static slab_class_t classes[MAX_CLASSES];
+static int num_classes;
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+static unsigned long slab_bytes;  // Mapped for all classes
+static unsigned long large_values;  // Live large values
+static unsigned long large_bytes;  // Their lengths added up
+
+size_t value_compress_min;
+
+/*
+ * Compression counters. The live ones describe the compressed values
+ * currently held; the CPU times are thread CPU time spent compressing
+ * values as they are added and inflating them for readers that cannot
+ * take them compressed.
+ */
+static struct {
+    unsigned long live;  // Compressed values held
+    unsigned long live_raw;  // Their uncompressed lengths added up
+    unsigned long live_stored;  // Their compressed lengths added up
+    unsigned long attempts;  // Values that were tried
+    unsigned long compress_ns;
+    unsigned long inflations;
+    unsigned long inflate_ns;
+    unsigned long passthrough;  // Sent compressed to clients that accept it
+    unsigned long passthrough_saved;  // Bytes those did not send
+} zstats;
+
+static unsigned long thread_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void init_classes(void) {
+    size_t size = (sizeof(value_t) + VALUE_LARGE + 1 + 63) & ~(size_t)63;
+    while (num_classes < MAX_CLASSES) {
+        if (pthread_mutex_init(&classes[num_classes].mutex, 0)) {
+            perror("could not initialize mutex");
+            exit(1);
+        }
+        classes[num_classes++].size = size;
+        if (size >= sizeof(value_t) + MAX_VALUELEN + 1) {
+            break;
+        }
+        size = (size + size / 4 + 63) & ~(size_t)63;
+    }
+}
+
+static void *slab_alloc(slab_class_t *sc) {
+    void *obj;
+    if (pthread_mutex_lock(&sc->mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    if (sc->free) {
+        obj = sc->free;
+        sc->free = sc->free->next;
+    } else {
+        if (sc->fresh_left < sc->size) {
+            size_t bytes = sc->size > SLAB_BYTES ? sc->size : SLAB_BYTES;
+            char *slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (slab == MAP_FAILED) {
+                pthread_mutex_unlock(&sc->mutex);
+                return NULL;
+            }
+            sc->fresh = slab;
+            sc->fresh_left = bytes;
+            __atomic_fetch_add(&slab_bytes, bytes, __ATOMIC_RELAXED);
+        }
+        obj = sc->fresh;
+        sc->fresh += sc->size;
+        sc->fresh_left -= sc->size;
+    }
+    if (pthread_mutex_unlock(&sc->mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+    return obj;
+}
+
+static void slab_free(slab_class_t *sc, void *obj) {
+    if (sc->size >= SLAB_RELEASE_BYTES) {
+        // Keep the page holding the free list link, drop the rest.
+        size_t page = sysconf(_SC_PAGESIZE);
+        char *start = (char *)(((unsigned long)obj + page) & ~(page - 1));
+        char *end = (char *)(((unsigned long)obj + sc->size) & ~(page - 1));
+        if (end > start && madvise(start, end - start, MADV_DONTNEED) < 0) {
+            perror("madvise");
+        }
+    }
+    if (pthread_mutex_lock(&sc->mutex)) {
+        perror("mutex could not be locked: \n");
+        exit(1);
+    }
+    ((free_obj_t *)obj)->next = sc->free;
+    sc->free = obj;
+    if (pthread_mutex_unlock(&sc->mutex)) {
+        perror("mutex could not be unlocked: \n");
+        exit(1);
+    }
+}
+
+/* Allocates a value with room for len bytes of data and one reference. */
+static value_t *value_alloc(size_t len) {
+    value_t *value;
+    if (len < VALUE_LARGE) {
+        if ((value = malloc(sizeof(value_t) + len + 1)) == NULL) {
+            return NULL;
+        }
+        value->large = 0;
+    } else {
+        pthread_once(&classes_once, init_classes);
+        int c = 0;
+        while (classes[c].size < sizeof(value_t) + len + 1) {
+            c++;
+        }
+        if ((value = slab_alloc(&classes[c])) == NULL) {
+            return NULL;
+        }
+        value->large = 1;
+        value->sclass = c;
+        __atomic_fetch_add(&large_values, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&large_bytes, len, __ATOMIC_RELAXED);
+    }
+    value->refs = 1;
+    value->compressed = 0;
+    value->len = len;
+    value->raw_len = len;
+    value->data[len] = '\0';
+    return value;
+}
+
+/* Compresses data into a new value. Returns NULL if that does not save an
+ * eighth of the length, or memory ran out. */
+static value_t *value_compress(const char *data, size_t len) {
+    value_t *value = NULL;
+    size_t cap = len - len / 8;
+    char *buf;
+    if ((buf = malloc(cap)) == NULL) {
+        return NULL;
+    }
+    unsigned long start = thread_ns();
+    size_t clen = lz_compress(data, len, buf, cap);
+    __atomic_fetch_add(&zstats.compress_ns, thread_ns() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zstats.attempts, 1, __ATOMIC_RELAXED);
+    if (clen > 0 && (value = value_alloc(clen)) != NULL) {
+        memcpy(value->data, buf, clen);
+        value->compressed = 1;
+        value->raw_len = len;
+        __atomic_fetch_add(&zstats.live, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&zstats.live_raw, len, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&zstats.live_stored, clen, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return value;
+}
+
+value_t *value_create(const char *data, size_t len) {
+    value_t *value;
+    if (len > MAX_VALUELEN) {
+        return NULL;
+    }
+    size_t min = __atomic_load_n(&value_compress_min, __ATOMIC_RELAXED);
+    if (min > 0 && len >= min && (value = value_compress(data, len)) != NULL) {
+        return value;
+    }
+    if ((value = value_alloc(len)) == NULL) {
+        return NULL;
+    }
+    memcpy(value->data, data, len);
+    return value;
+}
+
+value_t *value_inflate(value_t *value) {
+    value_t *plain;
+    if (!value->compressed) {
+        return value_ref(value);
+    }
+    if ((plain = value_alloc(value->raw_len)) == NULL) {
+        return NULL;
+    }
+    unsigned long start = thread_ns();
+    long n = lz_decompress(value->data, value->len, plain->data, plain->len);
+    __atomic_fetch_add(&zstats.inflate_ns, thread_ns() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zstats.inflations, 1, __ATOMIC_RELAXED);
+    if (n != (long)plain->len) {
+        value_release(plain);
+        return NULL;
+    }
+    return plain;
+}
+
+int value_write(value_t *value, FILE *out) {
+    value_t *plain;
+    if ((plain = value_inflate(value)) == NULL) {
+        return -1;
+    }
+    int ret = fwrite(plain->data, 1, plain->len, out) == plain->len ? 0 : -1;
+    value_release(plain);
+    return ret;
+}
+
+void value_sent_compressed(const value_t *value) {
+    __atomic_fetch_add(&zstats.passthrough, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&zstats.passthrough_saved, value->raw_len - value->len,
+                       __ATOMIC_RELAXED);
+}
+
+value_t *value_ref(value_t *value) {
+    __atomic_fetch_add(&value->refs, 1, __ATOMIC_RELAXED);
+    return value;
+}
+
+void value_release(value_t *value) {
+    if (value == NULL || __atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (value->compressed) {
+        __atomic_fetch_sub(&zstats.live, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&zstats.live_raw, value->raw_len, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&zstats.live_stored, value->len, __ATOMIC_RELAXED);
+    }
+    if (!value->large) {
+        free(value);
+        return;
+    }
+    __atomic_fetch_sub(&large_values, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&large_bytes, value->len, __ATOMIC_RELAXED);
+    slab_free(&classes[value->sclass], value);
+}
+
+void value_stats(char *buf, int len) {
+    unsigned long live_raw = __atomic_load_n(&zstats.live_raw, __ATOMIC_RELAXED);
+    unsigned long live_stored = __atomic_load_n(&zstats.live_stored, __ATOMIC_RELAXED);
+    snprintf(buf, len,
+             "large_values=%lu large_bytes=%lu slab_bytes=%lu compress_tries=%lu compressed=%lu "
+             "compress_ratio=%.2f compress_cpu_ms=%.1f inflations=%lu inflate_cpu_ms=%.1f "
+             "passthrough=%lu passthrough_saved=%lu",
+             __atomic_load_n(&large_values, __ATOMIC_RELAXED),
+             __atomic_load_n(&large_bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED),
+             __atomic_load_n(&zstats.attempts, __ATOMIC_RELAXED),
+             __atomic_load_n(&zstats.live, __ATOMIC_RELAXED),
+             live_stored ? (double)live_raw / live_stored : 1.0,
+             __atomic_load_n(&zstats.compress_ns, __ATOMIC_RELAXED) / 1e6,
+             __atomic_load_n(&zstats.inflations, __ATOMIC_RELAXED),
+             __atomic_load_n(&zstats.inflate_ns, __ATOMIC_RELAXED) / 1e6,
+             __atomic_load_n(&zstats.passthrough, __ATOMIC_RELAXED),
+             __atomic_load_n(&zstats.passthrough_saved, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,81 @@
+#ifndef VALUE_H_
+#define VALUE_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Limits on what a client may store; a command line holds one key and one value.
+// Built with FIXED_KEYS, the tree holds keys as integers (see db.h), and only short ones.
+#ifdef FIXED_KEYS
+#define MAX_KEYLEN 16
+#else
+#define MAX_KEYLEN 4096
+#endif
+#define MAX_VALUELEN (1 << 20)
+
+// Values of at least this many bytes come from the large-value slabs.
+#define VALUE_LARGE 4096
+
+/*
+ * A stored value. Values are immutable once created and reference-counted,
+ * so a query can hand one to the connection that streams it out while the
+ * node holding it is changed or removed in the meantime.
+ */
+typedef struct value {
+    int refs;
+    unsigned char large;  // Allocated from a large-value slab class
+    unsigned char sclass;  // Which one
+    unsigned char compressed;  // data holds the value compressed by lz_compress()
+    size_t len;  // Bytes in data
+    size_t raw_len;  // Bytes of the value itself; len unless compressed
+    char data[];  // len bytes followed by a NUL
+} value_t;
+
+/**
+  * Values of at least this many bytes are compressed by value_create(), when that makes
+  * them at least an eighth smaller. 0, the default, turns compression off.
+  */
+extern size_t value_compress_min;
+
+/**
+  * value_create() copies len bytes of data, compressed if value_compress_min says so,
+  * into a new value holding one reference.
+  * Returns the value, or NULL if len is too long or memory ran out.
+  */
+value_t *value_create(const char *data, size_t len);
+
+/**
+  * value_inflate() returns a reference to the uncompressed form of value: value itself if
+  * it is not compressed, or else a new value decompressed from it.
+  * Returns NULL if memory ran out or value does not decompress.
+  */
+value_t *value_inflate(value_t *value);
+
+/**
+  * value_write() writes the uncompressed bytes of value to out.
+  * Returns 0 on success, or -1 on failure.
+  */
+int value_write(value_t *value, FILE *out);
+
+/**
+  * value_sent_compressed() records that value went to a client still compressed.
+  */
+void value_sent_compressed(const value_t *value);
+
+/**
+  * value_ref() takes another reference to value and returns it.
+  */
+value_t *value_ref(value_t *value);
+
+/**
+  * value_release() drops a reference, freeing the value with the last one. Accepts NULL.
+  */
+void value_release(value_t *value);
+
+/**
+  * value_stats() writes the large-value slab and compression counters as key=value pairs
+  * into buf.
+  */
+void value_stats(char *buf, int len);
+
+#endif  // VALUE_H_